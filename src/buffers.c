@@ -0,0 +1,248 @@
+#include "buffers.h"
+#include "utils.h"
+
+#ifdef G_OS_UNIX
+#include <glib/gstdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Pixel buffers are taken from a pool of 128-byte aligned blocks so that
+// repeated loads and saves in one process (batch loads, the resident
+// extension) reuse memory instead of returning it to the system and faulting
+// it in again for the next image. Requests are rounded up to size classes
+// spaced a quarter power of two apart, which bounds the waste to 25%. Freed
+// blocks are kept until their total size exceeds the pool cap, set with
+// GIMP_JXR_BUFFER_POOL (256M by default, 0 disables pooling).
+//
+// If GIMP_JXR_RAM_BUDGET is set and a request would push the buffers in use
+// beyond it, the buffer is instead backed by a memory-mapped temporary file
+// (in GIMP_JXR_SCRATCH_DIR or the system temporary directory), so that very
+// large images are paged to that file rather than to swap.
+
+#define BUFFER_ALIGNMENT    128
+#define MIN_POOLED_SIZE     (256 * 1024)
+
+typedef struct
+{
+    guchar*     buffer;
+    gsize       size;
+    gboolean    mapped;
+} BufferInfo;
+
+static GMutex       pool_mutex;
+static GHashTable*  allocated = NULL;   // buffer -> BufferInfo
+static GQueue       idle = G_QUEUE_INIT;
+static guint64      idle_size = 0;
+static guint64      live_size = 0;
+static guint64      pool_cap;
+static guint64      ram_budget;
+
+static gsize get_size_class(gsize size);
+static void init_pool();
+static void free_oldest_idle();
+static ERR alloc_mapped(guchar** buffer, gsize size);
+static void free_buffer(BufferInfo* info);
+
+ERR buffer_alloc(guchar** buffer, guint64 size)
+{
+    ERR             err = WMP_errSuccess;
+    gsize           size_class;
+    GList*          link;
+    BufferInfo*     info = NULL;
+    gboolean        use_scratch;
+
+    *buffer = NULL;
+
+    FailIf(size > G_MAXSIZE / 2, WMP_errOutOfMemory);
+
+    size_class = get_size_class((gsize)size);
+
+    g_mutex_lock(&pool_mutex);
+
+    init_pool();
+
+    use_scratch = live_size + size_class > ram_budget;
+
+    if (!use_scratch)
+    {
+        for (link = idle.head; link != NULL; link = link->next)
+        {
+            if (((BufferInfo*)link->data)->size == size_class)
+            {
+                info = (BufferInfo*)link->data;
+                g_queue_delete_link(&idle, link);
+                idle_size -= size_class;
+                break;
+            }
+        }
+    }
+
+    live_size += size_class;
+
+    g_mutex_unlock(&pool_mutex);
+
+    if (info == NULL)
+    {
+        info = g_new(BufferInfo, 1);
+        info->size = size_class;
+        info->mapped = use_scratch && !Failed(alloc_mapped(&info->buffer, size_class));
+
+        if (!info->mapped)
+            err = PKAllocAligned((void**)&info->buffer, size_class, BUFFER_ALIGNMENT);
+
+        if (Failed(err))
+        {
+            g_free(info);
+
+            g_mutex_lock(&pool_mutex);
+            live_size -= size_class;
+            g_mutex_unlock(&pool_mutex);
+
+            goto Cleanup;
+        }
+    }
+
+    *buffer = info->buffer;
+
+    g_mutex_lock(&pool_mutex);
+    g_hash_table_insert(allocated, info->buffer, info);
+    g_mutex_unlock(&pool_mutex);
+
+Cleanup:
+    return err;
+}
+
+ERR buffer_free(guchar** buffer)
+{
+    BufferInfo* info;
+
+    if (*buffer == NULL)
+        return WMP_errSuccess;
+
+    g_mutex_lock(&pool_mutex);
+
+    info = (BufferInfo*)g_hash_table_lookup(allocated, *buffer);
+    g_hash_table_remove(allocated, *buffer);
+    live_size -= info->size;
+
+    if (info->mapped || info->size < MIN_POOLED_SIZE || info->size > pool_cap)
+    {
+        g_mutex_unlock(&pool_mutex);
+        free_buffer(info);
+    }
+    else
+    {
+        while (idle_size + info->size > pool_cap)
+            free_oldest_idle();
+
+        g_queue_push_head(&idle, info);
+        idle_size += info->size;
+
+        g_mutex_unlock(&pool_mutex);
+    }
+
+    *buffer = NULL;
+
+    return WMP_errSuccess;
+}
+
+void buffer_pool_trim()
+{
+    g_mutex_lock(&pool_mutex);
+
+    while (!g_queue_is_empty(&idle))
+        free_oldest_idle();
+
+    g_mutex_unlock(&pool_mutex);
+}
+
+static gsize get_size_class(gsize size)
+{
+    gsize base;
+    gsize step;
+
+    if (size <= MIN_POOLED_SIZE)
+        return MAX(size, 1);
+
+    for (base = MIN_POOLED_SIZE; base <= size / 2; base *= 2)
+        ;
+
+    step = base / 4;
+
+    return base + (size - base + step - 1) / step * step;
+}
+
+static void init_pool()
+{
+    if (allocated != NULL)
+        return;
+
+    allocated = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pool_cap = get_env_size("GIMP_JXR_BUFFER_POOL", G_GUINT64_CONSTANT(256) << 20);
+    ram_budget = get_env_size("GIMP_JXR_RAM_BUDGET", G_MAXUINT64 / 2);
+}
+
+static void free_oldest_idle()
+{
+    BufferInfo* info = (BufferInfo*)g_queue_pop_tail(&idle);
+
+    idle_size -= info->size;
+    free_buffer(info);
+}
+
+static ERR alloc_mapped(guchar** buffer, gsize size)
+{
+#ifdef G_OS_UNIX
+    const gchar*    dir;
+    gchar*          path;
+    gint            fd;
+    void*           mapping;
+
+    dir = g_getenv("GIMP_JXR_SCRATCH_DIR");
+    path = g_build_filename(dir != NULL ? dir : g_get_tmp_dir(), "gimp-jxr-XXXXXX", NULL);
+    fd = g_mkstemp(path);
+
+    if (fd < 0)
+    {
+        g_free(path);
+        return WMP_errFileIO;
+    }
+
+    // the file only lives as long as the mapping
+    g_unlink(path);
+    g_free(path);
+
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return WMP_errFileIO;
+    }
+
+    mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return WMP_errOutOfMemory;
+
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    *buffer = (guchar*)mapping;
+
+    return WMP_errSuccess;
+#else
+    return WMP_errNotYetImplemented;
+#endif
+}
+
+static void free_buffer(BufferInfo* info)
+{
+#ifdef G_OS_UNIX
+    if (info->mapped)
+        munmap(info->buffer, info->size);
+    else
+#endif
+        PKFreeAligned((void**)&info->buffer);
+
+    g_free(info);
+}
@@ -0,0 +1,11 @@
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#include "file-jxr.h"
+#include <JXRGlue.h>
+
+ERR buffer_alloc(guchar** buffer, guint64 size);
+ERR buffer_free(guchar** buffer);
+void buffer_pool_trim();
+
+#endif
@@ -0,0 +1,72 @@
+#include "colortransform.h"
+#include <lcms2.h>
+
+// Converts decoded pixels from an embedded ICC profile to sRGB with lcms2.
+// The transform is created without a cache (cmsFLAGS_NOCACHE), which makes it
+// safe to apply to different bands from several threads at once. Alpha is
+// passed through unchanged.
+
+struct ColorTransform
+{
+    cmsHTRANSFORM   transform;
+};
+
+ERR color_transform_new(const guchar* profile, guint profile_size, const PKPixelFormatGUID* pixel_format, ColorTransform** transform)
+{
+    ERR             err = WMP_errSuccess;
+    cmsHPROFILE     input = NULL;
+    cmsHPROFILE     output = NULL;
+    cmsHTRANSFORM   handle = NULL;
+    cmsUInt32Number format;
+
+    *transform = NULL;
+
+    if (IsEqualGUID(pixel_format, &GUID_PKPixelFormat24bppRGB))
+        format = TYPE_RGB_8;
+    else if (IsEqualGUID(pixel_format, &GUID_PKPixelFormat32bppRGBA))
+        format = TYPE_RGBA_8;
+    else
+        Call(WMP_errUnsupportedFormat);
+
+    input = cmsOpenProfileFromMem(profile, profile_size);
+
+    FailIf(input == NULL || cmsGetColorSpace(input) != cmsSigRgbData, WMP_errUnsupportedFormat);
+
+    output = cmsCreate_sRGBProfile();
+
+    FailIf(output == NULL, WMP_errOutOfMemory);
+
+    handle = cmsCreateTransform(input, format, output, format, INTENT_PERCEPTUAL, cmsFLAGS_NOCACHE | cmsFLAGS_COPY_ALPHA);
+
+    FailIf(handle == NULL, WMP_errUnsupportedFormat);
+
+    *transform = g_new(ColorTransform, 1);
+    (*transform)->transform = handle;
+
+Cleanup:
+    if (input != NULL)
+        cmsCloseProfile(input);
+
+    if (output != NULL)
+        cmsCloseProfile(output);
+
+    return err;
+}
+
+// Converts the pixels in place.
+void color_transform_apply(const ColorTransform* transform, guchar* pixels, guint width, guint height, guint stride)
+{
+    guint y;
+
+    for (y = 0; y < height; y++)
+        cmsDoTransform(transform->transform, pixels + (gsize)y * stride, pixels + (gsize)y * stride, width);
+}
+
+void color_transform_free(ColorTransform* transform)
+{
+    if (transform == NULL)
+        return;
+
+    cmsDeleteTransform(transform->transform);
+    g_free(transform);
+}
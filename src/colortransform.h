@@ -0,0 +1,13 @@
+#ifndef COLORTRANSFORM_H
+#define COLORTRANSFORM_H
+
+#include "file-jxr.h"
+#include <JXRGlue.h>
+
+typedef struct ColorTransform ColorTransform;
+
+ERR color_transform_new(const guchar* profile, guint profile_size, const PKPixelFormatGUID* pixel_format, ColorTransform** transform);
+void color_transform_apply(const ColorTransform* transform, guchar* pixels, guint width, guint height, guint stride);
+void color_transform_free(ColorTransform* transform);
+
+#endif
@@ -0,0 +1,464 @@
+#include "composite.h"
+#include "buffers.h"
+#include "trace.h"
+#include "transfer.h"
+
+// Combines the visible layers of an image for saving, so that multi-layer
+// images do not have to be duplicated and flattened by gimp_export_image.
+// Layers are read in bands of TRANSFER_ROWS rows of the canvas, expanded to
+// RGBA (palette, gray) and composited bottom to top with GIMP's normal mode
+// on straight alpha; applied layer masks multiply the alpha. Images with
+// anything else (layer groups, other modes, floating selections) are left to
+// gimp_export_image.
+//
+// A single layer can also be read on its own, on a canvas of its own size;
+// its opacity, mode and visibility are then ignored.
+//
+// The result has an alpha channel unless the bottom layer is opaque and
+// covers the canvas. Opaque gray images stay gray; opaque indexed images are
+// expanded to RGB unless they consist of a single layer with a black-white
+// color map.
+
+typedef struct
+{
+    GimpDrawable*   drawable;
+    GimpDrawable*   mask;
+    GimpImageType   type;
+    gint            x;
+    gint            y;
+    guint           opacity;        // 0 to 255
+} CompositeLayer;
+
+static void set_pixel_format(Composition* composition);
+static gint32 get_applied_mask(gint32 layer_ID);
+static ERR read_direct(const Composition* composition, Image* image, Progress* progress);
+static ERR read_composite(const Composition* composition, Image* image, Progress* progress);
+static void expand_row(const guchar* src, guchar* dst, guint count, GimpImageType type, const guchar* colormap);
+static void apply_mask(guchar* pixels, const guchar* mask, guint count);
+static void blend_row(guchar* dst, const guchar* src, guint count, guint opacity);
+static void pack_rows(const guchar* band, guchar* dst, guint width, guint rows, const Composition* composition);
+
+gboolean composition_init(Composition* composition, gint32 image_ID)
+{
+    gint32*         layers;
+    gint            count;
+    gint            i;
+
+    memset(composition, 0, sizeof(Composition));
+
+    composition->image_ID = image_ID;
+    composition->width = gimp_image_width(image_ID);
+    composition->height = gimp_image_height(image_ID);
+
+    layers = gimp_image_get_layers(image_ID, &count);
+    composition->layers = g_new(gint32, MAX(count, 1));
+
+    for (i = count - 1; i >= 0; i--)
+    {
+        if (!gimp_item_get_visible(layers[i]))
+            continue;
+
+        if (gimp_item_is_group(layers[i]) ||
+            gimp_layer_is_floating_sel(layers[i]) ||
+            gimp_layer_get_mode(layers[i]) != GIMP_NORMAL_MODE)
+        {
+            composition->layer_count = 0;
+            break;
+        }
+
+        composition->layers[composition->layer_count++] = layers[i];
+    }
+
+    g_free(layers);
+
+    if (composition->layer_count == 0)
+    {
+        composition_free(composition);
+        return FALSE;
+    }
+
+    set_pixel_format(composition);
+
+    return TRUE;
+}
+
+void composition_init_layer(Composition* composition, gint32 image_ID, gint32 layer_ID)
+{
+    memset(composition, 0, sizeof(Composition));
+
+    composition->image_ID = image_ID;
+    composition->layers = g_new(gint32, 1);
+    composition->layers[0] = layer_ID;
+    composition->layer_count = 1;
+    composition->single = TRUE;
+    composition->width = gimp_drawable_width(layer_ID);
+    composition->height = gimp_drawable_height(layer_ID);
+
+    gimp_drawable_offsets(layer_ID, &composition->x, &composition->y);
+
+    set_pixel_format(composition);
+}
+
+static void set_pixel_format(Composition* composition)
+{
+    gint32          bottom = composition->layers[0];
+    GimpImageType   type = gimp_drawable_type(bottom);
+    gboolean        full_opacity;
+    gboolean        covers;
+    gboolean        opaque;
+    gint            x, y;
+
+    gimp_drawable_offsets(bottom, &x, &y);
+
+    x -= composition->x;
+    y -= composition->y;
+
+    full_opacity = composition->single || gimp_layer_get_opacity(bottom) >= 100.0;
+    covers = x <= 0 && y <= 0 &&
+        x + gimp_drawable_width(bottom) >= (gint)composition->width &&
+        y + gimp_drawable_height(bottom) >= (gint)composition->height;
+    opaque = covers && full_opacity && !gimp_drawable_has_alpha(bottom) && get_applied_mask(bottom) == -1;
+
+    if (!opaque)
+        composition->pixel_format = GUID_PKPixelFormat32bppBGRA;
+    else if (gimp_image_base_type(composition->image_ID) == GIMP_GRAY)
+        composition->pixel_format = GUID_PKPixelFormat8bppGray;
+    else if (gimp_image_base_type(composition->image_ID) == GIMP_INDEXED && composition->layer_count == 1 &&
+        has_blackwhite_colormap(composition->image_ID, &composition->black_one))
+        composition->pixel_format = GUID_PKPixelFormatBlackWhite;
+    else
+        composition->pixel_format = GUID_PKPixelFormat24bppRGB;
+
+    // a layer that matches the canvas and the output format is read as is
+    composition->direct = composition->layer_count == 1 &&
+        x == 0 && y == 0 &&
+        gimp_drawable_width(bottom) == (gint)composition->width &&
+        gimp_drawable_height(bottom) == (gint)composition->height &&
+        full_opacity && get_applied_mask(bottom) == -1 &&
+        ((type == GIMP_RGB_IMAGE && IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat24bppRGB)) ||
+         (type == GIMP_RGBA_IMAGE && IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat32bppBGRA)) ||
+         (type == GIMP_GRAY_IMAGE && IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat8bppGray)) ||
+         (type == GIMP_INDEXED_IMAGE && IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormatBlackWhite)));
+}
+
+static gint32 get_applied_mask(gint32 layer_ID)
+{
+    gint32 mask_ID = gimp_layer_get_mask(layer_ID);
+
+    return mask_ID != -1 && gimp_layer_get_apply_mask(layer_ID) ? mask_ID : -1;
+}
+
+// Fills image with the combined layers. The pixels of black-white images are
+// color map indices, one byte per pixel.
+ERR composition_read(const Composition* composition, Image* image, Progress* progress)
+{
+    ERR     err;
+    guint   bytes_per_pixel;
+
+    if (IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat32bppBGRA))
+        bytes_per_pixel = 4;
+    else if (IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat24bppRGB))
+        bytes_per_pixel = 3;
+    else
+        bytes_per_pixel = 1;
+
+    image->width = composition->width;
+    image->height = composition->height;
+    image->stride = image->width * bytes_per_pixel;
+    image->pixel_format = composition->pixel_format;
+    image->black_one = composition->black_one;
+    image->pixels = NULL;
+
+    Call(buffer_alloc(&image->pixels, (guint64)image->stride * image->height));
+
+    trace_count("alloc-bytes", (guint64)image->stride * image->height);
+
+    if (composition->direct)
+        Call(read_direct(composition, image, progress));
+    else
+        Call(read_composite(composition, image, progress));
+
+Cleanup:
+    if (Failed(err))
+        buffer_free(&image->pixels);
+
+    return err;
+}
+
+void composition_free(Composition* composition)
+{
+    g_free(composition->layers);
+    composition->layers = NULL;
+    composition->layer_count = 0;
+}
+
+static ERR read_direct(const Composition* composition, Image* image, Progress* progress)
+{
+    ERR             err = WMP_errSuccess;
+    GimpDrawable*   drawable;
+    guint           y;
+    guint           rows;
+
+    drawable = gimp_drawable_get(composition->layers[0]);
+
+    transfer_set_cache(image->width, TRANSFER_ROWS);
+
+    // fetch the pixels in bands to report progress
+    for (y = 0; y < image->height; y += rows)
+    {
+        rows = MIN(TRANSFER_ROWS, image->height - y);
+        transfer_get_rect(drawable, image->pixels + (gsize)y * image->stride, image->stride, 0, y, image->width, rows);
+
+        if (!progress_update(progress, (gdouble)(y + rows) / image->height))
+        {
+            err = ERR_CANCELLED;
+            break;
+        }
+    }
+
+    gimp_drawable_detach(drawable);
+
+    return err;
+}
+
+static ERR read_composite(const Composition* composition, Image* image, Progress* progress)
+{
+    ERR             err = WMP_errSuccess;
+    CompositeLayer* layers;
+    guchar          colormap[256 * 3];
+    guchar*         palette;
+    gint            num_colors;
+    guchar*         band = NULL;
+    guchar*         layer_band = NULL;
+    guchar*         mask_band = NULL;
+    guchar*         row = NULL;
+    guint           y;
+    guint           rows;
+    guint           cache_width = 0;
+    gint            i;
+
+    memset(colormap, 0, sizeof(colormap));
+
+    if (gimp_image_base_type(composition->image_ID) == GIMP_INDEXED)
+    {
+        palette = gimp_image_get_colormap(composition->image_ID, &num_colors);
+        memcpy(colormap, palette, MIN(num_colors, 256) * 3);
+        g_free(palette);
+    }
+
+    layers = g_new(CompositeLayer, composition->layer_count);
+
+    for (i = 0; i < composition->layer_count; i++)
+    {
+        CompositeLayer* layer = &layers[i];
+        gint32          mask_ID = get_applied_mask(composition->layers[i]);
+
+        layer->drawable = gimp_drawable_get(composition->layers[i]);
+        layer->mask = mask_ID != -1 ? gimp_drawable_get(mask_ID) : NULL;
+        layer->type = gimp_drawable_type(composition->layers[i]);
+        layer->opacity = composition->single ? 255 :
+            (guint)(gimp_layer_get_opacity(composition->layers[i]) * 255.0 / 100.0 + 0.5);
+
+        gimp_drawable_offsets(composition->layers[i], &layer->x, &layer->y);
+
+        layer->x -= composition->x;
+        layer->y -= composition->y;
+
+        cache_width += MIN(layer->drawable->width, image->width) * (layer->mask != NULL ? 2 : 1);
+    }
+
+    // layers not aligned with the canvas bands use tiles in two bands
+    transfer_set_cache(cache_width, TRANSFER_ROWS + gimp_tile_height());
+
+    Call(buffer_alloc(&band, (guint64)image->width * 4 * TRANSFER_ROWS));
+    Call(buffer_alloc(&layer_band, (guint64)image->width * 4 * TRANSFER_ROWS));
+    Call(buffer_alloc(&mask_band, (guint64)image->width * TRANSFER_ROWS));
+    Call(buffer_alloc(&row, (guint64)image->width * 4));
+
+    for (y = 0; y < image->height; y += rows)
+    {
+        rows = MIN(TRANSFER_ROWS, image->height - y);
+
+        memset(band, 0, (gsize)image->width * 4 * rows);
+
+        for (i = 0; i < composition->layer_count; i++)
+        {
+            CompositeLayer* layer = &layers[i];
+            gint            x0 = MAX(layer->x, 0);
+            gint            y0 = MAX(layer->y, (gint)y);
+            gint            x1 = MIN(layer->x + (gint)layer->drawable->width, (gint)image->width);
+            gint            y1 = MIN(layer->y + (gint)layer->drawable->height, (gint)(y + rows));
+            guint           width;
+            guint           j;
+
+            if (x0 >= x1 || y0 >= y1 || layer->opacity == 0)
+                continue;
+
+            width = x1 - x0;
+
+            transfer_get_rect(layer->drawable, layer_band, (gsize)width * layer->drawable->bpp, x0 - layer->x, y0 - layer->y, width, y1 - y0);
+
+            if (layer->mask != NULL)
+                transfer_get_rect(layer->mask, mask_band, width, x0 - layer->x, y0 - layer->y, width, y1 - y0);
+
+            for (j = 0; j < (guint)(y1 - y0); j++)
+            {
+                expand_row(layer_band + (gsize)j * width * layer->drawable->bpp, row, width, layer->type, colormap);
+
+                if (layer->mask != NULL)
+                    apply_mask(row, mask_band + (gsize)j * width, width);
+
+                blend_row(band + ((gsize)(y0 - y + j) * image->width + x0) * 4, row, width, layer->opacity);
+            }
+        }
+
+        pack_rows(band, image->pixels + (gsize)y * image->stride, image->width, rows, composition);
+
+        if (!progress_update(progress, (gdouble)(y + rows) / image->height))
+        {
+            err = ERR_CANCELLED;
+            break;
+        }
+    }
+
+Cleanup:
+    for (i = 0; i < composition->layer_count; i++)
+    {
+        gimp_drawable_detach(layers[i].drawable);
+
+        if (layers[i].mask != NULL)
+            gimp_drawable_detach(layers[i].mask);
+    }
+
+    g_free(layers);
+
+    buffer_free(&band);
+    buffer_free(&layer_band);
+    buffer_free(&mask_band);
+    buffer_free(&row);
+
+    return err;
+}
+
+static void expand_row(const guchar* src, guchar* dst, guint count, GimpImageType type, const guchar* colormap)
+{
+    guint i;
+
+    switch (type)
+    {
+    case GIMP_RGB_IMAGE:
+        for (i = 0; i < count; i++)
+        {
+            dst[4 * i + 0] = src[3 * i + 0];
+            dst[4 * i + 1] = src[3 * i + 1];
+            dst[4 * i + 2] = src[3 * i + 2];
+            dst[4 * i + 3] = 0xFF;
+        }
+        break;
+    case GIMP_RGBA_IMAGE:
+        memcpy(dst, src, (gsize)count * 4);
+        break;
+    case GIMP_GRAY_IMAGE:
+        for (i = 0; i < count; i++)
+        {
+            dst[4 * i + 0] = dst[4 * i + 1] = dst[4 * i + 2] = src[i];
+            dst[4 * i + 3] = 0xFF;
+        }
+        break;
+    case GIMP_GRAYA_IMAGE:
+        for (i = 0; i < count; i++)
+        {
+            dst[4 * i + 0] = dst[4 * i + 1] = dst[4 * i + 2] = src[2 * i];
+            dst[4 * i + 3] = src[2 * i + 1];
+        }
+        break;
+    case GIMP_INDEXED_IMAGE:
+        for (i = 0; i < count; i++)
+        {
+            memcpy(dst + 4 * i, colormap + 3 * src[i], 3);
+            dst[4 * i + 3] = 0xFF;
+        }
+        break;
+    case GIMP_INDEXEDA_IMAGE:
+        for (i = 0; i < count; i++)
+        {
+            memcpy(dst + 4 * i, colormap + 3 * src[2 * i], 3);
+            dst[4 * i + 3] = src[2 * i + 1];
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void apply_mask(guchar* pixels, const guchar* mask, guint count)
+{
+    guint i;
+
+    for (i = 0; i < count; i++)
+        pixels[4 * i + 3] = (guchar)((pixels[4 * i + 3] * mask[i] + 127) / 255);
+}
+
+// Composites an RGBA row over another with GIMP's normal mode.
+static void blend_row(guchar* dst, const guchar* src, guint count, guint opacity)
+{
+    guint i, c;
+    guint alpha;
+    guint dst_alpha;
+    guint out_alpha;
+
+    for (i = 0; i < count; i++, src += 4, dst += 4)
+    {
+        alpha = (src[3] * opacity + 127) / 255;
+
+        if (alpha == 0)
+            continue;
+
+        if (alpha == 255 || dst[3] == 0)
+        {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = (guchar)alpha;
+            continue;
+        }
+
+        // both alphas scaled by 255
+        dst_alpha = dst[3] * (255 - alpha);
+        out_alpha = alpha * 255 + dst_alpha;
+
+        for (c = 0; c < 3; c++)
+            dst[c] = (guchar)((src[c] * alpha * 255 + dst[c] * dst_alpha + out_alpha / 2) / out_alpha);
+
+        dst[3] = (guchar)((out_alpha + 127) / 255);
+    }
+}
+
+static void pack_rows(const guchar* band, guchar* dst, guint width, guint rows, const Composition* composition)
+{
+    gsize count = (gsize)width * rows;
+    gsize i;
+
+    if (IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat32bppBGRA))
+        memcpy(dst, band, count * 4);
+    else if (IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat24bppRGB))
+    {
+        for (i = 0; i < count; i++)
+        {
+            dst[3 * i + 0] = band[4 * i + 0];
+            dst[3 * i + 1] = band[4 * i + 1];
+            dst[3 * i + 2] = band[4 * i + 2];
+        }
+    }
+    else if (IsEqualGUID(&composition->pixel_format, &GUID_PKPixelFormat8bppGray))
+    {
+        for (i = 0; i < count; i++)
+            dst[i] = band[4 * i];
+    }
+    else
+    {
+        // back to indices of the black-white color map
+        for (i = 0; i < count; i++)
+            dst[i] = (band[4 * i] >= 0x80) != (composition->black_one != FALSE);
+    }
+}
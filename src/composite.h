@@ -0,0 +1,29 @@
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+#include "file-jxr.h"
+#include "utils.h"
+
+// Visible layers of an image that the plug-in combines itself, or a single
+// layer saved on its own, and the pixel format the result is saved in
+typedef struct
+{
+    gint32              image_ID;
+    gint32*             layers;         // bottom to top
+    gint                layer_count;
+    gboolean            single;         // a layer on its own, without its opacity
+    gint                x;              // canvas in image coordinates
+    gint                y;
+    guint               width;
+    guint               height;
+    PKPixelFormatGUID   pixel_format;
+    gboolean            black_one;
+    gboolean            direct;         // a single layer that is read as is
+} Composition;
+
+gboolean composition_init(Composition* composition, gint32 image_ID);
+void composition_init_layer(Composition* composition, gint32 image_ID, gint32 layer_ID);
+ERR composition_read(const Composition* composition, Image* image, Progress* progress);
+void composition_free(Composition* composition);
+
+#endif
@@ -0,0 +1,339 @@
+#include "save.h"
+#include "load.h"
+#include "trace.h"
+#include "buffers.h"
+#include "workers.h"
+
+// Saves scaled copies of one source file. The source is decoded once and
+// halved repeatedly with a box filter; each output is scaled from the
+// smallest halving that is still at least as wide as the output, so it does
+// not depend on which other outputs are requested. The outputs are scaled and
+// encoded in parallel, each with its own copy of the pixels and options.
+// Finished outputs are counted under a mutex so that the main thread can
+// update the progress bar and stop the outputs not yet started on cancel.
+
+// Share of the progress bar given to decoding the source; the rest covers
+// the outputs
+#define DECODE_PROGRESS 0.3
+
+typedef struct
+{
+    GMutex          mutex;
+    GCond           cond;
+    guint           done;
+    gboolean        cancelled;
+} DerivativeBatch;
+
+typedef struct
+{
+    DerivativeBatch*    batch;
+    const Image*        level;
+    const gchar*        filename;
+    Image               image;
+    SaveOptions         save_options;
+    ERR                 err;
+} DerivativeTask;
+
+static void expand_bw(Image* image);
+static void run_derivative_task(gpointer data);
+static void encode_derivative(DerivativeTask* task);
+
+void save_derivatives(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
+{
+    GimpParam*          ret_values;
+    GimpRunMode         run_mode;
+    gchar*              filename;
+    gint                count;
+    gchar**             filenames;
+    const gint32*       widths;
+    const gint32*       qualities;
+    SaveOptions         save_options = DEFAULT_SAVE_OPTIONS;
+    Image               source;
+    GPtrArray*          levels;
+    DerivativeTask*     tasks;
+    TaskGroup*          group;
+    DerivativeBatch     batch;
+    guint               source_width;
+    guint               source_height;
+    gint                pushed;
+    guint               done;
+    gboolean            cancelled;
+    Progress            progress;
+    gchar*              error_message = NULL;
+    ERR                 err;
+    gint64              start;
+    gint                i;
+
+    start = trace_begin();
+
+    ret_values = g_new0(GimpParam, 2);
+
+    // the message is only returned by the paths that fill it in
+    *nreturn_vals = 1;
+    *return_vals = ret_values;
+    ret_values[0].type = GIMP_PDB_STATUS;
+    ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+
+    if (nparams != 8)
+        return;
+
+    run_mode  = (GimpRunMode)param[0].data.d_int32;
+    filename  = param[1].data.d_string;
+    count     = param[2].data.d_int32;
+    filenames = param[3].data.d_stringarray;
+    widths    = param[5].data.d_int32array;
+    qualities = param[7].data.d_int32array;
+
+    if (count <= 0 || param[4].data.d_int32 != count || param[6].data.d_int32 != count)
+        return;
+
+    for (i = 0; i < count; i++)
+        if (widths[i] <= 0 || qualities[i] < 0 || qualities[i] > 100)
+            return;
+
+    if (run_mode == GIMP_RUN_WITH_LAST_VALS)
+        gimp_get_data(SAVE_PROC, &save_options);
+
+    // outputs may not be wider than the source; the header is enough to
+    // tell, so a bad call does not decode the whole source first
+    err = jxrlib_get_size(filename, &source_width, &source_height);
+
+    if (!Failed(err))
+        for (i = 0; i < count; i++)
+            if ((guint)widths[i] > source_width)
+                return;
+
+    ret_values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
+
+    gimp_progress_init_printf(_("Saving scaled copies of '%s'"), gimp_filename_to_utf8(filename));
+
+    progress_init(&progress);
+    progress_set_stage(&progress, 0.0, DECODE_PROGRESS);
+
+    if (!Failed(err))
+        err = jxrlib_load(filename, &source, &error_message, &progress);
+
+    if (Failed(err))
+    {
+        if (err == ERR_CANCELLED)
+            ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+        else
+        {
+            *nreturn_vals = 2;
+            ret_values[1].type          = GIMP_PDB_STRING;
+            ret_values[1].data.d_string = error_message != NULL ? error_message : g_strdup(_("An error occurred."));
+        }
+
+        gimp_progress_end();
+        return;
+    }
+
+    if (IsEqualGUID(&source.pixel_format, &GUID_PKPixelFormatBlackWhite))
+        expand_bw(&source);
+
+    // the profile no longer describes pixels that were converted to sRGB
+    if (source.color_converted)
+    {
+        g_free(source.color_context);
+        source.color_context = NULL;
+        source.color_context_size = 0;
+    }
+
+    progress_set_stage(&progress, DECODE_PROGRESS, 1.0 - DECODE_PROGRESS);
+
+    levels = g_ptr_array_new();
+    g_ptr_array_add(levels, &source);
+
+    tasks = g_new0(DerivativeTask, count);
+
+    g_mutex_init(&batch.mutex);
+    g_cond_init(&batch.cond);
+    batch.done = 0;
+    batch.cancelled = FALSE;
+
+    group = task_group_new();
+    pushed = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        DerivativeTask* task = &tasks[i];
+        const Image*    level;
+        guint           l;
+
+        // build the halvings down to the smallest one that is still wide
+        // enough for this output
+        for (l = 0; ; l++)
+        {
+            const Image* parent;
+            Image*       next;
+
+            level = (const Image*)g_ptr_array_index(levels, l);
+
+            if ((level->width + 1) / 2 < (guint)widths[i] || level->height < 2)
+                break;
+
+            if (l + 1 < levels->len)
+                continue;
+
+            parent = level;
+            next = g_new(Image, 1);
+            *next = *parent;
+            next->width = (parent->width + 1) / 2;
+            next->height = (parent->height + 1) / 2;
+            next->stride = next->width * (parent->stride / parent->width);
+            next->pixels = NULL;
+
+            err = buffer_alloc(&next->pixels, (guint64)next->stride * next->height);
+
+            if (Failed(err))
+            {
+                g_free(next);
+                break;
+            }
+
+            downsample_box(parent->pixels, next->pixels, parent->width, parent->height, parent->stride, parent->stride / parent->width, 2);
+            g_ptr_array_add(levels, next);
+        }
+
+        if (Failed(err))
+            break;
+
+        task->batch = &batch;
+        task->level = level;
+        task->filename = filenames[i];
+        task->image = *level;
+        task->image.width = widths[i];
+        task->image.height = MAX((guint)(((guint64)source.height * widths[i] + source.width / 2) / source.width), 1);
+        task->image.stride = task->image.width * (level->stride / level->width);
+        task->image.pixels = NULL;
+        task->save_options = save_options;
+        task->save_options.image_quality = qualities[i];
+
+        // the encoder takes alpha images in GIMP's channel order
+        if (IsEqualGUID(&level->pixel_format, &GUID_PKPixelFormat32bppRGBA))
+            task->image.pixel_format = GUID_PKPixelFormat32bppBGRA;
+
+        task_group_push(group, run_derivative_task, task);
+        pushed++;
+    }
+
+    // report progress while the outputs are encoded; outputs that have not
+    // started when the user cancels are skipped
+    g_mutex_lock(&batch.mutex);
+
+    while (batch.done < (guint)pushed)
+    {
+        g_cond_wait_until(&batch.cond, &batch.mutex, g_get_monotonic_time() + G_TIME_SPAN_SECOND / 10);
+        done = batch.done;
+        g_mutex_unlock(&batch.mutex);
+
+        cancelled = !progress_update(&progress, (gdouble)done / count);
+
+        g_mutex_lock(&batch.mutex);
+        batch.cancelled |= cancelled;
+    }
+
+    cancelled = batch.cancelled;
+
+    g_mutex_unlock(&batch.mutex);
+
+    task_group_free(group);
+
+    g_mutex_clear(&batch.mutex);
+    g_cond_clear(&batch.cond);
+
+    for (i = 0; i < pushed && !Failed(err); i++)
+        err = tasks[i].err;
+
+    if (cancelled)
+        err = ERR_CANCELLED;
+
+    for (i = 1; i < (gint)levels->len; i++)
+    {
+        Image* level = (Image*)g_ptr_array_index(levels, i);
+
+        buffer_free(&level->pixels);
+        g_free(level);
+    }
+
+    g_ptr_array_free(levels, TRUE);
+    g_free(tasks);
+
+    buffer_free(&source.pixels);
+    g_free(source.color_context);
+    g_free(source.xmp_metadata);
+
+    if (!Failed(err))
+    {
+        ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+    }
+    else if (err == ERR_CANCELLED)
+    {
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+    }
+    else
+    {
+        *nreturn_vals = 2;
+        ret_values[1].type          = GIMP_PDB_STRING;
+        ret_values[1].data.d_string = g_strdup(_("An error occurred."));
+    }
+
+    gimp_progress_end();
+    trace_end("save-derivatives", start);
+}
+
+// Black-white sources are loaded as color map indices; scaled copies are
+// saved as grayscale.
+static void expand_bw(Image* image)
+{
+    guchar  zero = image->black_one ? 0xFF : 0x00;     // gray value of index 0
+    gsize   count = (gsize)image->stride * image->height;
+    gsize   i;
+
+    for (i = 0; i < count; i++)
+        image->pixels[i] = image->pixels[i] != 0 ? (guchar)~zero : zero;
+
+    image->pixel_format = GUID_PKPixelFormat8bppGray;
+    image->black_one = FALSE;
+}
+
+static void run_derivative_task(gpointer data)
+{
+    DerivativeTask* task = (DerivativeTask*)data;
+    Image*          image = &task->image;
+    gboolean        cancelled;
+
+    g_mutex_lock(&task->batch->mutex);
+    cancelled = task->batch->cancelled;
+    g_mutex_unlock(&task->batch->mutex);
+
+    if (cancelled)
+        task->err = ERR_CANCELLED;
+    else
+        task->err = buffer_alloc(&image->pixels, (guint64)image->stride * image->height);
+
+    if (!Failed(task->err))
+    {
+        encode_derivative(task);
+        buffer_free(&image->pixels);
+    }
+
+    g_mutex_lock(&task->batch->mutex);
+    task->batch->done++;
+    g_cond_signal(&task->batch->cond);
+    g_mutex_unlock(&task->batch->mutex);
+}
+
+// Scales the level into the task's image and saves it.
+static void encode_derivative(DerivativeTask* task)
+{
+    Image* image = &task->image;
+
+    if (image->width == task->level->width && image->height == task->level->height)
+        memcpy(image->pixels, task->level->pixels, (gsize)image->stride * image->height);
+    else
+        resample_area(task->level->pixels, task->level->width, task->level->height, task->level->stride,
+            image->pixels, image->width, image->height, image->stride / image->width);
+
+    task->err = jxrlib_save(task->filename, image, &task->save_options, NULL);
+}
@@ -1,50 +1,133 @@
 #include "file-jxr.h"
+#include "trace.h"
+#include "utils.h"
+#include "buffers.h"
+#include "workers.h"
+#include "load.h"
+#include "save.h"
 
 static void query();
+static void quit();
 static void run(const gchar* name, gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
-void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
-void save(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+static void run_extension(gint* nreturn_vals, GimpParam** return_vals);
 
 const GimpPlugInInfo PLUG_IN_INFO =
 {
     NULL, 
-    NULL, 
+    (GimpQuitProc)quit, 
     (GimpQueryProc)query,
     (GimpRunProc)run,
 };
 
+#define IDLE_TRIM_TIMEOUT 5000
+
+static guint run_count = 0;
+
+// Return values of the last call; libgimp sends them once run returns but
+// never frees them, which the resident extension would pay for on every call
+static GimpParam*   last_return_vals = NULL;
+static gint         last_nreturn_vals = 0;
+
+static const GimpParamDef load_args[] =
+{
+    { GIMP_PDB_INT32,   "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_STRING,  "filename",     "The name of the file to load" },
+    { GIMP_PDB_STRING,  "raw-filename", "The name entered" }
+};
+
+static const GimpParamDef load_return_vals[] =
+{
+    { GIMP_PDB_IMAGE,   "image", "Output image" }
+};
+
+static const GimpParamDef load_multiple_args[] =
+{
+    { GIMP_PDB_INT32,       "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_INT32,       "num-files",    "The number of files to load" },
+    { GIMP_PDB_STRINGARRAY, "filenames",    "The names of the files to load" }
+};
+
+static const GimpParamDef load_region_args[] =
+{
+    { GIMP_PDB_INT32,   "run-mode",     "Interactive, non-interactive" },
+    { GIMP_PDB_STRING,  "filename",     "The name of the file to load" },
+    { GIMP_PDB_STRING,  "raw-filename", "The name entered" },
+    { GIMP_PDB_INT32,   "x",            "Left edge of the region" },
+    { GIMP_PDB_INT32,   "y",            "Top edge of the region" },
+    { GIMP_PDB_INT32,   "width",        "Width of the region" },
+    { GIMP_PDB_INT32,   "height",       "Height of the region" },
+    { GIMP_PDB_INT32,   "scale",        "Reduction factor of the loaded image (1, 2, 4, 8 or 16)" }
+};
+
+static const GimpParamDef load_multiple_return_vals[] =
+{
+    { GIMP_PDB_INT32,       "num-images",   "The number of images" },
+    { GIMP_PDB_INT32ARRAY,  "images",       "Output images in the order of the file names, -1 for files that could not be loaded" }
+};
+
+// Arguments of file-jxr-save, which stay as they are so that existing scripts
+// keep working; file-jxr-save2 takes them followed by the newer options
+#define SAVE_ARGS \
+    { GIMP_PDB_INT32,   "run-mode",         "Interactive, non-interactive" }, \
+    { GIMP_PDB_IMAGE,   "image",            "Input image" }, \
+    { GIMP_PDB_DRAWABLE,"drawable",         "Drawable to save" }, \
+    { GIMP_PDB_STRING,  "filename",         "The name of the file to save the image in" }, \
+    { GIMP_PDB_STRING,  "raw-filename",     "The name entered" }, \
+    { GIMP_PDB_INT32,   "quality",          "Quality of saved image (0 <= quality <= 100, 100 = lossless)" }, \
+    { GIMP_PDB_INT32,   "alpha-quality",    "Quality of alpha channel (0 <= quality <= 100, 100 = lossless)" }, \
+    { GIMP_PDB_INT32,   "overlap",          "Overlap level (0 = auto, 1 = none, 2 = one level, 3 = two level, 4 = adapt to image)" }, \
+    { GIMP_PDB_INT32,   "subsampling",      "Chroma subsampling (0 = Y-only, 1 = 4:2:0, 2 = 4:2:2, 3 = 4:4:4, 4 = adapt to image)" }, \
+    { GIMP_PDB_INT32,   "tiling",           "Tiling (0 = none, 1 = 256 x 256, 2 = 512 x 512, 3 = 1024 x 1024, 4 = optimize for random access, 5 = custom)" }
+
+static const GimpParamDef save_args[] =
+{
+    SAVE_ARGS
+};
+
+static const GimpParamDef save2_args[] =
+{
+    SAVE_ARGS,
+    { GIMP_PDB_INT32,   "index-table",      "Write an index table for region decoding (0 = no, 1 = yes)" },
+    { GIMP_PDB_INT32,   "num-tile-columns", "Number of custom tile column widths (0 - 256)" },
+    { GIMP_PDB_INT32ARRAY, "tile-columns",  "Custom tile column widths in pixels, multiples of 16; the last width is repeated to the right edge" },
+    { GIMP_PDB_INT32,   "num-tile-rows",    "Number of custom tile row heights (0 - 256)" },
+    { GIMP_PDB_INT32ARRAY, "tile-rows",     "Custom tile row heights in pixels, multiples of 16; the last height is repeated to the bottom edge" },
+    { GIMP_PDB_INT32,   "metric",           "Quality metric the quantizers are tuned for (0 = PSNR, 1 = SSIM)" },
+    { GIMP_PDB_INT32,   "optimize-lossless", "At quality 100, keep the smallest of several lossless encodes (0 = no, 1 = yes)" },
+    { GIMP_PDB_INT32,   "skip-unchanged",   "Keep the existing file if it was saved from the same pixels and options (0 = no, 1 = yes)" }
+};
+
+static const GimpParamDef save_derivatives_args[] =
+{
+    { GIMP_PDB_INT32,       "run-mode",         "Interactive, non-interactive" },
+    { GIMP_PDB_STRING,      "filename",         "The name of the JPEG XR file to derive the outputs from" },
+    { GIMP_PDB_INT32,       "num-outputs",      "The number of outputs" },
+    { GIMP_PDB_STRINGARRAY, "output-filenames", "The names of the files to save the outputs in" },
+    { GIMP_PDB_INT32,       "num-widths",       "The number of widths, equal to num-outputs" },
+    { GIMP_PDB_INT32ARRAY,  "widths",           "Width of each output in pixels, at most the width of the source; the height keeps the aspect ratio" },
+    { GIMP_PDB_INT32,       "num-qualities",    "The number of qualities, equal to num-outputs" },
+    { GIMP_PDB_INT32ARRAY,  "qualities",        "Quality of each output (0 <= quality <= 100, 100 = lossless)" }
+};
+
+static const GimpParamDef save_layers_args[] =
+{
+    { GIMP_PDB_INT32,   "run-mode",         "Interactive, non-interactive" },
+    { GIMP_PDB_IMAGE,   "image",            "Input image" },
+    { GIMP_PDB_STRING,  "filename-pattern", "Names of the files to save the layers in: %d is replaced by the position of the layer (0 = top), %s by its name" }
+};
+
+static const GimpParamDef save_layers_return_vals[] =
+{
+    { GIMP_PDB_INT32,       "num-layers",   "The number of layers" },
+    { GIMP_PDB_INT32ARRAY,  "statuses",     "1 for each layer that was saved, 0 for layers that failed or whose file name a layer above already used, from top to bottom" }
+};
+
 G_BEGIN_DECLS
 
 MAIN()
 
 static void query()
 {
-    static const GimpParamDef load_args[] =
-    {
-        { GIMP_PDB_INT32,   "run-mode",     "Interactive, non-interactive" },
-        { GIMP_PDB_STRING,  "filename",     "The name of the file to load" },
-        { GIMP_PDB_STRING,  "raw-filename", "The name entered" }
-    };
-    
-    static const GimpParamDef load_return_vals[] =
-    {
-        { GIMP_PDB_IMAGE,   "image", "Output image" }
-    };
-
-    static const GimpParamDef save_args[] =
-    {
-        { GIMP_PDB_INT32,   "run-mode",         "Interactive, non-interactive" },
-        { GIMP_PDB_IMAGE,   "image",            "Input image" },
-        { GIMP_PDB_DRAWABLE,"drawable",         "Drawable to save" },
-        { GIMP_PDB_STRING,  "filename",         "The name of the file to save the image in" },
-        { GIMP_PDB_STRING,  "raw-filename",     "The name entered" },
-        { GIMP_PDB_INT32,   "quality",          "Quality of saved image (0 <= quality <= 100, 100 = lossless)" },
-        { GIMP_PDB_INT32,   "alpha-quality",    "Quality of alpha channel (0 <= quality <= 100, 100 = lossless)" }, 
-        { GIMP_PDB_INT32,   "overlap",          "Overlap level (0 = auto, 1 = none, 2 = one level, 3 = two level)" },
-        { GIMP_PDB_INT32,   "subsampling",      "Chroma subsampling (0 = Y-only, 1 = 4:2:0, 2 = 4:2:2, 3 = 4:4:4)" },
-        { GIMP_PDB_INT32,   "tiling",           "Tiling (0 = none, 1 = 256 x 256, 2 = 512 x 512, 3 = 1024 x 1024)" },   
-    };
-
     gimp_install_procedure(LOAD_PROC,
         N_("Loads JPEG XR images"),
         "Loads JPEG XR image files.",
@@ -61,6 +144,54 @@ static void query()
     gimp_register_file_handler_mime(LOAD_PROC, "image/vnd.ms-photo");
     gimp_register_magic_load_handler(LOAD_PROC, "jxr,wdp,hdp", "", "0,string,II\xBC");
     
+    gimp_install_procedure(LOAD_MULTIPLE_PROC,
+        "Loads multiple JPEG XR images",
+        "Loads a list of JPEG XR image files, decoding them in parallel. "
+        "The number of files decoded at the same time is limited by the number of processors "
+        "and by the memory budget set in the GIMP_JXR_LOAD_MEMORY environment variable (1G by default).",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_PLUGIN,
+        G_N_ELEMENTS(load_multiple_args),
+        G_N_ELEMENTS(load_multiple_return_vals),
+        load_multiple_args, load_multiple_return_vals);
+
+    gimp_install_procedure(LOAD_REGION_PROC,
+        "Loads a region of a JPEG XR image",
+        "Loads a rectangle of a JPEG XR image file, optionally reduced by a power of two. "
+        "If the GIMP_JXR_TILE_CACHE environment variable names a directory, decoded tiles are "
+        "kept there and later loads of the same file are served from it "
+        "(up to GIMP_JXR_TILE_CACHE_SIZE bytes, 1G by default).",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_PLUGIN,
+        G_N_ELEMENTS(load_region_args),
+        G_N_ELEMENTS(load_return_vals),
+        load_region_args, load_return_vals);
+
+    gimp_install_procedure(LOAD_INCREMENTAL_PROC,
+        "Loads a JPEG XR image while it is being written",
+        "Loads a JPEG XR image from a file that is still being written, or from a pipe or FIFO "
+        "(\"-\" reads standard input). Rows are decoded as soon as their data has arrived and, "
+        "in interactive mode, shown in a display right away. The file must be written front to back; "
+        "loading ends with an error if no new data arrives for GIMP_JXR_INCREMENTAL_TIMEOUT seconds "
+        "(30 by default).",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_PLUGIN,
+        G_N_ELEMENTS(load_args),
+        G_N_ELEMENTS(load_return_vals),
+        load_args, load_return_vals);
+    
     gimp_install_procedure(SAVE_PROC,
         N_("Saves JPEG XR images"),
         "Saves JPEG XR image files.",
@@ -75,14 +206,176 @@ static void query()
     
     gimp_register_save_handler(SAVE_PROC, "jxr", "");
     gimp_register_file_handler_mime(SAVE_PROC, "image/vnd.ms-photo");
+
+    gimp_install_procedure(SAVE2_PROC,
+        "Saves JPEG XR images with all options",
+        "Saves JPEG XR image files like file-jxr-save, with further arguments for the index table, "
+        "custom tiles, the quality metric, lossless size optimization and skipping unchanged outputs.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        "RGB*, GRAY, INDEXED",
+        GIMP_PLUGIN,
+        G_N_ELEMENTS(save2_args), 0,
+        save2_args, 0);
+
+    gimp_install_procedure(SAVE_DERIVATIVES_PROC,
+        "Saves scaled copies of a JPEG XR image",
+        "Decodes a JPEG XR file once and saves it at several sizes and qualities. "
+        "Each output is scaled from the nearest level of a pyramid of halvings of the source "
+        "and encoded in parallel with the other outputs. Settings other than the quality "
+        "are the defaults, or the last used save settings when run with last values.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_PLUGIN,
+        G_N_ELEMENTS(save_derivatives_args), 0,
+        save_derivatives_args, 0);
+
+    gimp_install_procedure(SAVE_LAYERS_PROC,
+        "Saves each layer of an image as a JPEG XR file",
+        "Saves every top-level layer of an image at its own size into a file of its own, "
+        "encoding the layers in parallel with the same settings. Layer masks are applied; "
+        "opacity, mode and visibility are ignored. Interactive calls ask for the settings once, "
+        "other calls use the defaults or, when run with last values, the last used save settings.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_PLUGIN,
+        G_N_ELEMENTS(save_layers_args),
+        G_N_ELEMENTS(save_layers_return_vals),
+        save_layers_args, save_layers_return_vals);
+
+    gimp_install_procedure(EXTENSION_PROC,
+        "Keeps the JPEG XR plug-in resident",
+        "Starts a persistent JPEG XR plug-in process that provides "
+        "file-jxr-load-resident, file-jxr-save-resident and file-jxr-save2-resident. These behave like "
+        "file-jxr-load, file-jxr-save and file-jxr-save2 but avoid starting a new process and "
+        "setting up jxrlib for every call, which speeds up batch processing.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_EXTENSION,
+        0, 0,
+        NULL, NULL);
+}
+
+static void quit()
+{
+    release_factories();
 }
 
 static void run(const gchar* name, gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
 {
+    run_count++;
+
+    if (last_return_vals != NULL)
+    {
+        gimp_destroy_params(last_return_vals, last_nreturn_vals);
+        last_return_vals = NULL;
+    }
+
+    trace_init();
+    workers_init();
+
     if (strcmp(name, LOAD_PROC) == 0)
         load(nparams, param, nreturn_vals, return_vals);
-    else if (strcmp(name, SAVE_PROC) == 0)
+    else if (strcmp(name, SAVE_PROC) == 0 || strcmp(name, SAVE2_PROC) == 0)
+        save(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, LOAD_MULTIPLE_PROC) == 0)
+        load_multiple(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, LOAD_REGION_PROC) == 0)
+        load_region(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, LOAD_INCREMENTAL_PROC) == 0)
+        load_incremental(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, SAVE_DERIVATIVES_PROC) == 0)
+        save_derivatives(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, SAVE_LAYERS_PROC) == 0)
+        save_layers(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, LOAD_RESIDENT_PROC) == 0)
+        load(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, SAVE_RESIDENT_PROC) == 0 || strcmp(name, SAVE2_RESIDENT_PROC) == 0)
         save(nparams, param, nreturn_vals, return_vals);
+    else if (strcmp(name, EXTENSION_PROC) == 0)
+        run_extension(nreturn_vals, return_vals);
+
+    // every procedure above returns a g_new'd array whose strings and
+    // arrays are allocated as well
+    last_return_vals = *return_vals;
+    last_nreturn_vals = *nreturn_vals;
+
+    trace_flush();
+}
+
+static void run_extension(gint* nreturn_vals, GimpParam** return_vals)
+{
+    static GimpParam ret_values[1];
+
+    gimp_install_temp_proc(LOAD_RESIDENT_PROC,
+        "Loads JPEG XR images (resident)",
+        "Loads JPEG XR image files using the resident plug-in process.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        NULL,
+        GIMP_TEMPORARY,
+        G_N_ELEMENTS(load_args),
+        G_N_ELEMENTS(load_return_vals),
+        load_args, load_return_vals,
+        (GimpRunProc)run);
+
+    gimp_install_temp_proc(SAVE_RESIDENT_PROC,
+        "Saves JPEG XR images (resident)",
+        "Saves JPEG XR image files using the resident plug-in process.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        "RGB*, GRAY, INDEXED",
+        GIMP_TEMPORARY,
+        G_N_ELEMENTS(save_args), 0,
+        save_args, NULL,
+        (GimpRunProc)run);
+
+    gimp_install_temp_proc(SAVE2_RESIDENT_PROC,
+        "Saves JPEG XR images with all options (resident)",
+        "Saves JPEG XR image files like file-jxr-save2, using the resident plug-in process.",
+        "Christoph Hausner",
+        "Christoph Hausner",
+        "2013",
+        NULL,
+        "RGB*, GRAY, INDEXED",
+        GIMP_TEMPORARY,
+        G_N_ELEMENTS(save2_args), 0,
+        save2_args, NULL,
+        (GimpRunProc)run);
+
+    ret_values[0].type          = GIMP_PDB_STATUS;
+    ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+
+    *nreturn_vals = 1;
+    *return_vals = ret_values;
+
+    gimp_extension_ack();
+
+    // release pooled pixel buffers once no call has come in for a while
+    while (TRUE)
+    {
+        guint last_run_count = run_count;
+
+        gimp_extension_process(IDLE_TRIM_TIMEOUT);
+
+        if (run_count == last_run_count)
+            buffer_pool_trim();
+    }
 }
 
 G_END_DECLS
\ No newline at end of file
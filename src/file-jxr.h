@@ -4,9 +4,22 @@
 #include <string.h>
 #include <libgimp/gimp.h>
 
-#define LOAD_PROC       "file-jxr-load"
-#define SAVE_PROC       "file-jxr-save"
-#define PLUG_IN_BINARY  "file-jxr"
+#define LOAD_PROC             "file-jxr-load"
+#define SAVE_PROC             "file-jxr-save"
+#define LOAD_MULTIPLE_PROC    "file-jxr-load-multiple"
+#define LOAD_REGION_PROC      "file-jxr-load-region"
+#define LOAD_INCREMENTAL_PROC "file-jxr-load-incremental"
+#define SAVE_DERIVATIVES_PROC "file-jxr-save-derivatives"
+#define SAVE_LAYERS_PROC      "file-jxr-save-layers"
+#define EXTENSION_PROC        "extension-file-jxr"
+#define LOAD_RESIDENT_PROC    "file-jxr-load-resident"
+#define SAVE_RESIDENT_PROC    "file-jxr-save-resident"
+#define SAVE2_PROC            "file-jxr-save2"
+#define SAVE2_RESIDENT_PROC   "file-jxr-save2-resident"
+#define PLUG_IN_BINARY        "file-jxr"
+
+// Part of the digest of skipped saves; raise it when the encoder output changes
+#define PLUG_IN_VERSION       "1.0"
 
 #define _(String) (String)
 #define N_(String) (String)
@@ -0,0 +1,299 @@
+#include "save.h"
+#include "composite.h"
+#include "trace.h"
+#include "buffers.h"
+#include "workers.h"
+
+#include <libgimp/gimpui.h>
+
+// Saves each top-level layer of an image as a file of its own. Layers are
+// read one after the other on the main thread (libgimp is not thread-safe)
+// and encoded on the worker pool while the next ones are read. At most one
+// layer per worker plus one is held in memory at a time. Every layer is
+// saved at its own size with the same options; its opacity, mode and
+// visibility are ignored, an applied layer mask is applied. A layer whose
+// file name was already given to a layer above it (two layers with the same
+// name under %s) is not saved and gets a failed status, so that it does not
+// overwrite the other file.
+
+typedef struct
+{
+    GMutex          mutex;
+    GCond           cond;
+    guint           pending;
+    guint           done;
+} LayerBatch;
+
+typedef struct
+{
+    LayerBatch*         batch;
+    gchar*              filename;
+    Image               image;
+    const SaveOptions*  save_options;
+    ERR                 err;
+} LayerTask;
+
+static gchar* get_layer_filename(const gchar* pattern, gint index, gint32 layer_ID);
+static void run_layer_task(gpointer data);
+
+void save_layers(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
+{
+    GimpParam*          ret_values;
+    GimpRunMode         run_mode;
+    gint32              image_ID;
+    const gchar*        pattern;
+    SaveOptions         save_options = DEFAULT_SAVE_OPTIONS;
+    gint32*             layers;
+    gint                count;
+    gint32*             statuses;
+    LayerTask*          tasks;
+    LayerBatch          batch;
+    TaskGroup*          group;
+    GHashTable*         filenames;
+    Composition         composition;
+    Progress            progress;
+    GimpParasite*       icc_parasite;
+    GimpParasite*       xmp_parasite;
+    gdouble             res_x, res_y;
+    guint               limit;
+    gboolean            cancelled = FALSE;
+    gint64              start;
+    gint                i;
+
+    start = trace_begin();
+
+    run_mode = (GimpRunMode)param[0].data.d_int32;
+    image_ID = param[1].data.d_int32;
+    pattern  = param[2].data.d_string;
+
+    ret_values = g_new0(GimpParam, 3);
+
+    *nreturn_vals = 1;
+    *return_vals = ret_values;
+    ret_values[0].type = GIMP_PDB_STATUS;
+    ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+
+    // every layer needs a file name of its own
+    if (nparams != 3 || pattern == NULL || (strstr(pattern, "%d") == NULL && strstr(pattern, "%s") == NULL))
+        return;
+
+    switch (run_mode)
+    {
+    case GIMP_RUN_INTERACTIVE:
+        gimp_ui_init(PLUG_IN_BINARY, FALSE);
+        gimp_get_data(SAVE_PROC, &save_options);
+
+        if (!show_options(&save_options, TRUE, TRUE))
+        {
+            ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+            return;
+        }
+
+        gimp_set_data(SAVE_PROC, &save_options, sizeof(SaveOptions));
+        break;
+
+    case GIMP_RUN_WITH_LAST_VALS:
+        gimp_get_data(SAVE_PROC, &save_options);
+        break;
+
+    default:
+        break;
+    }
+
+    gimp_progress_init_printf(_("Saving layers to '%s'"), gimp_filename_to_utf8(pattern));
+
+    progress_init(&progress);
+
+    if (!gimp_image_get_resolution(image_ID, &res_x, &res_y))
+        res_x = res_y = 72.0;
+
+    icc_parasite = gimp_image_parasite_find(image_ID, "icc-profile");
+    xmp_parasite = gimp_image_parasite_find(image_ID, "gimp-metadata");
+
+    if (xmp_parasite != NULL && (gimp_parasite_data_size(xmp_parasite) <= 10 || strncmp(gimp_parasite_data(xmp_parasite), "GIMP_XMP_1", 10) != 0))
+    {
+        gimp_parasite_free(xmp_parasite);
+        xmp_parasite = NULL;
+    }
+
+    layers = gimp_image_get_layers(image_ID, &count);
+    statuses = g_new0(gint32, MAX(count, 1));
+    tasks = g_new0(LayerTask, MAX(count, 1));
+
+    g_mutex_init(&batch.mutex);
+    g_cond_init(&batch.cond);
+    batch.pending = 0;
+    batch.done = 0;
+
+    group = task_group_new();
+    limit = get_worker_count() + 1;
+    filenames = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (i = 0; i < count && !cancelled; i++)
+    {
+        LayerTask* task = &tasks[i];
+
+        task->filename = get_layer_filename(pattern, i, layers[i]);
+
+        if (g_hash_table_lookup(filenames, task->filename) != NULL)
+        {
+            task->err = WMP_errFail;
+
+            g_mutex_lock(&batch.mutex);
+            batch.done++;
+            g_mutex_unlock(&batch.mutex);
+            continue;
+        }
+
+        g_hash_table_insert(filenames, task->filename, task->filename);
+
+        // wait for an encode to finish before reading more pixels
+        g_mutex_lock(&batch.mutex);
+
+        while (batch.pending >= limit)
+            g_cond_wait(&batch.cond, &batch.mutex);
+
+        batch.pending++;
+
+        g_mutex_unlock(&batch.mutex);
+
+        task->batch = &batch;
+        task->save_options = &save_options;
+
+        composition_init_layer(&composition, image_ID, layers[i]);
+
+        task->err = composition_read(&composition, &task->image, NULL);
+
+        composition_free(&composition);
+
+        task->image.resolution_x = (gfloat)res_x;
+        task->image.resolution_y = (gfloat)res_y;
+
+        if (icc_parasite != NULL)
+        {
+            task->image.color_context = (guchar*)gimp_parasite_data(icc_parasite);
+            task->image.color_context_size = gimp_parasite_data_size(icc_parasite);
+        }
+
+        if (xmp_parasite != NULL)
+        {
+            task->image.xmp_metadata = (guchar*)gimp_parasite_data(xmp_parasite) + 10; // skip metadata marker "GIMP_XMP_1"
+            task->image.xmp_metadata_size = gimp_parasite_data_size(xmp_parasite) - 10;
+        }
+
+        task_group_push(group, run_layer_task, task);
+
+        g_mutex_lock(&batch.mutex);
+        cancelled = !progress_update(&progress, (gdouble)batch.done / count);
+        g_mutex_unlock(&batch.mutex);
+    }
+
+    // report progress while the last layers are encoded
+    g_mutex_lock(&batch.mutex);
+
+    while (batch.pending > 0)
+    {
+        g_cond_wait(&batch.cond, &batch.mutex);
+        progress_update(&progress, (gdouble)batch.done / count);
+    }
+
+    g_mutex_unlock(&batch.mutex);
+
+    task_group_free(group);
+
+    g_mutex_clear(&batch.mutex);
+    g_cond_clear(&batch.cond);
+
+    g_hash_table_destroy(filenames);
+
+    for (i = 0; i < count; i++)
+    {
+        statuses[i] = tasks[i].filename != NULL && !Failed(tasks[i].err);
+        g_free(tasks[i].filename);
+    }
+
+    if (icc_parasite != NULL)
+        gimp_parasite_free(icc_parasite);
+
+    if (xmp_parasite != NULL)
+        gimp_parasite_free(xmp_parasite);
+
+    g_free(tasks);
+    g_free(layers);
+
+    *nreturn_vals = 3;
+    ret_values[0].data.d_status = cancelled ? GIMP_PDB_CANCEL : GIMP_PDB_SUCCESS;
+    ret_values[1].type          = GIMP_PDB_INT32;
+    ret_values[1].data.d_int32  = count;
+    ret_values[2].type          = GIMP_PDB_INT32ARRAY;
+    ret_values[2].data.d_int32array = statuses;
+
+    gimp_progress_end();
+    trace_end("save-layers", start);
+}
+
+// Replaces %d in pattern with the position of the layer in the layer stack
+// (0 = top), %s with its name and %% with %.
+static gchar* get_layer_filename(const gchar* pattern, gint index, gint32 layer_ID)
+{
+    GString*        filename = g_string_new(NULL);
+    gchar*          name;
+    const gchar*    p;
+
+    for (p = pattern; *p != '\0'; p++)
+    {
+        if (p[0] != '%' || p[1] == '\0')
+        {
+            g_string_append_c(filename, *p);
+            continue;
+        }
+
+        p++;
+
+        switch (*p)
+        {
+        case 'd':
+            g_string_append_printf(filename, "%d", index);
+            break;
+        case 's':
+            // layer names may contain characters that are not allowed in file names
+            name = gimp_item_get_name(layer_ID);
+            g_strdelimit(name, "/\\:*?\"<>|", '_');
+            g_string_append(filename, name);
+            g_free(name);
+            break;
+        default:
+            g_string_append_c(filename, *p);
+            break;
+        }
+    }
+
+    return g_string_free(filename, FALSE);
+}
+
+static void run_layer_task(gpointer data)
+{
+    LayerTask*  task = (LayerTask*)data;
+    Image*      image = &task->image;
+
+    if (!Failed(task->err))
+    {
+        if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormatBlackWhite))
+        {
+            convert_indexed_bw(image->pixels, image->width, image->height);
+            image->stride = (image->width + 7) / 8;
+        }
+
+        task->err = jxrlib_save(task->filename, image, task->save_options, NULL);
+
+        buffer_free(&image->pixels);
+    }
+
+    g_mutex_lock(&task->batch->mutex);
+
+    task->batch->pending--;
+    task->batch->done++;
+
+    g_cond_signal(&task->batch->cond);
+    g_mutex_unlock(&task->batch->mutex);
+}
@@ -1,11 +1,129 @@
-#include "file-jxr.h"
-#include <JXRGlue.h>
-#include "utils.h"
+#include "load.h"
+#include "transfer.h"
+#include "trace.h"
+#include "workers.h"
+#include "buffers.h"
+#include "tilecache.h"
+#include "colortransform.h"
+#include "stream.h"
 #include <glib/gprintf.h>
 
-static ERR jxrlib_load(const gchar* filename, Image* image, gchar** error_message);
+// Rows are decoded in bands of about this many bytes
+#define BAND_SIZE (8 << 20)
+
+// Share of the progress bar given to decoding; the rest covers the transfer
+// of the pixels to GIMP
+#define DECODE_PROGRESS 0.8
+
+// Region loads decode neighbouring missing tiles together, up to this many
+// bytes of decoded pixels at a time
+#define CHUNK_SIZE (64 << 20)
+
+// Incremental loads decode and show one macroblock row at a time
+#define INCREMENTAL_BAND_ROWS 16
+
+typedef struct
+{
+    const PKPixelFormatGUID*    target_format;
+    guint                       bytes_per_pixel;
+    guint                       decode_stride;
+    guint                       band_rows;
+    gboolean                    direct;
+    guint64                     image_size;
+    guint64                     band_size;
+} DecodeLayout;
+
+typedef struct
+{
+    const ColorTransform*   transform;
+    guchar*                 pixels;
+    guint                   width;
+    guint                   rows;
+    guint                   stride;
+} TransformTask;
+
+typedef struct
+{
+    guint               scale;
+    guint               image_width;
+    guint               image_height;
+    PKPixelFormatGUID   pixel_format;
+    guint               bytes_per_pixel;
+    guint               width;          // size of the scaled image
+    guint               height;
+    guint               x0;             // region in the scaled image
+    guint               y0;
+    guint               x1;
+    guint               y1;
+} TileGrid;
+
+typedef struct
+{
+    const gchar*    filename;
+    Image           image;
+    ERR             err;
+    gchar*          error_message;
+    guint64         reserved;
+    gboolean        done;
+} LoadJob;
+
+typedef struct
+{
+    GMutex          mutex;
+    GCond           cond;
+    LoadJob*        jobs;
+} LoadBatch;
+
+typedef struct
+{
+    LoadBatch*      batch;
+    LoadJob*        job;
+} LoadTask;
+
+// Called with each band of rows as soon as it is decoded
+typedef void (*BandFunc)(const Image* image, guint y, guint rows, gpointer data);
+
+typedef struct
+{
+    guint           band_rows;
+    BandFunc        func;
+    gpointer        data;
+} BandListener;
+
+// Image of an incremental load, created when the first band arrives
+typedef struct
+{
+    const gchar*    filename;
+    gboolean        display;
+    gint32          image_ID;
+    gint32          layer_ID;
+    gint32          display_ID;
+    GimpDrawable*   drawable;
+} IncrementalView;
+
+static ERR jxrlib_estimate_size(const gchar* filename, guint64* size);
 static ERR get_target_pixel_format(const PKPixelFormatGUID* source, const PKPixelFormatGUID** target);
-static void compact_stride(guchar* pixels, gint width, gint height, gint stride, gint bytes_per_pixel);
+static ERR get_decode_layout(guint width, guint height, const PKPixelFormatGUID* pixel_format, DecodeLayout* layout);
+static ERR read_header(PKImageDecode* decoder, Image* image, DecodeLayout* layout, gchar** error_message);
+static ERR read_metadata(PKImageDecode* decoder, Image* image);
+static ERR check_limits(PKImageDecode* decoder, const Image* image, guint64 pixel_memory, gchar** error_message);
+static ERR create_converter(PKCodecFactory* codec_factory, PKImageDecode* decoder, const PKPixelFormatGUID* target_format, PKFormatConverter** converter);
+static ERR decode_file(const gchar* filename, struct WMPStream* stream, const BandListener* listener, Image* image, gchar** error_message, Progress* progress);
+static ERR create_decoder(PKCodecFactory* codec_factory, const gchar* filename, struct WMPStream* stream, PKImageDecode** decoder);
+static ERR decode_bands(PKFormatConverter* converter, Image* image, const DecodeLayout* layout, guchar* band, const ColorTransform* transform, const BandListener* listener, guint* rows_done, Progress* progress);
+static void run_transform_task(gpointer data);
+static gchar* get_unsupported_format_message(const PKPixelFormatGUID* pf);
+static ERR decode_tiles(const gchar* filename, const TileGrid* grid, guint row, guint first, guint last, const gboolean* missing, TileCache* cache, Image* image);
+static void set_region_of_interest(PKImageDecode* decoder, const PKRect* rect);
+static guint64 get_chunk_size(const TileGrid* grid);
+static void get_tile_info(const TileGrid* grid, guint column, guint row, TileInfo* tile);
+static void get_tile_overlap(const TileGrid* grid, const TileInfo* tile, guint* x0, guint* y0, guint* x1, guint* y1);
+static gint32 create_image(const gchar* filename, Image* image, Progress* progress);
+static gint32 new_image(const gchar* filename, const Image* image, gint32* layer_ID);
+static void attach_metadata(gint32 image_ID, Image* image);
+static void show_band(const Image* image, guint y, guint rows, gpointer data);
+static gchar* get_load_error_message(ERR err, gchar* error_message);
+static void run_load_task(gpointer data);
 
 void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
 {
@@ -16,13 +134,9 @@ void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
     ERR                 err;
 
     Image               image;
-
-    GimpImageBaseType   base_type;
-    GimpImageType       image_type;
     gint32              image_ID;
-    gint32              layer_ID;
-    GimpDrawable*       drawable;
-    GimpPixelRgn        pixel_rgn;
+    gint64              load_start;
+    Progress            progress;
 
     /*clock_t             time;
     gchar*              time_message;*/
@@ -31,9 +145,11 @@ void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
     while (TRUE) { }
 #endif*/
 
+    load_start = trace_begin();
+
     filename = param[1].data.d_string;
 
-    ret_values = g_new(GimpParam, 2);
+    ret_values = g_new0(GimpParam, 2);
 
     *nreturn_vals = 2;
     *return_vals = ret_values;  
@@ -42,32 +158,31 @@ void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
 
     /*time = clock();*/
 
-    err = jxrlib_load(filename, &image, &error_message);
+    progress_init(&progress);
+    progress_set_stage(&progress, 0.0, DECODE_PROGRESS);
 
-    if (Failed(err))
+    err = jxrlib_load(filename, &image, &error_message, &progress);
+
+    if (err == ERR_CANCELLED)
     {
-        if (error_message == NULL)
-        {
-            switch (err)
-            {
-            case WMP_errFileIO:
-                error_message = _("Error opening file.");
-                break;
-            case WMP_errOutOfMemory:
-                error_message = _("Out of memory.");
-                break;
-            default:
-                error_message = _("An error occurred during image loading.");
-                break;
-            }
-        }
+        *nreturn_vals = 1;
+        ret_values[0].type          = GIMP_PDB_STATUS;
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+
+        gimp_progress_end();
+        trace_end("load", load_start);
+        return;
+    }
 
+    if (Failed(err))
+    {
         ret_values[0].type          = GIMP_PDB_STATUS;
         ret_values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR; 
         ret_values[1].type          = GIMP_PDB_STRING;
-        ret_values[1].data.d_string = error_message;
+        ret_values[1].data.d_string = get_load_error_message(err, error_message);
         
         gimp_progress_end();
+        trace_end("load", load_start);
         return;
     }
 
@@ -77,212 +192,1249 @@ void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
     g_sprintf(time_message, _("Elapsed time: %f ms."), (double)(time) / CLOCKS_PER_SEC);
     g_message(time_message);*/
 
-    if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormat24bppRGB))
+    if (image.lossy_conversion)
     {
-        base_type = GIMP_RGB;
-        image_type = GIMP_RGB_IMAGE;
+        g_message(_("Warning:\n"
+                    "The image you are loading has a pixel format that is not directly supported by GIMP. "
+                    "In order to load this image it needs to be converted to a lower bit depth first. "
+                    "Information will be lost because of this conversion."));
     }
-    else if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormat32bppRGBA))
+
+    progress_set_stage(&progress, DECODE_PROGRESS, 1.0 - DECODE_PROGRESS);
+
+    image_ID = create_image(filename, &image, &progress);
+
+    if (image_ID == -1)
     {
-        base_type = GIMP_RGB;
-        image_type = GIMP_RGBA_IMAGE;
+        *nreturn_vals = 1;
+        ret_values[0].type          = GIMP_PDB_STATUS;
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
     }
-    else if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormat8bppGray))
+    else
     {
-        base_type = GIMP_GRAY;
-        image_type = GIMP_GRAY_IMAGE;
+        ret_values[0].type          = GIMP_PDB_STATUS;
+        ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+        ret_values[1].type          = GIMP_PDB_IMAGE;
+        ret_values[1].data.d_image  = image_ID;
     }
-    else if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormatBlackWhite))
+
+    gimp_progress_end();
+    trace_end("load", load_start);
+}
+
+// Loads a file that may still be growing, or a pipe or FIFO ("-" for standard
+// input). Each macroblock row is put into the image as soon as its data has
+// arrived and is decoded; in interactive mode the image is displayed from the
+// first row on.
+void load_incremental(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
+{
+    GimpParam*          ret_values;
+    gchar*              filename;
+    gchar*              error_message = NULL;
+    struct WMPStream*   stream = NULL;
+    IncrementalView     view;
+    BandListener        listener;
+    Image               image;
+    Progress            progress;
+    ERR                 err;
+    gint64              load_start;
+
+    load_start = trace_begin();
+
+    filename = param[1].data.d_string;
+
+    ret_values = g_new0(GimpParam, 2);
+
+    *nreturn_vals = 2;
+    *return_vals = ret_values;
+    ret_values[0].type = GIMP_PDB_STATUS;
+    ret_values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
+
+    memset(&view, 0, sizeof(view));
+    view.filename = filename;
+    view.display = (GimpRunMode)param[0].data.d_int32 == GIMP_RUN_INTERACTIVE;
+    view.image_ID = -1;
+    view.display_ID = -1;
+
+    listener.band_rows = INCREMENTAL_BAND_ROWS;
+    listener.func = show_band;
+    listener.data = &view;
+
+    gimp_progress_init_printf(_("Opening '%s'"), gimp_filename_to_utf8(filename));
+
+    progress_init(&progress);
+
+    err = stream_create_growing(&stream, filename);
+
+    if (!Failed(err))
+        err = decode_file(filename, stream, &listener, &image, &error_message, &progress);
+
+    if (stream != NULL)
+        stream->Close(&stream);
+
+    if (view.drawable != NULL)
+        gimp_drawable_detach(view.drawable);
+
+    if (!Failed(err))
     {
-        base_type = GIMP_INDEXED;
-        image_type = GIMP_INDEXED_IMAGE;
-    }
+        buffer_free(&image.pixels);
+        attach_metadata(view.image_ID, &image);
 
-    image_ID = gimp_image_new(image.width, image.height, base_type);
-    
-    gimp_image_set_filename(image_ID, filename);
-    gimp_image_set_resolution(image_ID, image.resolution_x, image.resolution_y);
-    
-    if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormatBlackWhite))
+        ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+        ret_values[1].type          = GIMP_PDB_IMAGE;
+        ret_values[1].data.d_image  = view.image_ID;
+    }
+    else
     {
-        guchar colormap[] = { 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF };
-        
-        if (image.black_one)
+        // closing the last display deletes the image as well
+        if (view.display_ID != -1)
+            gimp_display_delete(view.display_ID);
+        else if (view.image_ID != -1)
+            gimp_image_delete(view.image_ID);
+
+        if (err == ERR_CANCELLED)
         {
-            colormap[0] = colormap[1] = colormap[2] = 0xFF;
-            colormap[3] = colormap[4] = colormap[5] = 0x00;
+            *nreturn_vals = 1;
+            ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+        }
+        else
+        {
+            ret_values[1].type          = GIMP_PDB_STRING;
+            ret_values[1].data.d_string = get_load_error_message(err, error_message);
         }
-
-        gimp_image_set_colormap(image_ID, colormap, 2);
     }
 
-    layer_ID = gimp_layer_new(image_ID, "Background", image.width, image.height, image_type, 100.0, GIMP_NORMAL_MODE);
-    drawable = gimp_drawable_get(layer_ID);
+    gimp_progress_end();
+    trace_end("load-incremental", load_start);
+}
 
-    gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, image.width, image.height, TRUE, FALSE);
-    gimp_pixel_rgn_set_rect(&pixel_rgn, image.pixels, 0, 0, image.width, image.height);
+// Loads the rectangle x, y, width, height of a file, reduced by scale (a power
+// of two up to 16). The region is assembled from tiles of the scaled image;
+// tiles found in the tile cache are copied from there and only the missing
+// ones are decoded.
+void load_region(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
+{
+    GimpParam*          ret_values;
 
-    gimp_drawable_update(layer_ID, 0, 0, image.width, image.height);
-    gimp_image_add_layer(image_ID, layer_ID, 0);
-    gimp_drawable_detach(drawable);
+    gchar*              filename;
+    gchar*              error_message;
+    ERR                 err;
+
+    Region              region;
+    Image               image;
+    gint32              image_ID;
+    gint64              load_start;
+    Progress            progress;
+
+    load_start = trace_begin();
+
+    ret_values = g_new0(GimpParam, 2);
+
+    *nreturn_vals = 1;
+    *return_vals = ret_values;
+    ret_values[0].type          = GIMP_PDB_STATUS;
+    ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+
+    if (nparams != 8 || 
+        param[3].data.d_int32 < 0 || param[4].data.d_int32 < 0 || 
+        param[5].data.d_int32 <= 0 || param[6].data.d_int32 <= 0 ||
+        param[7].data.d_int32 < 1 || param[7].data.d_int32 > 16 || 
+        (param[7].data.d_int32 & (param[7].data.d_int32 - 1)) != 0)
+        return;
+
+    filename = param[1].data.d_string;
+
+    region.x        = param[3].data.d_int32;
+    region.y        = param[4].data.d_int32;
+    region.width    = param[5].data.d_int32;
+    region.height   = param[6].data.d_int32;
+    region.scale    = param[7].data.d_int32;
+
+    *nreturn_vals = 2;
+
+    gimp_progress_init_printf(_("Opening '%s'"), gimp_filename_to_utf8(filename));
+
+    progress_init(&progress);
+    progress_set_stage(&progress, 0.0, DECODE_PROGRESS);
 
-    PKFreeAligned(&image.pixels);
+    err = jxrlib_load_region(filename, &region, &image, &error_message, &progress);
 
-    if (image.color_context_size != 0)
+    if (err == ERR_CANCELLED)
     {
-        GimpParasite* parasite;
-        parasite = gimp_parasite_new("icc-profile", GIMP_PARASITE_PERSISTENT | GIMP_PARASITE_UNDOABLE, image.color_context_size, image.color_context);
-        gimp_image_attach_parasite(image_ID, parasite);        
-        gimp_parasite_free(parasite);
-        g_free(image.color_context);
+        *nreturn_vals = 1;
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+
+        gimp_progress_end();
+        trace_end("load-region", load_start);
+        return;
     }
 
-    if (image.xmp_metadata_size != 0)
+    if (Failed(err))
     {
-        guchar* parasite_data;
-        GimpParasite* parasite;
-        parasite_data = g_new(guchar, image.xmp_metadata_size + 10); // prepend XMP data with metadata marker "GIMP_XMP_1"
-        strncpy(parasite_data, "GIMP_XMP_1", 10);
-        g_memmove(parasite_data + 10, image.xmp_metadata, image.xmp_metadata_size);
-        parasite = gimp_parasite_new("gimp-metadata", GIMP_PARASITE_PERSISTENT | GIMP_PARASITE_UNDOABLE, image.xmp_metadata_size + 10, parasite_data);
-        gimp_image_attach_parasite(image_ID, parasite);
-        gimp_parasite_free(parasite);
-        g_free(image.xmp_metadata);
-        g_free(parasite_data);
+        ret_values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR; 
+        ret_values[1].type          = GIMP_PDB_STRING;
+        ret_values[1].data.d_string = get_load_error_message(err, error_message);
+        
+        gimp_progress_end();
+        trace_end("load-region", load_start);
+        return;
     }
 
-    ret_values[0].type          = GIMP_PDB_STATUS;
-    ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
-    ret_values[1].type          = GIMP_PDB_IMAGE;
-    ret_values[1].data.d_image  = image_ID;
+    progress_set_stage(&progress, DECODE_PROGRESS, 1.0 - DECODE_PROGRESS);
+
+    image_ID = create_image(filename, &image, &progress);
+
+    if (image_ID == -1)
+    {
+        *nreturn_vals = 1;
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+    }
+    else
+    {
+        ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
+        ret_values[1].type          = GIMP_PDB_IMAGE;
+        ret_values[1].data.d_image  = image_ID;
+    }
 
     gimp_progress_end();
+    trace_end("load-region", load_start);
 }
 
-static ERR jxrlib_load(const gchar* filename, Image* image, gchar** error_message)
+// Decodes a list of files on the worker pool and creates the GIMP images on the
+// calling thread in list order. Files are only handed to the workers while the
+// estimated size of all decoded but not yet consumed images stays within the
+// memory budget (GIMP_JXR_LOAD_MEMORY, 1 GiB by default); a single file larger
+// than the budget is still loaded, but on its own.
+void load_multiple(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals)
 {
-    ERR                 err;
-    PKCodecFactory*     codec_factory = NULL;
-    PKImageDecode*      decoder = NULL;
-    PKPixelFormatGUID*  target_format;
-    PKFormatConverter*  converter = NULL;
-    PKRect              rect;
-    
-    memset(image, 0, sizeof(*image));
+    GimpParam*          ret_values;
+    gint32              num_files;
+    gchar**             filenames;
+    gint32*             image_IDs;
 
-    *error_message = NULL;
+    LoadBatch           batch;
+    TaskGroup*          group;
+    guint64             budget;
+    guint64             in_use = 0;
+    gint32              next_submit = 0;
+    gint32              i;
+    gboolean            lossy_conversion = FALSE;
+    gint64              load_start;
 
-    Call(PKCreateCodecFactory(&codec_factory, WMP_SDK_VERSION));
+    load_start = trace_begin();
 
-    Call(codec_factory->CreateDecoderFromFile(filename, &decoder)); 
+    ret_values = g_new0(GimpParam, 3);
 
-    Call(decoder->GetSize(decoder, &image->width, &image->height)); 
-    Call(decoder->GetResolution(decoder, &image->resolution_x, &image->resolution_y));    
-    Call(decoder->GetPixelFormat(decoder, &image->pixel_format));
+    *nreturn_vals = 1;
+    *return_vals = ret_values;
+    ret_values[0].type          = GIMP_PDB_STATUS;
+    ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
 
-    Call(decoder->GetColorContext(decoder, NULL, &image->color_context_size));
-    if (image->color_context_size != 0)
-    {
-        image->color_context = g_new(guchar, image->color_context_size);
-        Call(decoder->GetColorContext(decoder, image->color_context, &image->color_context_size));
-    }
+    if (nparams != 3 || param[1].data.d_int32 < 0)
+        return;
 
-    Call(_PKImageDecode_GetXMPMetadata_WMP(decoder, NULL, &image->xmp_metadata_size));
-    if (image->xmp_metadata_size != 0)
-    {
-        image->xmp_metadata = g_new(guchar, image->xmp_metadata_size);
-        Call(_PKImageDecode_GetXMPMetadata_WMP(decoder, image->xmp_metadata, &image->xmp_metadata_size));
-    }
+    num_files = param[1].data.d_int32;
+    filenames = param[2].data.d_stringarray;
 
-    image->black_one = decoder->WMP.wmiSCP.bBlackWhite;
+    budget = get_env_size("GIMP_JXR_LOAD_MEMORY", G_GUINT64_CONSTANT(1) << 30);
 
-    Call(codec_factory->CreateFormatConverter(&converter));
-    
-    err = get_target_pixel_format(&image->pixel_format, &target_format);
+    image_IDs = g_new(gint32, MAX(num_files, 1));
 
-    if (!Failed(err))
-        err = converter->Initialize(converter, decoder, NULL, *target_format);
-    
-    if (Failed(err))
+    g_mutex_init(&batch.mutex);
+    g_cond_init(&batch.cond);
+    batch.jobs = g_new0(LoadJob, MAX(num_files, 1));
+
+    group = task_group_new();
+
+    gimp_progress_init_printf(_("Opening %d images"), num_files);
+
+    for (i = 0; i < num_files; i++)
     {
-        PKPixelFormatGUID* pf = &image->pixel_format;
-        gchar* mnemonic = get_pixel_format_mnemonic(pf);
+        LoadJob* job = &batch.jobs[i];
+
+        while (next_submit < num_files)
+        {
+            LoadJob*    next = &batch.jobs[next_submit];
+            LoadTask*   task;
+
+            next->filename = filenames[next_submit];
+
+            if (Failed(jxrlib_estimate_size(next->filename, &next->reserved)))
+                next->reserved = 0;
+
+            if (in_use > 0 && in_use + next->reserved > budget)
+                break;
+
+            in_use += next->reserved;
+
+            task = g_new(LoadTask, 1);
+            task->batch = &batch;
+            task->job = next;
+            task_group_push(group, run_load_task, task);
+
+            next_submit++;
+        }
 
-        *error_message = g_new(gchar, 128);
+        g_mutex_lock(&batch.mutex);
+        while (!job->done)
+            g_cond_wait(&batch.cond, &batch.mutex);
+        g_mutex_unlock(&batch.mutex);
 
-        if (mnemonic != NULL)
-            g_sprintf(*error_message, _("Image has an unsupported pixel format (%s)."), mnemonic);
+        if (Failed(job->err))
+        {
+            image_IDs[i] = -1;
+            g_free(job->error_message);
+        }
         else
-            g_sprintf(*error_message, _("Image has an unsupported pixel format (%08X-%04X-%04X-%02X%02X%02X%02X%02X%02X%02X%02X)."), 
-                pf->Data1, pf->Data2, pf->Data3, pf->Data4[0], pf->Data4[1], pf->Data4[2], pf->Data4[3], pf->Data4[4], pf->Data4[5], pf->Data4[6], pf->Data4[7]);
+        {
+            lossy_conversion |= job->image.lossy_conversion;
+            image_IDs[i] = create_image(job->filename, &job->image, NULL);
+        }
 
-        goto Cleanup;
+        in_use -= job->reserved;
+
+        gimp_progress_update((gdouble)(i + 1) / num_files);
     }
 
-    if (get_bits_per_pixel(target_format) < get_bits_per_pixel(&image->pixel_format))
+    task_group_free(group);
+
+    g_free(batch.jobs);
+    g_cond_clear(&batch.cond);
+    g_mutex_clear(&batch.mutex);
+
+    if (lossy_conversion)
     {
         g_message(_("Warning:\n"
-                    "The image you are loading has a pixel format that is not directly supported by GIMP. "
-                    "In order to load this image it needs to be converted to a lower bit depth first. "
-                    "Information will be lost because of this conversion."));
+                    "Some of the images you are loading have a pixel format that is not directly supported by GIMP. "
+                    "They have been converted to a lower bit depth and information was lost because of this conversion."));
     }
-    
-    decoder->WMP.wmiSCP.uAlphaMode = 
-        IsEqualGUID(target_format, &GUID_PKPixelFormat32bppRGBA) ? 2 : 0;
 
-    image->stride = (image->width * max(get_bits_per_pixel(&image->pixel_format), get_bits_per_pixel(target_format)) + 7) / 8;
+    *nreturn_vals = 3;
+    ret_values[0].data.d_status     = GIMP_PDB_SUCCESS;
+    ret_values[1].type              = GIMP_PDB_INT32;
+    ret_values[1].data.d_int32      = num_files;
+    ret_values[2].type              = GIMP_PDB_INT32ARRAY;
+    ret_values[2].data.d_int32array = image_IDs;
+
+    gimp_progress_end();
+    trace_end("load-multiple", load_start);
+}
 
-    Call(PKAllocAligned(&image->pixels, image->stride * image->height, 128));
+static void run_load_task(gpointer data)
+{
+    LoadTask*   task = (LoadTask*)data;
+    LoadJob*    job = task->job;
 
-    rect.X = 0;
-    rect.Y = 0;
-    rect.Width = image->width;
-    rect.Height = image->height;
+    job->err = jxrlib_load(job->filename, &job->image, &job->error_message, NULL);
 
-    Call(converter->Copy(converter, &rect, image->pixels, image->stride)); 
-    
-    if (!IsEqualGUID(target_format, &GUID_PKPixelFormatBlackWhite) &&
-        get_bits_per_pixel(&image->pixel_format) > get_bits_per_pixel(target_format))
-    {
-        guint bytes_per_pixel = get_bits_per_pixel(target_format) / 8;      
-        compact_stride(image->pixels, image->width, image->height, image->stride, bytes_per_pixel);   
-        image->stride = bytes_per_pixel * image->width;
-    }
-    
-    if (IsEqualGUID(target_format, &GUID_PKPixelFormatBlackWhite))
+    g_mutex_lock(&task->batch->mutex);
+    job->done = TRUE;
+    g_cond_broadcast(&task->batch->cond);
+    g_mutex_unlock(&task->batch->mutex);
+
+    g_free(task);
+}
+
+static gint32 create_image(const gchar* filename, Image* image, Progress* progress)
+{
+    gint32              image_ID;
+    gint32              layer_ID;
+    GimpDrawable*       drawable;
+    gint64              stage_start;
+    guint               y;
+    guint               rows;
+
+    stage_start = trace_begin();
+
+    image_ID = new_image(filename, image, &layer_ID);
+    drawable = gimp_drawable_get(layer_ID);
+
+    transfer_set_cache(image->width, TRANSFER_ROWS);
+
+    // hand over the pixels in bands to report progress
+    for (y = 0; y < image->height; y += rows)
     {
-        guchar* conv_pixels; 
-        
-        Call(convert_bw_indexed(image->pixels, image->width, image->height, &conv_pixels)); // should pass stride here
-                                                                                            // if there were formats converted to BlackWhite
+        rows = MIN(TRANSFER_ROWS, image->height - y);
+        transfer_set_rect(drawable, image->pixels + (gsize)y * image->stride, image->stride, 0, y, image->width, rows);
 
-        Call(PKFreeAligned(&image->pixels));
-        image->pixels = conv_pixels;
+        if (!progress_update(progress, (gdouble)(y + rows) / image->height))
+            break;
     }
-    
-    image->pixel_format = *target_format;
-        
-Cleanup:
-    if (Failed(err) && image->pixels)
-        PKFreeAligned(&image->pixels);
 
-    if (converter)
-        converter->Release(&converter);
+    gimp_drawable_update(layer_ID, 0, 0, image->width, image->height);
+    gimp_drawable_detach(drawable);
 
-    if (decoder)
-        decoder->Release(&decoder);
-    
-    if (codec_factory)
-        codec_factory->Release(&codec_factory);
+    buffer_free(&image->pixels);
 
-    return err;
+    trace_end("gimp-transfer", stage_start);
+
+    if (y < image->height)
+    {
+        gimp_image_delete(image_ID);
+        g_free(image->color_context);
+        g_free(image->xmp_metadata);
+        return -1;
+    }
+
+    attach_metadata(image_ID, image);
+
+    return image_ID;
 }
 
-static ERR get_target_pixel_format(const PKPixelFormatGUID* source, const PKPixelFormatGUID** target)
-{ 
-    ERR         err;
-    PKPixelInfo pixel_info;   
-    
+// Puts a decoded band of an incremental load into its image, creating the
+// image on the first band.
+static void show_band(const Image* image, guint y, guint rows, gpointer data)
+{
+    IncrementalView* view = (IncrementalView*)data;
+
+    if (view->image_ID == -1)
+    {
+        view->image_ID = new_image(view->filename, image, &view->layer_ID);
+        view->drawable = gimp_drawable_get(view->layer_ID);
+
+        // bands are shorter than a tile; keep the tile row being filled
+        transfer_set_cache(image->width, gimp_tile_height());
+
+        if (view->display)
+            view->display_ID = gimp_display_new(view->image_ID);
+    }
+
+    transfer_set_rect(view->drawable, image->pixels + (gsize)y * image->stride, image->stride, 0, y, image->width, rows);
+
+    gimp_drawable_flush(view->drawable);
+    gimp_drawable_update(view->layer_ID, 0, y, image->width, rows);
+
+    if (view->display)
+        gimp_displays_flush();
+}
+
+// Creates an image with a single empty layer for the pixel format of image.
+static gint32 new_image(const gchar* filename, const Image* image, gint32* layer_ID)
+{
+    GimpImageBaseType   base_type;
+    GimpImageType       image_type;
+    gint32              image_ID;
+
+    if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat24bppRGB))
+    {
+        base_type = GIMP_RGB;
+        image_type = GIMP_RGB_IMAGE;
+    }
+    else if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppRGBA))
+    {
+        base_type = GIMP_RGB;
+        image_type = GIMP_RGBA_IMAGE;
+    }
+    else if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat8bppGray))
+    {
+        base_type = GIMP_GRAY;
+        image_type = GIMP_GRAY_IMAGE;
+    }
+    else if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormatBlackWhite))
+    {
+        base_type = GIMP_INDEXED;
+        image_type = GIMP_INDEXED_IMAGE;
+    }
+
+    image_ID = gimp_image_new(image->width, image->height, base_type);
+    
+    gimp_image_set_filename(image_ID, filename);
+    gimp_image_set_resolution(image_ID, image->resolution_x, image->resolution_y);
+    
+    if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormatBlackWhite))
+    {
+        guchar colormap[] = { 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF };
+        
+        if (image->black_one)
+        {
+            colormap[0] = colormap[1] = colormap[2] = 0xFF;
+            colormap[3] = colormap[4] = colormap[5] = 0x00;
+        }
+
+        gimp_image_set_colormap(image_ID, colormap, 2);
+    }
+
+    *layer_ID = gimp_layer_new(image_ID, "Background", image->width, image->height, image_type, 100.0, GIMP_NORMAL_MODE);
+    gimp_image_add_layer(image_ID, *layer_ID, 0);
+
+    return image_ID;
+}
+
+// Attaches the color profile and XMP metadata of image and frees them.
+static void attach_metadata(gint32 image_ID, Image* image)
+{
+    if (image->color_context_size != 0)
+    {
+        GimpParasite* parasite;
+        // a profile the pixels were converted from is kept for reference only
+        parasite = gimp_parasite_new(image->color_converted ? "jxr-original-icc-profile" : "icc-profile",
+            GIMP_PARASITE_PERSISTENT | GIMP_PARASITE_UNDOABLE, image->color_context_size, image->color_context);
+        gimp_image_attach_parasite(image_ID, parasite);        
+        gimp_parasite_free(parasite);
+        g_free(image->color_context);
+    }
+
+    if (image->xmp_metadata_size != 0)
+    {
+        guchar* parasite_data;
+        GimpParasite* parasite;
+        parasite_data = g_new(guchar, image->xmp_metadata_size + 10); // prepend XMP data with metadata marker "GIMP_XMP_1"
+        strncpy(parasite_data, "GIMP_XMP_1", 10);
+        g_memmove(parasite_data + 10, image->xmp_metadata, image->xmp_metadata_size);
+        parasite = gimp_parasite_new("gimp-metadata", GIMP_PARASITE_PERSISTENT | GIMP_PARASITE_UNDOABLE, image->xmp_metadata_size + 10, parasite_data);
+        gimp_image_attach_parasite(image_ID, parasite);
+        gimp_parasite_free(parasite);
+        g_free(image->xmp_metadata);
+        g_free(parasite_data);
+    }
+
+}
+
+static gchar* get_load_error_message(ERR err, gchar* error_message)
+{
+    if (error_message != NULL)
+        return error_message;
+
+    switch (err)
+    {
+    case WMP_errFileIO:
+        return g_strdup(_("Error opening file."));
+    case WMP_errOutOfMemory:
+        return g_strdup(_("Out of memory."));
+    default:
+        return g_strdup(_("An error occurred during image loading."));
+    }
+}
+
+ERR jxrlib_load(const gchar* filename, Image* image, gchar** error_message, Progress* progress)
+{
+    return decode_file(filename, NULL, NULL, image, error_message, progress);
+}
+
+// Decodes filename, or stream if given. A listener receives the rows of each
+// band as soon as they are decoded, in bands of its size.
+static ERR decode_file(const gchar* filename, struct WMPStream* stream, const BandListener* listener, Image* image, gchar** error_message, Progress* progress)
+{
+    ERR                 err;
+    PKCodecFactory*     codec_factory = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKFormatConverter*  converter = NULL;
+    DecodeLayout        layout;
+    ColorTransform*     transform = NULL;
+    guchar*             band = NULL;
+    guint               rows_done;
+    gint64              start;
+    gint64              stage_start;
+    size_t              stream_pos;
+    
+    memset(image, 0, sizeof(*image));
+
+    *error_message = NULL;
+
+    start = stage_start = trace_begin();
+
+    Call(get_factories(NULL, &codec_factory));
+
+    Call(create_decoder(codec_factory, filename, stream, &decoder));
+
+    trace_end("decoder-init", stage_start);
+    stage_start = trace_begin();
+
+    Call(read_header(decoder, image, &layout, error_message));
+
+    if (listener != NULL)
+    {
+        layout.band_rows = MIN(listener->band_rows, image->height);
+        layout.band_size = layout.direct ? 0 : (guint64)layout.decode_stride * layout.band_rows;
+    }
+
+    Call(check_limits(decoder, image, layout.image_size + layout.band_size, error_message));
+    Call(read_metadata(decoder, image));
+
+    trace_end("read-header", stage_start);
+
+    err = create_converter(codec_factory, decoder, layout.target_format, &converter);
+    
+    if (Failed(err))
+    {
+        *error_message = get_unsupported_format_message(&image->pixel_format);
+        goto Cleanup;
+    }
+
+    image->lossy_conversion = get_bits_per_pixel(layout.target_format) < get_bits_per_pixel(&image->pixel_format);
+
+    image->stride = image->width * layout.bytes_per_pixel;
+
+    // images whose profile cannot be converted keep it as it is
+    if (image->color_context_size != 0 && get_env_size("GIMP_JXR_CONVERT_TO_SRGB", 0) != 0)
+        color_transform_new(image->color_context, image->color_context_size, layout.target_format, &transform);
+
+    Call(buffer_alloc(&image->pixels, layout.image_size));
+
+    trace_count("alloc-bytes", layout.image_size);
+
+    if (!layout.direct)
+    {
+        Call(buffer_alloc(&band, layout.band_size));
+
+        trace_count("alloc-bytes", layout.band_size);
+    }
+
+    image->pixel_format = *layout.target_format;
+
+    stage_start = trace_begin();
+
+    err = decode_bands(converter, image, &layout, band, transform, listener, &rows_done, progress);
+
+    if (err == WMP_errInvalidParameter && rows_done > 0)
+    {
+        // jxrlib builds without REENTRANT_MODE only decode from the top of the
+        // image; start over and decode everything in a single band, as long
+        // as the larger band still fits the memory limit
+        converter->Release(&converter);
+        decoder->Release(&decoder);
+
+        layout.band_rows = image->height;
+        layout.band_size = layout.direct ? 0 : (guint64)layout.decode_stride * image->height;
+
+        Call(create_decoder(codec_factory, filename, stream, &decoder));
+        Call(check_limits(decoder, image, layout.image_size + layout.band_size, error_message));
+
+        if (!layout.direct)
+        {
+            Call(buffer_free(&band));
+            Call(buffer_alloc(&band, layout.band_size));
+
+            trace_count("alloc-bytes", layout.band_size);
+        }
+
+        Call(create_converter(codec_factory, decoder, layout.target_format, &converter));
+
+        err = decode_bands(converter, image, &layout, band, transform, listener, &rows_done, progress);
+    }
+
+    Call(err);
+
+    trace_end("decode", stage_start);
+
+    if (trace_active && !Failed(decoder->pStream->GetPos(decoder->pStream, &stream_pos)))
+        trace_counter("stream-read-bytes", stream_pos);
+    
+    image->color_converted = transform != NULL;
+        
+Cleanup:
+    if (Failed(err))
+    {
+        if (image->pixels)
+            buffer_free(&image->pixels);
+
+        g_free(image->color_context);
+        g_free(image->xmp_metadata);
+    }
+
+    if (band)
+        buffer_free(&band);
+
+    color_transform_free(transform);
+
+    if (converter)
+        converter->Release(&converter);
+
+    if (decoder)
+        decoder->Release(&decoder);
+
+    trace_end("jxrlib-load", start);
+
+    return err;
+}
+
+// Decoders created from a stream do not own it; the stream is rewound so that
+// a decoder can be created again after a failed first attempt.
+static ERR create_decoder(PKCodecFactory* codec_factory, const gchar* filename, struct WMPStream* stream, PKImageDecode** decoder)
+{
+    ERR err;
+
+    if (stream == NULL)
+        return codec_factory->CreateDecoderFromFile(filename, decoder);
+
+    Call(stream->SetPos(stream, 0));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpDecode, (void**)decoder));
+    Call((*decoder)->Initialize(*decoder, stream));
+
+Cleanup:
+    return err;
+}
+
+static ERR read_header(PKImageDecode* decoder, Image* image, DecodeLayout* layout, gchar** error_message)
+{
+    ERR err;
+
+    Call(decoder->GetSize(decoder, &image->width, &image->height)); 
+    Call(decoder->GetResolution(decoder, &image->resolution_x, &image->resolution_y));    
+    Call(decoder->GetPixelFormat(decoder, &image->pixel_format));
+    Call(decoder->GetColorContext(decoder, NULL, &image->color_context_size));
+    Call(_PKImageDecode_GetXMPMetadata_WMP(decoder, NULL, &image->xmp_metadata_size));
+
+    err = get_decode_layout(image->width, image->height, &image->pixel_format, layout);
+
+    if (Failed(err))
+        *error_message = get_unsupported_format_message(&image->pixel_format);
+
+Cleanup:
+    return err;
+}
+
+static ERR read_metadata(PKImageDecode* decoder, Image* image)
+{
+    ERR err = WMP_errSuccess;
+
+    if (image->color_context_size != 0)
+    {
+        image->color_context = g_new(guchar, image->color_context_size);
+        Call(decoder->GetColorContext(decoder, image->color_context, &image->color_context_size));
+    }
+
+    if (image->xmp_metadata_size != 0)
+    {
+        image->xmp_metadata = g_new(guchar, image->xmp_metadata_size);
+        Call(_PKImageDecode_GetXMPMetadata_WMP(decoder, image->xmp_metadata, &image->xmp_metadata_size));
+    }
+
+    image->black_one = decoder->WMP.wmiSCP.bBlackWhite;
+
+Cleanup:
+    return err;
+}
+
+// The decoder writes rows in the layout of the wider of the source and the
+// target pixel format. Where that differs from the packed layout of the loaded
+// image (formats with more than 8 bits per channel, BlackWhite), each band is
+// decoded into a scratch buffer and converted into the image from there, so
+// that no second full-size buffer is needed.
+static ERR get_decode_layout(guint width, guint height, const PKPixelFormatGUID* pixel_format, DecodeLayout* layout)
+{
+    ERR     err;
+    guint64 decode_stride;
+
+    Call(get_target_pixel_format(pixel_format, &layout->target_format));
+
+    decode_stride = ((guint64)width * max(get_bits_per_pixel(pixel_format), get_bits_per_pixel(layout->target_format)) + 7) / 8;
+
+    FailIf(decode_stride > G_MAXINT32, WMP_errOutOfMemory);
+
+    if (IsEqualGUID(layout->target_format, &GUID_PKPixelFormatBlackWhite))
+        layout->bytes_per_pixel = 1;
+    else
+        layout->bytes_per_pixel = get_bits_per_pixel(layout->target_format) / 8;
+
+    layout->decode_stride = (guint)decode_stride;
+    layout->direct = !IsEqualGUID(layout->target_format, &GUID_PKPixelFormatBlackWhite) &&
+        decode_stride == (guint64)width * layout->bytes_per_pixel;
+    layout->band_rows = MAX(BAND_SIZE / layout->decode_stride / 64 * 64, 64);
+    layout->band_rows = MIN(layout->band_rows, height);
+    layout->image_size = (guint64)width * layout->bytes_per_pixel * height;
+    layout->band_size = layout->direct ? 0 : (guint64)layout->decode_stride * layout->band_rows;
+
+Cleanup:
+    return err;
+}
+
+// Rejects images whose header asks for more than the plug-in is configured to
+// handle, before any pixel memory is allocated. The limits are taken from
+// GIMP_JXR_MAX_PIXELS, GIMP_JXR_MAX_TILES and GIMP_JXR_MAX_MEMORY; pixel_memory
+// is the peak size of all pixel buffers the load will hold at the same time.
+static ERR check_limits(PKImageDecode* decoder, const Image* image, guint64 pixel_memory, gchar** error_message)
+{
+    guint64 pixels = (guint64)image->width * image->height;
+    guint64 tiles = (guint64)(decoder->WMP.wmiSCP.cNumOfSliceMinus1V + 1) * (decoder->WMP.wmiSCP.cNumOfSliceMinus1H + 1);
+    guint64 memory = pixel_memory + image->color_context_size + image->xmp_metadata_size;
+    guint64 max_pixels = get_env_size("GIMP_JXR_MAX_PIXELS", G_MAXUINT64);
+    guint64 max_tiles = get_env_size("GIMP_JXR_MAX_TILES", G_MAXUINT64);
+    guint64 max_memory = get_env_size("GIMP_JXR_MAX_MEMORY", G_MAXUINT64);
+
+    if (image->width == 0 || image->height == 0 || image->width > GIMP_MAX_IMAGE_SIZE || image->height > GIMP_MAX_IMAGE_SIZE)
+    {
+        *error_message = g_strdup_printf(_("Image size %u x %u is not supported."), image->width, image->height);
+    }
+    else if (pixels > max_pixels)
+    {
+        *error_message = g_strdup_printf(_("Image size %u x %u exceeds the limit of %" G_GUINT64_FORMAT " pixels."), 
+            image->width, image->height, max_pixels);
+    }
+    else if (tiles > max_tiles)
+    {
+        *error_message = g_strdup_printf(_("Image has %" G_GUINT64_FORMAT " tiles, exceeding the limit of %" G_GUINT64_FORMAT "."), 
+            tiles, max_tiles);
+    }
+    else if (memory > max_memory)
+    {
+        gchar* memory_text = g_format_size(memory);
+        gchar* max_memory_text = g_format_size(max_memory);
+
+        *error_message = g_strdup_printf(_("Loading the image requires %s of memory, exceeding the limit of %s."), 
+            memory_text, max_memory_text);
+
+        g_free(memory_text);
+        g_free(max_memory_text);
+    }
+
+    return *error_message != NULL ? WMP_errOutOfMemory : WMP_errSuccess;
+}
+
+static ERR create_converter(PKCodecFactory* codec_factory, PKImageDecode* decoder, const PKPixelFormatGUID* target_format, PKFormatConverter** converter)
+{
+    ERR err;
+
+    Call(codec_factory->CreateFormatConverter(converter));
+    Call((*converter)->Initialize(*converter, decoder, NULL, *target_format));
+
+    decoder->WMP.wmiSCP.uAlphaMode = 
+        IsEqualGUID(target_format, &GUID_PKPixelFormat32bppRGBA) ? 2 : 0;
+
+Cleanup:
+    return err;
+}
+
+// With a color transform, each band is converted on a worker thread while the
+// next one is decoded, so that the pixels are only swept once. Bands passed to
+// a listener are converted right away.
+static ERR decode_bands(PKFormatConverter* converter, Image* image, const DecodeLayout* layout, guchar* band, const ColorTransform* transform, const BandListener* listener, guint* rows_done, Progress* progress)
+{
+    ERR         err = WMP_errSuccess;
+    PKRect      rect;
+    guint       rows;
+    guchar*     dst;
+    TaskGroup*  group = NULL;
+
+    if (transform != NULL && listener == NULL)
+        group = task_group_new();
+
+    for (*rows_done = 0; *rows_done < image->height; *rows_done += rows)
+    {
+        rows = MIN(layout->band_rows, image->height - *rows_done);
+        dst = image->pixels + (gsize)*rows_done * image->stride;
+
+        rect.X = 0;
+        rect.Y = *rows_done;
+        rect.Width = image->width;
+        rect.Height = rows;
+
+        Call(converter->Copy(converter, &rect, layout->direct ? dst : band, layout->decode_stride));
+
+        if (IsEqualGUID(layout->target_format, &GUID_PKPixelFormatBlackWhite))
+            convert_bw_indexed(band, dst, image->width, rows, layout->decode_stride);
+        else if (!layout->direct)
+            compact_stride(band, dst, image->width, rows, layout->decode_stride, layout->bytes_per_pixel);
+
+        if (group != NULL)
+        {
+            TransformTask* task = g_new(TransformTask, 1);
+
+            task->transform = transform;
+            task->pixels = dst;
+            task->width = image->width;
+            task->rows = rows;
+            task->stride = image->stride;
+
+            task_group_push(group, run_transform_task, task);
+        }
+        else if (transform != NULL)
+            color_transform_apply(transform, dst, image->width, rows, image->stride);
+
+        if (listener != NULL)
+            listener->func(image, *rows_done, rows, listener->data);
+
+        if (!progress_update(progress, (gdouble)(*rows_done + rows) / image->height))
+            Call(ERR_CANCELLED);
+    }
+
+Cleanup:
+    if (group != NULL)
+    {
+        task_group_wait(group);
+        task_group_free(group);
+    }
+
+    return err;
+}
+
+static void run_transform_task(gpointer data)
+{
+    TransformTask* task = (TransformTask*)data;
+
+    color_transform_apply(task->transform, task->pixels, task->width, task->rows, task->stride);
+
+    g_free(task);
+}
+
+static gchar* get_unsupported_format_message(const PKPixelFormatGUID* pf)
+{
+    gchar* mnemonic = get_pixel_format_mnemonic(pf);
+
+    if (mnemonic != NULL)
+        return g_strdup_printf(_("Image has an unsupported pixel format (%s)."), mnemonic);
+    else
+        return g_strdup_printf(_("Image has an unsupported pixel format (%08X-%04X-%04X-%02X%02X%02X%02X%02X%02X%02X%02X)."), 
+            pf->Data1, pf->Data2, pf->Data3, pf->Data4[0], pf->Data4[1], pf->Data4[2], pf->Data4[3], pf->Data4[4], pf->Data4[5], pf->Data4[6], pf->Data4[7]);
+}
+
+// Reads only the image header and returns the number of bytes jxrlib_load
+// will need for the pixel buffers of the file.
+static ERR jxrlib_estimate_size(const gchar* filename, guint64* size)
+{
+    ERR                 err;
+    PKCodecFactory*     codec_factory = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKPixelFormatGUID   pixel_format;
+    DecodeLayout        layout;
+    I32                 width;
+    I32                 height;
+
+    *size = 0;
+
+    Call(get_factories(NULL, &codec_factory));
+    Call(codec_factory->CreateDecoderFromFile(filename, &decoder));
+    Call(decoder->GetSize(decoder, &width, &height));
+    Call(decoder->GetPixelFormat(decoder, &pixel_format));
+    Call(get_decode_layout(width, height, &pixel_format, &layout));
+
+    *size = layout.image_size + layout.band_size;
+
+Cleanup:
+    if (decoder)
+        decoder->Release(&decoder);
+
+    return err;
+}
+
+// Reads the size of the image from the header only.
+ERR jxrlib_get_size(const gchar* filename, guint* width, guint* height)
+{
+    ERR                 err;
+    PKCodecFactory*     codec_factory = NULL;
+    PKImageDecode*      decoder = NULL;
+    I32                 w;
+    I32                 h;
+
+    *width = 0;
+    *height = 0;
+
+    Call(get_factories(NULL, &codec_factory));
+    Call(codec_factory->CreateDecoderFromFile(filename, &decoder));
+    Call(decoder->GetSize(decoder, &w, &h));
+
+    *width = (guint)w;
+    *height = (guint)h;
+
+Cleanup:
+    if (decoder)
+        decoder->Release(&decoder);
+
+    return err;
+}
+
+// Region loads work on a grid of TILE_CACHE_TILE_SIZE tiles of the image
+// reduced by region->scale. Each row of tiles is first served from the tile
+// cache; the tiles that are missing are decoded in chunks of neighbouring
+// tiles, reduced, stored in the cache and copied into the region.
+ERR jxrlib_load_region(const gchar* filename, const Region* region, Image* image, gchar** error_message, Progress* progress)
+{
+    ERR                 err;
+    PKCodecFactory*     codec_factory = NULL;
+    PKImageDecode*      decoder = NULL;
+    DecodeLayout        layout;
+    TileCache*          cache = NULL;
+    TileGrid            grid;
+    gboolean*           missing = NULL;
+    guint               column, row;
+    guint               first_missing, last_missing;
+    gint64              start;
+    gint64              stage_start;
+    
+    memset(image, 0, sizeof(*image));
+
+    *error_message = NULL;
+
+    start = trace_begin();
+
+    Call(get_factories(NULL, &codec_factory));
+    Call(codec_factory->CreateDecoderFromFile(filename, &decoder)); 
+    Call(read_header(decoder, image, &layout, error_message));
+
+    if ((guint)region->x >= image->width || (guint)region->y >= image->height)
+    {
+        *error_message = g_strdup_printf(_("Region lies outside the image (%u x %u)."), image->width, image->height);
+        Call(WMP_errInvalidParameter);
+    }
+
+    grid.scale = region->scale;
+    grid.image_width = image->width;
+    grid.image_height = image->height;
+    grid.pixel_format = image->pixel_format;
+    grid.bytes_per_pixel = layout.bytes_per_pixel;
+    grid.width = (image->width + grid.scale - 1) / grid.scale;
+    grid.height = (image->height + grid.scale - 1) / grid.scale;
+    grid.x0 = region->x / grid.scale;
+    grid.y0 = region->y / grid.scale;
+    grid.x1 = (MIN((guint64)region->x + region->width, image->width) + grid.scale - 1) / grid.scale;
+    grid.y1 = (MIN((guint64)region->y + region->height, image->height) + grid.scale - 1) / grid.scale;
+
+    image->width = grid.x1 - grid.x0;
+    image->height = grid.y1 - grid.y0;
+    image->stride = image->width * layout.bytes_per_pixel;
+    image->resolution_x /= grid.scale;
+    image->resolution_y /= grid.scale;
+
+    Call(check_limits(decoder, image, (guint64)image->stride * image->height + get_chunk_size(&grid), error_message));
+    Call(read_metadata(decoder, image));
+
+    decoder->Release(&decoder);
+
+    image->lossy_conversion = get_bits_per_pixel(layout.target_format) < get_bits_per_pixel(&image->pixel_format);
+    image->pixel_format = *layout.target_format;
+
+    Call(buffer_alloc(&image->pixels, (guint64)image->stride * image->height));
+
+    trace_count("alloc-bytes", (guint64)image->stride * image->height);
+
+    cache = tile_cache_open(filename);
+    missing = g_new(gboolean, grid.width / TILE_CACHE_TILE_SIZE + 1);
+
+    for (row = grid.y0 / TILE_CACHE_TILE_SIZE; row <= (grid.y1 - 1) / TILE_CACHE_TILE_SIZE; row++)
+    {
+        first_missing = G_MAXUINT;
+        last_missing = 0;
+
+        stage_start = trace_begin();
+
+        for (column = grid.x0 / TILE_CACHE_TILE_SIZE; column <= (grid.x1 - 1) / TILE_CACHE_TILE_SIZE; column++)
+        {
+            TileInfo    tile;
+            guint       x0, y0, x1, y1;
+
+            get_tile_info(&grid, column, row, &tile);
+            get_tile_overlap(&grid, &tile, &x0, &y0, &x1, &y1);
+
+            missing[column] = !tile_cache_read(cache, &tile, 
+                x0 - column * TILE_CACHE_TILE_SIZE, y0 - row * TILE_CACHE_TILE_SIZE, x1 - x0, y1 - y0,
+                image->pixels + (gsize)(y0 - grid.y0) * image->stride + (gsize)(x0 - grid.x0) * grid.bytes_per_pixel, image->stride);
+
+            if (missing[column])
+            {
+                first_missing = MIN(first_missing, column);
+                last_missing = column;
+            }
+        }
+
+        trace_end("tile-cache-read", stage_start);
+
+        if (first_missing != G_MAXUINT)
+        {
+            stage_start = trace_begin();
+
+            Call(decode_tiles(filename, &grid, row, first_missing, last_missing, missing, cache, image));
+
+            trace_end("decode-tiles", stage_start);
+        }
+
+        if (!progress_update(progress, (gdouble)(MIN((row + 1) * TILE_CACHE_TILE_SIZE, grid.y1) - grid.y0) / (grid.y1 - grid.y0)))
+            Call(ERR_CANCELLED);
+    }
+
+Cleanup:
+    if (Failed(err))
+    {
+        if (image->pixels)
+            buffer_free(&image->pixels);
+
+        g_free(image->color_context);
+        g_free(image->xmp_metadata);
+    }
+
+    tile_cache_close(cache);
+    g_free(missing);
+
+    if (decoder)
+        decoder->Release(&decoder);
+
+    trace_end("jxrlib-load-region", start);
+
+    return err;
+}
+
+// Decodes the tiles first..last of a tile row, at most as many at a time as
+// fit into CHUNK_SIZE bytes of decoded full-resolution pixels, and copies the
+// ones flagged as missing into the cache and the region.
+static ERR decode_tiles(const gchar* filename, const TileGrid* grid, guint row, guint first, guint last, const gboolean* missing, TileCache* cache, Image* image)
+{
+    ERR                 err = WMP_errSuccess;
+    PKCodecFactory*     codec_factory = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKFormatConverter*  converter = NULL;
+    DecodeLayout        layout;
+    PKRect              rect;
+    PKRect              copy_rect;
+    guchar*             decoded = NULL;
+    guchar*             packed = NULL;
+    guchar*             scaled = NULL;
+    guint               tiles_per_chunk;
+    guint               chunk_first, chunk_last;
+    guint               column;
+    guint               scaled_width;
+
+    tiles_per_chunk = MAX(CHUNK_SIZE / get_chunk_size(grid), 1);
+
+    Call(get_factories(NULL, &codec_factory));
+
+    for (chunk_first = first; chunk_first <= last; chunk_first = chunk_last + 1)
+    {
+        chunk_last = MIN(chunk_first + tiles_per_chunk - 1, last);
+
+        rect.X = chunk_first * TILE_CACHE_TILE_SIZE * grid->scale;
+        rect.Y = row * TILE_CACHE_TILE_SIZE * grid->scale;
+        rect.Width = MIN((chunk_last + 1) * TILE_CACHE_TILE_SIZE * grid->scale, grid->image_width) - rect.X;
+        rect.Height = MIN((row + 1) * TILE_CACHE_TILE_SIZE * grid->scale, grid->image_height) - rect.Y;
+
+        scaled_width = (rect.Width + grid->scale - 1) / grid->scale;
+
+        Call(get_decode_layout(rect.Width, rect.Height, &grid->pixel_format, &layout));
+
+        Call(buffer_alloc(&packed, (guint64)rect.Width * rect.Height * grid->bytes_per_pixel));
+
+        if (!layout.direct)
+            Call(buffer_alloc(&decoded, (guint64)layout.decode_stride * rect.Height));
+
+        if (grid->scale > 1)
+            Call(buffer_alloc(&scaled, (guint64)scaled_width * ((rect.Height + grid->scale - 1) / grid->scale) * grid->bytes_per_pixel));
+
+        // every chunk gets a fresh decoder, as not all jxrlib builds can
+        // decode more than one rectangle with the same one
+        Call(codec_factory->CreateDecoderFromFile(filename, &decoder));
+        set_region_of_interest(decoder, &rect);
+        Call(create_converter(codec_factory, decoder, layout.target_format, &converter));
+
+        copy_rect.X = 0;
+        copy_rect.Y = 0;
+        copy_rect.Width = rect.Width;
+        copy_rect.Height = rect.Height;
+
+        Call(converter->Copy(converter, &copy_rect, layout.direct ? packed : decoded, layout.decode_stride));
+
+        if (IsEqualGUID(layout.target_format, &GUID_PKPixelFormatBlackWhite))
+            convert_bw_indexed(decoded, packed, rect.Width, rect.Height, layout.decode_stride);
+        else if (!layout.direct)
+            compact_stride(decoded, packed, rect.Width, rect.Height, layout.decode_stride, grid->bytes_per_pixel);
+
+        if (grid->scale > 1)
+            downsample_box(packed, scaled, rect.Width, rect.Height, rect.Width * grid->bytes_per_pixel, grid->bytes_per_pixel, grid->scale);
+
+        for (column = chunk_first; column <= chunk_last; column++)
+        {
+            TileInfo        tile;
+            guint           x0, y0, x1, y1;
+            const guchar*   src;
+            gsize           src_stride = (gsize)scaled_width * grid->bytes_per_pixel;
+            guint           y;
+
+            if (!missing[column])
+                continue;
+
+            get_tile_info(grid, column, row, &tile);
+            get_tile_overlap(grid, &tile, &x0, &y0, &x1, &y1);
+
+            src = (grid->scale > 1 ? scaled : packed) + (gsize)(column - chunk_first) * TILE_CACHE_TILE_SIZE * grid->bytes_per_pixel;
+
+            tile_cache_write(cache, &tile, src, src_stride);
+
+            src += (gsize)(y0 - row * TILE_CACHE_TILE_SIZE) * src_stride + (gsize)(x0 - column * TILE_CACHE_TILE_SIZE) * grid->bytes_per_pixel;
+
+            for (y = y0; y < y1; y++, src += src_stride)
+                memcpy(image->pixels + (gsize)(y - grid->y0) * image->stride + (gsize)(x0 - grid->x0) * grid->bytes_per_pixel, 
+                    src, (gsize)(x1 - x0) * grid->bytes_per_pixel);
+        }
+
+        converter->Release(&converter);
+        decoder->Release(&decoder);
+        buffer_free(&packed);
+
+        if (decoded)
+            buffer_free(&decoded);
+
+        if (scaled)
+            buffer_free(&scaled);
+    }
+
+Cleanup:
+    if (packed)
+        buffer_free(&packed);
+
+    if (decoded)
+        buffer_free(&decoded);
+
+    if (scaled)
+        buffer_free(&scaled);
+
+    if (converter)
+        converter->Release(&converter);
+
+    if (decoder)
+        decoder->Release(&decoder);
+
+    return err;
+}
+
+// Restricts decoding to rect. jxrlib builds without REENTRANT_MODE reject
+// copies that do not start at the origin, and builds with it write rows of
+// the full image width; with the region of interest set, both decode only the
+// tiles and macroblocks that overlap rect and copy it from (0, 0).
+static void set_region_of_interest(PKImageDecode* decoder, const PKRect* rect)
+{
+    decoder->WMP.wmiI.cROILeftX = rect->X;
+    decoder->WMP.wmiI.cROITopY = rect->Y;
+    decoder->WMP.wmiI.cROIWidth = rect->Width;
+    decoder->WMP.wmiI.cROIHeight = rect->Height;
+
+    // planar alpha is decoded with its own copy of the image info
+    decoder->WMP.wmiI_Alpha.cROILeftX = rect->X;
+    decoder->WMP.wmiI_Alpha.cROITopY = rect->Y;
+    decoder->WMP.wmiI_Alpha.cROIWidth = rect->Width;
+    decoder->WMP.wmiI_Alpha.cROIHeight = rect->Height;
+}
+
+// Returns the number of bytes of the decode and conversion buffers needed for
+// a single tile at full resolution.
+static guint64 get_chunk_size(const TileGrid* grid)
+{
+    guint64 size = (guint64)TILE_CACHE_TILE_SIZE * grid->scale;
+
+    return size * size * MAX(get_bits_per_pixel(&grid->pixel_format), grid->bytes_per_pixel * 8) / 8 * 2;
+}
+
+static void get_tile_info(const TileGrid* grid, guint column, guint row, TileInfo* tile)
+{
+    tile->scale = grid->scale;
+    tile->column = column;
+    tile->row = row;
+    tile->width = MIN(TILE_CACHE_TILE_SIZE, grid->width - column * TILE_CACHE_TILE_SIZE);
+    tile->height = MIN(TILE_CACHE_TILE_SIZE, grid->height - row * TILE_CACHE_TILE_SIZE);
+    tile->bytes_per_pixel = grid->bytes_per_pixel;
+}
+
+// Computes the part of a tile that lies inside the region, in pixels of the
+// scaled image.
+static void get_tile_overlap(const TileGrid* grid, const TileInfo* tile, guint* x0, guint* y0, guint* x1, guint* y1)
+{
+    *x0 = MAX(tile->column * TILE_CACHE_TILE_SIZE, grid->x0);
+    *y0 = MAX(tile->row * TILE_CACHE_TILE_SIZE, grid->y0);
+    *x1 = MIN(tile->column * TILE_CACHE_TILE_SIZE + tile->width, grid->x1);
+    *y1 = MIN(tile->row * TILE_CACHE_TILE_SIZE + tile->height, grid->y1);
+}
+
+static ERR get_target_pixel_format(const PKPixelFormatGUID* source, const PKPixelFormatGUID** target)
+{ 
+    ERR         err;
+    PKPixelInfo pixel_info;   
+    
     pixel_info.pGUIDPixFmt = source;
     
     Call(PixelFormatLookup(&pixel_info, LOOKUP_FORWARD));
@@ -300,18 +1452,3 @@ static ERR get_target_pixel_format(const PKPixelFormatGUID* source, const PKPixe
 Cleanup:
     return err;
 }
-
-static void compact_stride(guchar* pixels, gint width, gint height, gint stride, gint bytes_per_pixel)
-{
-    gint    y;
-    guchar* src;
-    guchar* dst;
-    gint    new_stride = width * bytes_per_pixel;
-    
-    for (y = 1; y < height; y++)
-    {
-        src = pixels + y * stride;
-        dst = pixels + y * new_stride;
-        g_memmove(dst, src, new_stride);
-    }
-}
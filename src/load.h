@@ -0,0 +1,27 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+#include "file-jxr.h"
+#include <JXRGlue.h>
+#include "utils.h"
+
+// Part of an image to load, in pixels of the full image, and the factor (a
+// power of two) it is scaled down by
+typedef struct
+{
+    gint        x;
+    gint        y;
+    gint        width;
+    gint        height;
+    guint       scale;
+} Region;
+
+void load(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+void load_multiple(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+void load_incremental(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+void load_region(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+ERR jxrlib_load(const gchar* filename, Image* image, gchar** error_message, Progress* progress);
+ERR jxrlib_get_size(const gchar* filename, guint* width, guint* height);
+ERR jxrlib_load_region(const gchar* filename, const Region* region, Image* image, gchar** error_message, Progress* progress);
+
+#endif
@@ -0,0 +1,270 @@
+#include "manifest.h"
+#include "trace.h"
+#include <glib/gstdio.h>
+
+// Saves that are asked to skip unchanged outputs record a digest of what was
+// encoded next to each output, in <output>.jxrdigest. The digest covers the
+// pixels, the image header and metadata, the save options and the plug-in
+// version. A later save with the same digest leaves the output alone as long
+// as the output still has the size and modification time recorded with it.
+//
+// The hash is a streaming 64-bit hash in the style of XXH64: the input is
+// consumed in 32-byte stripes by four independent lanes, so the loop has no
+// dependency between lanes and hashes at memory speed.
+
+#define SIDECAR_SUFFIX  ".jxrdigest"
+#define SIDECAR_MAGIC   "jxr-digest-1"
+#define STRIPE_SIZE     32
+
+#define PRIME1  G_GUINT64_CONSTANT(11400714785074694791)
+#define PRIME2  G_GUINT64_CONSTANT(14029467366897019727)
+#define PRIME3  G_GUINT64_CONSTANT(1609587929392839161)
+#define PRIME4  G_GUINT64_CONSTANT(9650029242287828579)
+#define PRIME5  G_GUINT64_CONSTANT(2870177450012600261)
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct
+{
+    guint64     lanes[4];
+    guchar      stripe[STRIPE_SIZE];
+    gsize       buffered;
+    guint64     length;
+} Digest;
+
+static void digest_init(Digest* digest);
+static void digest_update(Digest* digest, const void* data, gsize size);
+static void digest_update_int(Digest* digest, guint32 value);
+static guint64 digest_final(Digest* digest);
+static void consume_stripes(guint64* lanes, const guchar* data, gsize count);
+static guint64 read_u64(const guchar* data);
+static gchar* get_sidecar_filename(const gchar* filename);
+
+gchar* manifest_digest(const Image* image, const SaveOptions* save_options)
+{
+    Digest      digest;
+    gint        i;
+    gint64      start;
+
+    start = trace_begin();
+
+    digest_init(&digest);
+
+    digest_update(&digest, PLUG_IN_VERSION, strlen(PLUG_IN_VERSION) + 1);
+
+    digest_update_int(&digest, image->width);
+    digest_update_int(&digest, image->height);
+    digest_update_int(&digest, image->stride);
+    digest_update(&digest, &image->pixel_format, sizeof(image->pixel_format));
+    digest_update(&digest, &image->resolution_x, sizeof(image->resolution_x));
+    digest_update(&digest, &image->resolution_y, sizeof(image->resolution_y));
+    digest_update_int(&digest, image->black_one != FALSE);
+
+    digest_update_int(&digest, image->color_context_size);
+    digest_update(&digest, image->color_context, image->color_context_size);
+    digest_update_int(&digest, image->xmp_metadata_size);
+    digest_update(&digest, image->xmp_metadata, image->xmp_metadata_size);
+
+    // every option that can change the output; skip_unchanged itself cannot
+    digest_update_int(&digest, save_options->image_quality);
+    digest_update_int(&digest, save_options->alpha_quality);
+    digest_update_int(&digest, save_options->overlap);
+    digest_update_int(&digest, save_options->subsampling);
+    digest_update_int(&digest, save_options->tiling);
+    digest_update_int(&digest, save_options->index_table != FALSE);
+    digest_update_int(&digest, save_options->metric);
+    digest_update_int(&digest, save_options->optimize_lossless != FALSE);
+
+    if (save_options->tiling == TILING_CUSTOM)
+    {
+        digest_update_int(&digest, save_options->tile_column_count);
+
+        for (i = 0; i < save_options->tile_column_count; i++)
+            digest_update_int(&digest, save_options->tile_columns[i]);
+
+        digest_update_int(&digest, save_options->tile_row_count);
+
+        for (i = 0; i < save_options->tile_row_count; i++)
+            digest_update_int(&digest, save_options->tile_rows[i]);
+    }
+
+    digest_update(&digest, image->pixels, (gsize)image->stride * image->height);
+
+    trace_end("digest", start);
+    trace_count("digest-bytes", (guint64)image->stride * image->height);
+
+    return g_strdup_printf("%016" G_GINT64_MODIFIER "x", digest_final(&digest));
+}
+
+// TRUE if filename exists and is the output that the sidecar records for
+// digest. Outputs that were rewritten or touched since no longer match.
+gboolean manifest_matches(const gchar* filename, const gchar* digest)
+{
+    gchar*      sidecar = get_sidecar_filename(filename);
+    gchar*      contents = NULL;
+    gchar**     fields = NULL;
+    GStatBuf    st;
+    gboolean    matches = FALSE;
+
+    if (g_stat(filename, &st) == 0 && g_file_get_contents(sidecar, &contents, NULL, NULL))
+    {
+        fields = g_strsplit(g_strstrip(contents), " ", 0);
+
+        matches = g_strv_length(fields) == 4 &&
+            strcmp(fields[0], SIDECAR_MAGIC) == 0 &&
+            strcmp(fields[1], digest) == 0 &&
+            g_ascii_strtoull(fields[2], NULL, 10) == (guint64)st.st_size &&
+            g_ascii_strtoll(fields[3], NULL, 10) == (gint64)st.st_mtime;
+    }
+
+    g_strfreev(fields);
+    g_free(contents);
+    g_free(sidecar);
+
+    return matches;
+}
+
+// Records digest for the output that was just saved to filename. A sidecar
+// that cannot be written only costs an encode the next time.
+void manifest_write(const gchar* filename, const gchar* digest)
+{
+    gchar*      sidecar = get_sidecar_filename(filename);
+    gchar*      contents;
+    GStatBuf    st;
+
+    if (g_stat(filename, &st) == 0)
+    {
+        contents = g_strdup_printf("%s %s %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+            SIDECAR_MAGIC, digest, (guint64)st.st_size, (gint64)st.st_mtime);
+
+        g_file_set_contents(sidecar, contents, -1, NULL);
+        g_free(contents);
+    }
+
+    g_free(sidecar);
+}
+
+static gchar* get_sidecar_filename(const gchar* filename)
+{
+    return g_strconcat(filename, SIDECAR_SUFFIX, NULL);
+}
+
+static void digest_init(Digest* digest)
+{
+    digest->lanes[0] = PRIME1 + PRIME2;
+    digest->lanes[1] = PRIME2;
+    digest->lanes[2] = 0;
+    digest->lanes[3] = (guint64)0 - PRIME1;
+    digest->buffered = 0;
+    digest->length = 0;
+}
+
+static void digest_update(Digest* digest, const void* data, gsize size)
+{
+    const guchar*   p = (const guchar*)data;
+    gsize           n;
+
+    if (size == 0)
+        return;
+
+    digest->length += size;
+
+    // complete a stripe left over from the last update
+    if (digest->buffered > 0)
+    {
+        n = MIN(size, STRIPE_SIZE - digest->buffered);
+        memcpy(digest->stripe + digest->buffered, p, n);
+        digest->buffered += n;
+        p += n;
+        size -= n;
+
+        if (digest->buffered < STRIPE_SIZE)
+            return;
+
+        consume_stripes(digest->lanes, digest->stripe, 1);
+        digest->buffered = 0;
+    }
+
+    n = size / STRIPE_SIZE;
+    consume_stripes(digest->lanes, p, n);
+
+    p += n * STRIPE_SIZE;
+    size -= n * STRIPE_SIZE;
+
+    memcpy(digest->stripe, p, size);
+    digest->buffered = size;
+}
+
+static void digest_update_int(Digest* digest, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    digest_update(digest, &value, sizeof(value));
+}
+
+static guint64 digest_final(Digest* digest)
+{
+    guint64     h;
+    gsize       i;
+    gint        l;
+
+    h = ROTL64(digest->lanes[0], 1) + ROTL64(digest->lanes[1], 7) +
+        ROTL64(digest->lanes[2], 12) + ROTL64(digest->lanes[3], 18);
+
+    for (l = 0; l < 4; l++)
+    {
+        guint64 lane = ROTL64(digest->lanes[l] * PRIME2, 31) * PRIME1;
+        h = (h ^ lane) * PRIME1 + PRIME4;
+    }
+
+    h += digest->length;
+
+    for (i = 0; i + 8 <= digest->buffered; i += 8)
+    {
+        guint64 k = ROTL64(read_u64(digest->stripe + i) * PRIME2, 31) * PRIME1;
+        h = ROTL64(h ^ k, 27) * PRIME1 + PRIME4;
+    }
+
+    for (; i < digest->buffered; i++)
+        h = ROTL64(h ^ (digest->stripe[i] * PRIME5), 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+// The lanes are kept in locals so the compiler can hold them in registers
+// and interleave (or vectorize) the four multiplies of a stripe
+static void consume_stripes(guint64* lanes, const guchar* data, gsize count)
+{
+    guint64     v0 = lanes[0];
+    guint64     v1 = lanes[1];
+    guint64     v2 = lanes[2];
+    guint64     v3 = lanes[3];
+    gsize       i;
+
+    for (i = 0; i < count; i++, data += STRIPE_SIZE)
+    {
+        v0 = ROTL64(v0 + read_u64(data) * PRIME2, 31) * PRIME1;
+        v1 = ROTL64(v1 + read_u64(data + 8) * PRIME2, 31) * PRIME1;
+        v2 = ROTL64(v2 + read_u64(data + 16) * PRIME2, 31) * PRIME1;
+        v3 = ROTL64(v3 + read_u64(data + 24) * PRIME2, 31) * PRIME1;
+    }
+
+    lanes[0] = v0;
+    lanes[1] = v1;
+    lanes[2] = v2;
+    lanes[3] = v3;
+}
+
+static guint64 read_u64(const guchar* data)
+{
+    guint64 value;
+
+    memcpy(&value, data, sizeof(value));
+
+    return GUINT64_FROM_LE(value);
+}
@@ -0,0 +1,10 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "save.h"
+
+gchar* manifest_digest(const Image* image, const SaveOptions* save_options);
+gboolean manifest_matches(const gchar* filename, const gchar* digest);
+void manifest_write(const gchar* filename, const gchar* digest);
+
+#endif
@@ -0,0 +1,99 @@
+// Mnemonics of the jxrlib pixel formats, keyed by the last byte of the GUID.
+// All of them share the other 15 bytes, PIXEL_FORMAT_GUID_PREFIX. Shared
+// with tools/jxr-catalog.
+
+#ifndef PIXELFORMATS_H
+#define PIXELFORMATS_H
+
+#define PIXEL_FORMAT_GUID_PREFIX "\x24\xC3\xDD\x6F\x03\x4E\xFE\x4B\xB1\x85\x3D\x77\x76\x8D\xC9"
+
+typedef struct
+{
+    guint8          id;
+    const gchar*    mnemonic;
+} PixelFormatName;
+
+static const PixelFormatName pixel_format_names[] =
+{
+    { 0x0D, "24bppRGB" },
+    { 0x0C, "24bppBGR" },
+    { 0x0E, "32bppBGR" },
+    { 0x15, "48bppRGB" },
+    { 0x12, "48bppRGBFixedPoint" },
+    { 0x3B, "48bppRGBHalf" },
+    { 0x18, "96bppRGBFixedPoint" },
+    { 0x40, "64bppRGBFixedPoint" },
+    { 0x42, "64bppRGBHalf" },
+    { 0x41, "128bppRGBFixedPoint" },
+    { 0x1B, "128bppRGBFloat" },
+    { 0x0F, "32bppBGRA" },
+    { 0x16, "64bppRGBA" },
+    { 0x1D, "64bppRGBAFixedPoint" },
+    { 0x3A, "64bppRGBAHalf" },
+    { 0x1E, "128bppRGBAFixedPoint" },
+    { 0x19, "128bppRGBAFloat" },
+    { 0x10, "32bppPBGRA" },
+    { 0x17, "64bppPRGBA" },
+    { 0x1A, "128bppPRGBAFloat" },
+    { 0x1C, "32bppCMYK" },
+    { 0x2C, "40bppCMYKAlpha" },
+    { 0x1F, "64bppCMYK" },
+    { 0x2D, "80bppCMYKAlpha" },
+    { 0x20, "24bpp3Channels" },
+    { 0x21, "32bpp4Channels" },
+    { 0x22, "40bpp5Channels" },
+    { 0x23, "48bpp6Channels" },
+    { 0x24, "56bpp7Channels" },
+    { 0x25, "64bpp8Channels" },
+    { 0x2E, "32bpp3ChannelsAlpha" },
+    { 0x2F, "40bpp4ChannelsAlpha" },
+    { 0x30, "48bpp5ChannelsAlpha" },
+    { 0x31, "56bpp6ChannelsAlpha" },
+    { 0x32, "64bpp7ChannelsAlpha" },
+    { 0x33, "72bpp8ChannelsAlpha" },
+    { 0x26, "48bpp3Channels" },
+    { 0x27, "64bpp4Channels" },
+    { 0x28, "80bpp5Channels" },
+    { 0x29, "96bpp6Channels" },
+    { 0x2A, "112bpp7Channels" },
+    { 0x2B, "128bpp8Channels" },
+    { 0x34, "64bpp3ChannelsAlpha" },
+    { 0x35, "80bpp4ChannelsAlpha" },
+    { 0x36, "96bpp5ChannelsAlpha" },
+    { 0x37, "112bpp6ChannelsAlpha" },
+    { 0x38, "128bpp7ChannelsAlpha" },
+    { 0x39, "144bpp8ChannelsAlpha" },
+    { 0x08, "8bppGray" },
+    { 0x0B, "16bppGray" },
+    { 0x13, "16bppGrayFixedPoint" },
+    { 0x3E, "16bppGrayHalf" },
+    { 0x3F, "32bppGrayFixedPoint" },
+    { 0x11, "32bppGrayFloat" },
+    { 0x05, "BlackWhite" },
+    { 0x09, "16bppBGR555" },
+    { 0x0A, "16bppBGR565" },
+    { 0x14, "32bppBGR101010" },
+    { 0x3D, "32bppRGBE" },
+    { 0x54, "32bppCMYKDIRECT" },
+    { 0x55, "64bppCMYKDIRECT" },
+    { 0x56, "40bppCMYKDIRECTAlpha" },
+    { 0x43, "80bppCMYKDIRECTAlpha" },
+    { 0x44, "12bppYCC420" },
+    { 0x45, "16bppYCC422" },
+    { 0x46, "20bppYCC422" },
+    { 0x47, "32bppYCC422" },
+    { 0x48, "24bppYCC444" },
+    { 0x49, "30bppYCC444" },
+    { 0x4A, "48bppYCC444" },
+    { 0x4B, "48bppYCC444FixedPoint" },
+    { 0x4C, "20bppYCC420Alpha" },
+    { 0x4D, "24bppYCC422Alpha" },
+    { 0x4E, "30bppYCC422Alpha" },
+    { 0x4F, "48bppYCC422Alpha" },
+    { 0x50, "32bppYCC444Alpha" },
+    { 0x51, "40bppYCC444Alpha" },
+    { 0x52, "64bppYCC444Alpha" },
+    { 0x53, "64bppYCC444AlphaFixedPoint" }
+};
+
+#endif
@@ -0,0 +1,134 @@
+// Quantizer indices for Y, U, V, Y highpass, U highpass and V highpass at the
+// quality steps 0.0, 0.1, ..., 1.1, per metric and chroma subsampling mode.
+// Regenerate with tools/qp-calibrate instead of editing this file.
+//
+// Hand-tuned tables, the same for all subsampling modes.
+
+#ifndef QPTABLES_H
+#define QPTABLES_H
+
+#define QP_METRIC_COUNT     2
+#define QP_SUBSAMPLINGS     4
+#define QP_TABLE_ROWS       12
+
+static const guint8 qp_tables[QP_METRIC_COUNT][QP_SUBSAMPLINGS][QP_TABLE_ROWS][6] =
+{
+    { // PSNR
+        { // Y-only
+            {  67,  79,  86,  72,  90,  98 },
+            {  59,  74,  80,  64,  83,  89 },
+            {  53,  68,  75,  57,  76,  83 },
+            {  49,  64,  71,  53,  70,  77 },
+            {  45,  60,  67,  48,  67,  74 },
+            {  40,  56,  62,  42,  59,  66 },
+            {  33,  49,  55,  35,  51,  58 },
+            {  27,  44,  49,  28,  45,  50 },
+            {  20,  36,  42,  20,  38,  44 },
+            {  13,  27,  34,  13,  28,  34 },
+            {   7,  17,  21,   8,  17,  21 },
+            {   2,   5,   6,   2,   5,   6 }
+        },
+        { // 4:2:0
+            {  67,  79,  86,  72,  90,  98 },
+            {  59,  74,  80,  64,  83,  89 },
+            {  53,  68,  75,  57,  76,  83 },
+            {  49,  64,  71,  53,  70,  77 },
+            {  45,  60,  67,  48,  67,  74 },
+            {  40,  56,  62,  42,  59,  66 },
+            {  33,  49,  55,  35,  51,  58 },
+            {  27,  44,  49,  28,  45,  50 },
+            {  20,  36,  42,  20,  38,  44 },
+            {  13,  27,  34,  13,  28,  34 },
+            {   7,  17,  21,   8,  17,  21 },
+            {   2,   5,   6,   2,   5,   6 }
+        },
+        { // 4:2:2
+            {  67,  79,  86,  72,  90,  98 },
+            {  59,  74,  80,  64,  83,  89 },
+            {  53,  68,  75,  57,  76,  83 },
+            {  49,  64,  71,  53,  70,  77 },
+            {  45,  60,  67,  48,  67,  74 },
+            {  40,  56,  62,  42,  59,  66 },
+            {  33,  49,  55,  35,  51,  58 },
+            {  27,  44,  49,  28,  45,  50 },
+            {  20,  36,  42,  20,  38,  44 },
+            {  13,  27,  34,  13,  28,  34 },
+            {   7,  17,  21,   8,  17,  21 },
+            {   2,   5,   6,   2,   5,   6 }
+        },
+        { // 4:4:4
+            {  67,  79,  86,  72,  90,  98 },
+            {  59,  74,  80,  64,  83,  89 },
+            {  53,  68,  75,  57,  76,  83 },
+            {  49,  64,  71,  53,  70,  77 },
+            {  45,  60,  67,  48,  67,  74 },
+            {  40,  56,  62,  42,  59,  66 },
+            {  33,  49,  55,  35,  51,  58 },
+            {  27,  44,  49,  28,  45,  50 },
+            {  20,  36,  42,  20,  38,  44 },
+            {  13,  27,  34,  13,  28,  34 },
+            {   7,  17,  21,   8,  17,  21 },
+            {   2,   5,   6,   2,   5,   6 }
+        }
+    },
+    { // SSIM
+        { // Y-only
+            {  67,  93,  98,  71,  98, 104 },
+            {  59,  83,  88,  61,  89,  95 },
+            {  50,  76,  81,  53,  85,  90 },
+            {  46,  71,  77,  47,  79,  85 },
+            {  41,  67,  71,  42,  75,  78 },
+            {  34,  59,  65,  35,  66,  72 },
+            {  30,  54,  60,  29,  60,  66 },
+            {  24,  48,  53,  22,  53,  58 },
+            {  18,  39,  45,  17,  43,  48 },
+            {  13,  34,  38,  11,  35,  38 },
+            {   8,  20,  24,   7,  22,  25 },
+            {   2,   5,   6,   2,   5,   6 }
+        },
+        { // 4:2:0
+            {  67,  93,  98,  71,  98, 104 },
+            {  59,  83,  88,  61,  89,  95 },
+            {  50,  76,  81,  53,  85,  90 },
+            {  46,  71,  77,  47,  79,  85 },
+            {  41,  67,  71,  42,  75,  78 },
+            {  34,  59,  65,  35,  66,  72 },
+            {  30,  54,  60,  29,  60,  66 },
+            {  24,  48,  53,  22,  53,  58 },
+            {  18,  39,  45,  17,  43,  48 },
+            {  13,  34,  38,  11,  35,  38 },
+            {   8,  20,  24,   7,  22,  25 },
+            {   2,   5,   6,   2,   5,   6 }
+        },
+        { // 4:2:2
+            {  67,  93,  98,  71,  98, 104 },
+            {  59,  83,  88,  61,  89,  95 },
+            {  50,  76,  81,  53,  85,  90 },
+            {  46,  71,  77,  47,  79,  85 },
+            {  41,  67,  71,  42,  75,  78 },
+            {  34,  59,  65,  35,  66,  72 },
+            {  30,  54,  60,  29,  60,  66 },
+            {  24,  48,  53,  22,  53,  58 },
+            {  18,  39,  45,  17,  43,  48 },
+            {  13,  34,  38,  11,  35,  38 },
+            {   8,  20,  24,   7,  22,  25 },
+            {   2,   5,   6,   2,   5,   6 }
+        },
+        { // 4:4:4
+            {  67,  93,  98,  71,  98, 104 },
+            {  59,  83,  88,  61,  89,  95 },
+            {  50,  76,  81,  53,  85,  90 },
+            {  46,  71,  77,  47,  79,  85 },
+            {  41,  67,  71,  42,  75,  78 },
+            {  34,  59,  65,  35,  66,  72 },
+            {  30,  54,  60,  29,  60,  66 },
+            {  24,  48,  53,  22,  53,  58 },
+            {  18,  39,  45,  17,  43,  48 },
+            {  13,  34,  38,  11,  35,  38 },
+            {   8,  20,  24,   7,  22,  25 },
+            {   2,   5,   6,   2,   5,   6 }
+        }
+    }
+};
+
+#endif
@@ -1,41 +1,18 @@
-#include "file-jxr.h"
-#include <JXRGlue.h>
-#include "utils.h"
+#include "save.h"
+#include "trace.h"
+#include "buffers.h"
+#include "stream.h"
+#include "workers.h"
+#include "qptables.h"
+#include "composite.h"
+#include "manifest.h"
 
 #include <libgimp/gimpui.h>
+#include <math.h>
 
-typedef enum
-{
-    OVERLAP_AUTO,
-    OVERLAP_NONE,
-    OVERLAP_ONE,
-    OVERLAP_TWO
-} OverlapSetting;
-
-typedef enum
-{
-    SUBSAMPLING_YONLY,
-    SUBSAMPLING_420,
-    SUBSAMPLING_422,
-    SUBSAMPLING_444
-} SubsamplingSetting;
-
-typedef enum
-{
-    TILING_NONE,
-    TILING_256,
-    TILING_512,
-    TILING_1024
-} TilingSetting;
-
-typedef struct
-{
-    gint                image_quality;
-    gint                alpha_quality;
-    OverlapSetting      overlap;
-    SubsamplingSetting  subsampling;
-    TilingSetting       tiling; 
-} SaveOptions;
+// The random access preset picks the smallest tile size that keeps the
+// number of tiles, and with it the index table, below this count
+#define RANDOM_ACCESS_MAX_TILES 4096
 
 typedef struct
 {
@@ -54,16 +31,125 @@ typedef struct
     GtkWidget*  subsampling_combo_box;
     GtkWidget*  tiling_label;
     GtkWidget*  tiling_combo_box;
+    GtkWidget*  index_table_check_button;
+    GtkWidget*  metric_label;
+    GtkWidget*  metric_combo_box;
+    GtkWidget*  optimize_lossless_check_button;
     GtkWidget*  lossless_label;
     GtkWidget*  defaults_table;
     GtkWidget*  defaults_button;
 } SaveGui;
 
-static const SaveOptions DEFAULT_SAVE_OPTIONS = { 90, 100, OVERLAP_AUTO, SUBSAMPLING_444, TILING_NONE };
+typedef struct
+{
+    guchar*     pixels;
+    guint       width;
+    guint       rows;
+} SwapTask;
 
-static ERR jxrlib_save(const gchar *filename, const Image* image, const SaveOptions* save_options);
+typedef struct
+{
+    SaveOptions     save_options;
+    const Image*    crops;
+    guint           crop_count;
+    MetricSetting   metric;
+    guint64         bytes;
+    gdouble         error_sum;      // squared error for PSNR, window scores for SSIM
+    guint64         error_count;
+    ERR             err;
+} TrialTask;
+
+// One combination of lossless encoder settings
+typedef struct
+{
+    BITSTREAMFORMAT     bitstream_format;
+    TilingSetting       tiling;
+    OVERLAP             overlap;
+    COLORFORMAT         color_format;
+} LosslessCandidate;
+
+// State shared by the encodes of a lossless optimization; the smallest
+// result so far is kept in best
+typedef struct
+{
+    GMutex      mutex;
+    GCond       cond;
+    struct _LosslessTask* tasks;
+    guint       count;
+    guint       next;               // first candidate not yet taken
+    guint       running;            // candidates being encoded
+    guint       finished;
+    gint64      deadline;
+    gboolean    cancelled;
+    guint64     budget;
+    guint64     in_use;             // bytes reserved by runners and best
+    guchar*     best;
+    gsize       best_size;
+    gsize       best_capacity;
+    ERR         err;
+} LosslessSearch;
+
+typedef struct _LosslessTask
+{
+    const Image*        image;
+    const SaveOptions*  save_options;
+    LosslessCandidate   candidate;
+    guint               index;
+    gboolean            verify;
+    gsize               capacity;
+    LosslessSearch*     search;
+} LosslessTask;
+
+// Pixels are handed to the encoder in bands of about this many bytes
+#define ENCODE_BAND_SIZE (4 << 20)
+
+// Share of the progress bar given to fetching the pixels from GIMP; the rest
+// covers encoding
+#define TRANSFER_PROGRESS 0.2
+
+// Adaptive overlap and subsampling are chosen from trial encodes of up to
+// TRIAL_CROPS crops of TRIAL_CROP_SIZE pixels spread over the image
+#define TRIAL_CROP_SIZE 256
+#define TRIAL_CROPS 4
+
+// Trials may score this much below the non-adaptive settings and still win
+// if they are smaller
+#define TRIAL_PSNR_TOLERANCE 0.05
+#define TRIAL_SSIM_TOLERANCE 0.0005
+
+// Images whose chroma carries this share of the luma detail (screenshots,
+// colored text) are not tried with chroma subsampling
+#define CHROMA_DETAIL_RATIO 0.5
+
+// Default time budget of a lossless optimization, in seconds
+#define DEFAULT_OPTIMIZE_SECONDS 60
+
+// Default memory budget of a lossless optimization, in bytes
+#define DEFAULT_OPTIMIZE_MEMORY (G_GUINT64_CONSTANT(1) << 30)
+
+const SaveOptions DEFAULT_SAVE_OPTIONS = { 90, 100, OVERLAP_AUTO, SUBSAMPLING_444, TILING_NONE, TRUE, METRIC_PSNR, FALSE, FALSE };
+
+static ERR encode_bands(PKImageEncode* encoder, const Image* image, struct WMPStream* alpha_stream, Progress* progress);
+static void run_swap_task(gpointer data);
+static void resolve_adaptive_options(const Image* image, SaveOptions* save_options);
+static guint get_trial_crops(const Image* image, Image* crops);
+static gdouble get_chroma_detail_ratio(const Image* image);
+static void run_trial_task(gpointer data);
+static ERR encode_trial(const Image* crop, const SaveOptions* save_options, guchar* buffer, gsize buffer_size, gsize* size);
+static ERR decode_trial(guchar* buffer, gsize size, const Image* crop, guchar* pixels);
+static void measure_error(const Image* crop, const guchar* pixels, MetricSetting metric, gdouble* sum, guint64* count);
+static gdouble get_trial_score(const TrialTask* trial);
+static ERR optimize_lossless(const Image* image, const SaveOptions* save_options, struct WMPStream* stream, Progress* progress);
+static guint get_lossless_candidates(const Image* image, const SaveOptions* save_options, LosslessCandidate* candidates);
+static gboolean is_gray(const Image* image);
+static void run_lossless_runner(gpointer data);
+static void run_lossless_task(LosslessTask* task, gsize capacity, guchar* pixels);
+static ERR encode_lossless(const Image* image, const SaveOptions* save_options, const LosslessCandidate* candidate, guchar* buffer, gsize buffer_size, gsize* size);
+static ERR verify_lossless(const Image* image, guchar* buffer, gsize size, guchar* pixels);
 static void apply_save_options(const SaveOptions* save_options, guint width, guint height, PKPixelFormatGUID pixel_format, gboolean black_one, CWMIStrCodecParam* wmiSCP, CWMIStrCodecParam* wmiSCP_Alpha);
-static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled, gboolean subsampling_enabled);
+static void set_tile_grid(const gint32* sizes, guint count, guint extent, U32* tiles, U32* num_tiles_minus1);
+static gint32 get_random_access_tile_size(guint width, guint height);
+static gboolean get_custom_tiles(const GimpParam* count_param, const GimpParam* sizes_param, gint32* sizes, gint* count);
 static void load_save_gui_defaults(const SaveGui* save_gui);
 static void open_help(const gchar* help_id, gpointer help_data);
 
@@ -83,10 +169,7 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
     gint32                  image_ID;
     gint32                  orig_image_ID;
     gint32                  drawable_ID;
-    GimpImageType           image_type;
-
-    GimpPixelRgn            pixel_rgn;
-    GimpDrawable*           drawable;
+    Composition             composition;
 
     ERR                     err;
 
@@ -96,6 +179,10 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
     GimpParasite*           icc_parasite;
     GimpParasite*           xmp_parasite;
 
+    gint64                  save_start;
+    gint64                  stage_start;
+    Progress                progress;
+
 /*#ifdef _DEBUG
     while (TRUE) { }
 #endif*/
@@ -105,8 +192,9 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
     drawable_ID   = param[2].data.d_int32;
     filename      = param[3].data.d_string;
     orig_image_ID = image_ID;
+    save_start    = trace_begin();
     
-    ret_values = g_new(GimpParam, 2);
+    ret_values = g_new0(GimpParam, 2);
 
     *nreturn_vals = 2;
     *return_vals = ret_values;
@@ -117,59 +205,38 @@ void save(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam**
 
     memset(&image, 0, sizeof(image));
     
-    capabilities = GIMP_EXPORT_CAN_HANDLE_RGB | GIMP_EXPORT_CAN_HANDLE_GRAY | 
-        GIMP_EXPORT_CAN_HANDLE_INDEXED | GIMP_EXPORT_CAN_HANDLE_ALPHA;
-            
-Export:
-    export_return = gimp_export_image(&image_ID, &drawable_ID, "JPEG XR", capabilities);
+    // layers are combined band by band while reading where possible; only
+    // images with layer groups or other layer modes are flattened by GIMP
+    export_return = GIMP_EXPORT_IGNORE;
 
-    if (export_return == GIMP_EXPORT_CANCEL)
-    {
-        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
-        return;
-    }
-    
-    image_type = gimp_drawable_type(drawable_ID);
-        
-    switch (image_type)
+    if (!composition_init(&composition, image_ID))
     {
-    case GIMP_RGB_IMAGE:
-        image.pixel_format = GUID_PKPixelFormat24bppRGB; 
-        break;
-    case GIMP_RGBA_IMAGE:
-        image.pixel_format = GUID_PKPixelFormat32bppBGRA;
-        break;
-    case GIMP_GRAY_IMAGE:
-        image.pixel_format = GUID_PKPixelFormat8bppGray;
-        break;
-    case GIMP_GRAYA_IMAGE:
-        ret_values[1].type          = GIMP_PDB_STRING;
-        ret_values[1].data.d_string = _("Grayscale images with an alpha channel are not supported.");
-        return;
-    case GIMP_INDEXED_IMAGE:        
-        if (has_blackwhite_colormap(image_ID, &image.black_one))
+        capabilities = GIMP_EXPORT_CAN_HANDLE_RGB | GIMP_EXPORT_CAN_HANDLE_GRAY | 
+            GIMP_EXPORT_CAN_HANDLE_INDEXED | GIMP_EXPORT_CAN_HANDLE_ALPHA;
+
+        stage_start = trace_begin();
+        export_return = gimp_export_image(&image_ID, &drawable_ID, "JPEG XR", capabilities);
+        trace_end("export-image", stage_start);
+
+        if (export_return == GIMP_EXPORT_CANCEL)
         {
-            image.pixel_format = GUID_PKPixelFormatBlackWhite;
+            ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+            return;
         }
-        else
+
+        if (!composition_init(&composition, image_ID))
         {
+            if (export_return == GIMP_EXPORT_EXPORT)
+                gimp_image_delete(image_ID);
+
             ret_values[1].type          = GIMP_PDB_STRING;
-            ret_values[1].data.d_string = _("Indexed images are not supported except for black-white colormaps.");
+            ret_values[1].data.d_string = g_strdup(_("Image has an unsupported pixel format."));
             return;
-            /*gimp_image_delete(image_ID);
-            capabilities &= GIMP_EXPORT_CAN_HANDLE_RGB | GIMP_EXPORT_CAN_HANDLE_GRAY | GIMP_EXPORT_CAN_HANDLE_ALPHA;
-            goto Export;*/
         }
-        break;
-    case GIMP_INDEXEDA_IMAGE:
-        ret_values[1].type          = GIMP_PDB_STRING;
-        ret_values[1].data.d_string = _("Indexed images with an alpha channel are not supported.");
-        return;
-    default:
-        ret_values[1].type          = GIMP_PDB_STRING;
-        ret_values[1].data.d_string = _("Image has an unsupported pixel format.");
-        return;
     }
+
+    image.pixel_format = composition.pixel_format;
+    image.black_one = composition.black_one;
     
     switch (run_mode)
     {
@@ -185,12 +252,13 @@ Export:
         else
         {
             ret_values[0].data.d_status = GIMP_PDB_CANCEL;
-            return;
+            goto Abort;
         }
         break;
 
     case GIMP_RUN_NONINTERACTIVE:
-        if (nparams == 10)
+        // file-jxr-save takes 10 arguments, file-jxr-save2 the same and 8 more
+        if (nparams == 10 || nparams == 18)
         {
             save_options.image_quality = param[5].data.d_int32;
             save_options.alpha_quality = param[6].data.d_int32;
@@ -200,18 +268,41 @@ Export:
             
             if (save_options.image_quality < 0 || save_options.image_quality > 100 ||
                 save_options.alpha_quality < 0 || save_options.alpha_quality > 100 ||
-                save_options.overlap < 0       || save_options.overlap > 3 ||
-                save_options.subsampling < 0   || save_options.subsampling > 3 ||
-                save_options.tiling < 0        || save_options.tiling > 3)
+                save_options.overlap < 0       || save_options.overlap > 4 ||
+                save_options.subsampling < 0   || save_options.subsampling > 4 ||
+                save_options.tiling < 0        || save_options.tiling > 5)
+            {
+                ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+                goto Abort;
+            }
+
+            if (nparams == 18)
+            {
+                save_options.index_table = param[10].data.d_int32 != 0;
+                save_options.metric = param[15].data.d_int32;
+                save_options.optimize_lossless = param[16].data.d_int32 != 0;
+                save_options.skip_unchanged = param[17].data.d_int32 != 0;
+
+                if (!get_custom_tiles(&param[11], &param[12], save_options.tile_columns, &save_options.tile_column_count) ||
+                    !get_custom_tiles(&param[13], &param[14], save_options.tile_rows, &save_options.tile_row_count) ||
+                    save_options.metric < 0 || save_options.metric >= QP_METRIC_COUNT)
+                {
+                    ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+                    goto Abort;
+                }
+            }
+
+            if (save_options.tiling == TILING_CUSTOM && 
+                (save_options.tile_column_count == 0 || save_options.tile_row_count == 0))
             {
                 ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
-                return;
+                goto Abort;
             }
         }
         else
         {
             ret_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
-            return;
+            goto Abort;
         }   
         break;
 
@@ -222,10 +313,8 @@ Export:
     
     gimp_progress_init_printf(_("Saving '%s'"), gimp_filename_to_utf8(filename));
 
-    drawable = gimp_drawable_get(drawable_ID);
-
-    image.width   = drawable->width;
-    image.height  = drawable->height;
+    progress_init(&progress);
+    progress_set_stage(&progress, 0.0, TRANSFER_PROGRESS);
 
     if (!gimp_image_get_resolution(image_ID, &res_x, &res_y))
     {
@@ -238,32 +327,45 @@ Export:
         image.resolution_y = (gfloat)res_y;
     }
 
-    image.stride = image.width * drawable->bpp;
+    stage_start = trace_begin();
 
-    err = PKAllocAligned(&image.pixels, image.stride * image.height, 128);
-    
-    if (Failed(err))
-    {
-        ret_values[1].type          = GIMP_PDB_STRING;
-        ret_values[1].data.d_string = _("Out of memory.");
-        return;
-    }
+    err = composition_read(&composition, &image, &progress);
 
-    gimp_pixel_rgn_init(&pixel_rgn, drawable, 0, 0, image.width, image.height, FALSE, FALSE);
-    gimp_pixel_rgn_get_rect(&pixel_rgn, image.pixels, 0, 0, image.width, image.height);
+    trace_end("gimp-transfer", stage_start);
 
-    gimp_drawable_detach(drawable);
+    composition_free(&composition);
 
     if (export_return == GIMP_EXPORT_EXPORT)
         gimp_image_delete(image_ID);
+
+    if (err == ERR_CANCELLED)
+    {
+        *nreturn_vals = 1;
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+
+        gimp_progress_end();
+        trace_end("save", save_start);
+        return;
+    }
+    else if (Failed(err))
+    {
+        ret_values[1].type          = GIMP_PDB_STRING;
+        ret_values[1].data.d_string = g_strdup(_("Out of memory."));
+
+        gimp_progress_end();
+        trace_end("save", save_start);
+        return;
+    }
+
+    stage_start = trace_begin();
         
     if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormatBlackWhite))
     {
         convert_indexed_bw(image.pixels, image.width, image.height);
         image.stride = (image.width + 7) / 8;
     }
-    else if (IsEqualGUID(&image.pixel_format, &GUID_PKPixelFormat32bppBGRA))
-        convert_rgba_bgra(image.pixels, image.width, image.height);
+
+    trace_end("convert", stage_start);
 
     icc_parasite = gimp_image_parasite_find(orig_image_ID, "icc-profile");
 
@@ -281,9 +383,11 @@ Export:
         image.xmp_metadata_size = gimp_parasite_data_size(xmp_parasite) - 10;
     }
 
-    err = jxrlib_save(filename, &image, &save_options);
+    progress_set_stage(&progress, TRANSFER_PROGRESS, 1.0 - TRANSFER_PROGRESS);
+
+    err = jxrlib_save(filename, &image, &save_options, &progress);
 
-    PKFreeAligned(&image.pixels); 
+    buffer_free(&image.pixels);
 
     if (icc_parasite != NULL)
     {
@@ -300,28 +404,91 @@ Export:
         *nreturn_vals = 1;
         ret_values[0].data.d_status = GIMP_PDB_SUCCESS;
     }
+    else if (err == ERR_CANCELLED)
+    {
+        *nreturn_vals = 1;
+        ret_values[0].data.d_status = GIMP_PDB_CANCEL;
+    }
     else
     {
         ret_values[1].type          = GIMP_PDB_STRING;
-        ret_values[1].data.d_string = _("An error occurred.");  
+        ret_values[1].data.d_string = g_strdup(_("An error occurred."));
     }
     
     gimp_progress_end();
+    trace_end("save", save_start);
+    return;
+
+Abort:
+    composition_free(&composition);
+
+    if (export_return == GIMP_EXPORT_EXPORT)
+        gimp_image_delete(image_ID);
 } 
 
-static ERR jxrlib_save(const gchar *filename, const Image* image, const SaveOptions* save_options)
+// Encodes image to filename. The channels of 32bppBGRA images are swapped in
+// place for the encoder and swapped back before this returns.
+ERR jxrlib_save(const gchar *filename, const Image* image, const SaveOptions* save_options, Progress* progress)
 {
     ERR                 err;
-    PKFactory*          factory = NULL;
-    struct WMPStream*   stream;
+    struct WMPStream*   stream = NULL;
+    struct WMPStream*   alpha_stream = NULL;
     PKCodecFactory*     codec_factory = NULL;
     PKImageEncode*      encoder = NULL;
     CWMIStrCodecParam   wmiSCP;
+    SaveOptions         options = *save_options;
+    gint64              start;
+    gint64              stage_start;
+    size_t              stream_pos;
+    guint64             size_hint;
+    gchar*              digest = NULL;
 
-    Call(PKCreateFactory(&factory, PK_SDK_VERSION));
-    Call(PKCreateCodecFactory(&codec_factory, WMP_SDK_VERSION));    
+    start = stage_start = trace_begin();
 
-    Call(factory->CreateStreamFromFilename(&stream, filename, "wb"));    
+    if (options.skip_unchanged || get_env_size("GIMP_JXR_SKIP_UNCHANGED", 0) != 0)
+    {
+        digest = manifest_digest(image, save_options);
+
+        if (manifest_matches(filename, digest))
+        {
+            trace_count("skipped-unchanged", 1);
+
+            g_free(digest);
+            digest = NULL;
+            err = WMP_errSuccess;
+            goto Cleanup;
+        }
+
+        stage_start = trace_begin();
+    }
+
+    if (options.overlap == OVERLAP_ADAPTIVE || options.subsampling == SUBSAMPLING_ADAPTIVE)
+    {
+        resolve_adaptive_options(image, &options);
+
+        trace_end("adaptive-options", stage_start);
+        stage_start = trace_begin();
+    }
+
+    save_options = &options;
+
+    Call(get_factories(NULL, &codec_factory));
+
+    // lossy output rarely exceeds the raw pixel size scaled by the quality
+    size_hint = (guint64)image->stride * image->height * MAX(save_options->image_quality, 10) / 100 + 
+        image->color_context_size + image->xmp_metadata_size + 64 * 1024;
+
+    Call(stream_create_atomic(&stream, filename, size_hint));
+
+    if (options.optimize_lossless && options.image_quality == 100)
+    {
+        Call(optimize_lossless(image, &options, stream, progress));
+
+        trace_end("optimize-lossless", stage_start);
+
+        Call(stream_commit(stream));
+        goto Cleanup;
+    }
 
     Call(codec_factory->CreateCodec(&IID_PKImageWmpEncode, (void**)&encoder));
     
@@ -345,50 +512,140 @@ static ERR jxrlib_save(const gchar *filename, const Image* image, const SaveOpti
         Call(PKImageEncode_SetXMPMetadata_WMP(encoder, image->xmp_metadata, image->xmp_metadata_size));
     }
 
-    Call(encoder->WritePixels(encoder, image->height, image->pixels, image->stride));
+    trace_end("encoder-init", stage_start);
+    stage_start = trace_begin();
+
+    // planar alpha is coded in the same sweep as the color plane if the
+    // encoder gets a scratch stream to collect the alpha plane in; without
+    // one, WritePixels makes a second pass over the image for it
+    if (encoder->WMP.wmiSCP.uAlphaMode == 2 && Failed(stream_create_temp(&alpha_stream, filename)))
+    {
+        convert_rgba_bgra(image->pixels, image->width, image->height);
+        err = encoder->WritePixels(encoder, image->height, image->pixels, image->stride);
+        convert_rgba_bgra(image->pixels, image->width, image->height);
+        Call(err);
+    }
+    else
+        Call(encode_bands(encoder, image, alpha_stream, progress));
+
+    trace_end("encode", stage_start);
+
+    if (trace_active && !Failed(stream->GetPos(stream, &stream_pos)))
+        trace_counter("stream-write-bytes", stream_pos);
+
+    Call(stream_commit(stream));
     
 Cleanup:
-    if (encoder)
+    // the encoder closes the stream once it has been initialized with it
+    if (encoder && encoder->pStream == stream)
         encoder->Release(&encoder);
-    
-    if (codec_factory)
-        codec_factory->Release(&codec_factory);
-    
-    if (factory)
-        factory->Release(&factory);
+    else
+    {
+        if (encoder)
+            encoder->Release(&encoder);
+
+        if (stream)
+            stream->Close(&stream);
+    }
+
+    if (alpha_stream)
+        alpha_stream->Close(&alpha_stream);
+
+    if (digest != NULL)
+    {
+        if (!Failed(err))
+            manifest_write(filename, digest);
+
+        g_free(digest);
+    }
+
+    trace_end("jxrlib-save", start);
     
     return err;
 }
 
-static int qp_table[12][6] = { // optimized for PSNR
-    { 67, 79, 86, 72, 90, 98 },
-    { 59, 74, 80, 64, 83, 89 },
-    { 53, 68, 75, 57, 76, 83 },
-    { 49, 64, 71, 53, 70, 77 },
-    { 45, 60, 67, 48, 67, 74 },
-    { 40, 56, 62, 42, 59, 66 },
-    { 33, 49, 55, 35, 51, 58 },
-    { 27, 44, 49, 28, 45, 50 },
-    { 20, 36, 42, 20, 38, 44 },
-    { 13, 27, 34, 13, 28, 34 },
-    {  7, 17, 21,  8, 17, 21 },
-    {  2,  5,  6,  2,  5,  6 }
-};
-
-/*static int qp_table[12][6] = { // optimized for SSIM
-    { 67, 93, 98, 71, 98, 104 },
-    { 59, 83, 88, 61, 89,  95 },
-    { 50, 76, 81, 53, 85,  90 },
-    { 46, 71, 77, 47, 79,  85 },
-    { 41, 67, 71, 42, 75,  78 },
-    { 34, 59, 65, 35, 66,  72 },
-    { 30, 54, 60, 29, 60,  66 },
-    { 24, 48, 53, 22, 53,  58 },
-    { 18, 39, 45, 17, 43,  48 },
-    { 13, 34, 38, 11, 35,  38 },
-    {  8, 20, 24,  7, 22,  25 },
-    {  2,  5,  6,  2,  5,   6 }
-};*/
+// Feeds the image to the encoder band by band. The pixels of 32bppBGRA images
+// arrive in GIMP's RGBA order; the channels of the next band are swapped on a
+// worker thread while the encoder codes the current one, and those of the
+// band coded before it are swapped back, so the caller gets its pixels back
+// unchanged. Rows restored..swapped are in the encoder's order.
+static ERR encode_bands(PKImageEncode* encoder, const Image* image, struct WMPStream* alpha_stream, Progress* progress)
+{
+    ERR         err;
+    TaskGroup*  group = NULL;
+    SwapTask    task;
+    SwapTask    restore_task;
+    guint       band_rows;
+    guint       y;
+    guint       rows;
+    guint       next;
+    guint       swapped = 0;
+    guint       restored = 0;
+
+    // all bands but the last must be a multiple of 16 rows
+    band_rows = MAX(ENCODE_BAND_SIZE / image->stride / 16 * 16, 16);
+
+    if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppBGRA))
+    {
+        group = task_group_new();
+        swapped = MIN(band_rows, image->height);
+        convert_rgba_bgra(image->pixels, image->width, swapped);
+    }
+
+    Call(encoder->WritePixelsBandedBegin(encoder, alpha_stream));
+
+    for (y = 0; y < image->height; y += rows)
+    {
+        rows = MIN(band_rows, image->height - y);
+        next = y + rows;
+
+        if (group != NULL && next < image->height)
+        {
+            task.pixels = image->pixels + (gsize)next * image->stride;
+            task.width = image->width;
+            task.rows = MIN(band_rows, image->height - next);
+            task_group_push(group, run_swap_task, &task);
+            swapped = next + task.rows;
+        }
+
+        if (group != NULL && y > restored)
+        {
+            restore_task.pixels = image->pixels + (gsize)restored * image->stride;
+            restore_task.width = image->width;
+            restore_task.rows = y - restored;
+            task_group_push(group, run_swap_task, &restore_task);
+            restored = y;
+        }
+
+        Call(encoder->WritePixelsBanded(encoder, rows, image->pixels + (gsize)y * image->stride, image->stride, next >= image->height));
+
+        if (group != NULL)
+            task_group_wait(group);
+
+        if (!progress_update(progress, (gdouble)next / image->height))
+            Call(ERR_CANCELLED);
+    }
+
+    Call(encoder->WritePixelsBandedEnd(encoder));
+
+Cleanup:
+    if (group != NULL)
+    {
+        task_group_wait(group);
+        task_group_free(group);
+
+        convert_rgba_bgra(image->pixels + (gsize)restored * image->stride, image->width, swapped - restored);
+    }
+
+    return err;
+}
+
+static void run_swap_task(gpointer data)
+{
+    SwapTask* task = (SwapTask*)data;
+
+    convert_rgba_bgra(task->pixels, task->width, task->rows);
+}
 
 static void apply_save_options(const SaveOptions* save_options, guint width, guint height, PKPixelFormatGUID pixel_format, gboolean black_one, CWMIStrCodecParam* wmiSCP, CWMIStrCodecParam* wmiSCP_Alpha)
 {
@@ -398,7 +655,9 @@ static void apply_save_options(const SaveOptions* save_options, guint width, gui
     
     wmiSCP->bVerbose = FALSE;
     wmiSCP->bdBitDepth = BD_LONG;
-    wmiSCP->bfBitstreamFormat = FREQUENCY;
+    // jxrlib writes the index table needed for region decoding in frequency
+    // order; tiled images carry one in either order
+    wmiSCP->bfBitstreamFormat = save_options->index_table ? FREQUENCY : SPATIAL;
     wmiSCP->bProgressiveMode = TRUE;    
     wmiSCP->sbSubband = SB_ALL;
     wmiSCP->uAlphaMode = IsEqualGUID(&pixel_format, &GUID_PKPixelFormat32bppBGRA) ? 2 : 0;
@@ -427,10 +686,10 @@ static void apply_save_options(const SaveOptions* save_options, guint width, gui
             wmiSCP->uiDefaultQPIndex = (U8)(8 - 5.0f * iq_float + 0.5f);
         else
         {
-            gfloat  iq;
-            gint    qi;
-            gint    *qp_row;
-            float   qf;
+            gfloat          iq;
+            gint            qi;
+            const guint8*   qp_row;
+            float           qf;
 
             if (iq_float > 0.8f)
                 iq = 0.8f + (iq_float - 0.8f) * 1.5f;
@@ -440,7 +699,7 @@ static void apply_save_options(const SaveOptions* save_options, guint width, gui
             qi = (int)(10.0f * iq);
             qf = 10.0f * iq - (float)qi;
             
-            qp_row = qp_table[qi];
+            qp_row = qp_tables[save_options->metric][wmiSCP->cfColorFormat][qi];
 
             wmiSCP->uiDefaultQPIndex    = (U8)(0.5f + qp_row[0] * (1.0f - qf) + (qp_row + 6)[0] * qf);
             wmiSCP->uiDefaultQPIndexU   = (U8)(0.5f + qp_row[1] * (1.0f - qf) + (qp_row + 6)[1] * qf);
@@ -470,46 +729,853 @@ static void apply_save_options(const SaveOptions* save_options, guint width, gui
 
             qi = (int)(10.0f * aq);
             qf = 10.0f * aq - (float)qi;
-            wmiSCP_Alpha->uiDefaultQPIndex = (U8)(0.5f + qp_table[qi][0] * (1.0f - qf) + qp_table[qi + 1][0] * qf);
+            wmiSCP_Alpha->uiDefaultQPIndex = (U8)(0.5f + qp_tables[save_options->metric][Y_ONLY][qi][0] * (1.0f - qf) + 
+                qp_tables[save_options->metric][Y_ONLY][qi + 1][0] * qf);
         }
 
         wmiSCP->uiDefaultQPIndexAlpha = wmiSCP_Alpha->uiDefaultQPIndex;
     }
     
-    if (save_options->tiling == TILING_NONE)
+    switch (save_options->tiling)
+    {
+    case TILING_NONE:
         wmiSCP->cNumOfSliceMinus1H = wmiSCP->cNumOfSliceMinus1V = 0;
+        break;
+
+    case TILING_CUSTOM:
+        set_tile_grid(save_options->tile_rows, save_options->tile_row_count, height, wmiSCP->uiTileY, &wmiSCP->cNumOfSliceMinus1H);
+        set_tile_grid(save_options->tile_columns, save_options->tile_column_count, width, wmiSCP->uiTileX, &wmiSCP->cNumOfSliceMinus1V);
+        break;
+
+    default:
+        {
+            gint32 tile_size;
+            
+            if (save_options->tiling == TILING_RANDOM_ACCESS)
+                tile_size = get_random_access_tile_size(width, height);
+            else
+                tile_size = 256 << (save_options->tiling - 1);
+
+            set_tile_grid(&tile_size, 1, height, wmiSCP->uiTileY, &wmiSCP->cNumOfSliceMinus1H);
+            set_tile_grid(&tile_size, 1, width, wmiSCP->uiTileX, &wmiSCP->cNumOfSliceMinus1V);
+        }
+        break;
+    }
+
+    // Hard tile boundaries keep overlap filtering from reaching into
+    // neighbouring tiles, so that a window decodes only the tiles it covers
+    wmiSCP->bUseHardTileBoundaries = save_options->tiling == TILING_RANDOM_ACCESS;
+}
+
+// Replaces adaptive overlap and subsampling settings with the ones that give
+// the smallest trial encodes at the quality of the non-adaptive defaults
+// (automatic overlap, 4:4:4). Each combination is encoded on a worker thread.
+static void resolve_adaptive_options(const Image* image, SaveOptions* save_options)
+{
+    Image               crops[TRIAL_CROPS];
+    guint               crop_count;
+    TrialTask           trials[1 + 3 * 3];
+    guint               trial_count = 0;
+    OverlapSetting      overlaps[3];
+    guint               overlap_count = 0;
+    SubsamplingSetting  subsamplings[3];
+    guint               subsampling_count = 0;
+    TaskGroup*          group;
+    gboolean            color;
+    gdouble             tolerance;
+    guint               baseline = 0;
+    guint               best;
+    guint               i, j;
+
+    color = IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat24bppRGB) ||
+        IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppBGRA);
+
+    if (save_options->subsampling == SUBSAMPLING_ADAPTIVE)
+        save_options->subsampling = SUBSAMPLING_444;
     else
+        color = FALSE;  // the user's subsampling is kept
+
+    if (save_options->overlap == OVERLAP_ADAPTIVE)
     {
-        gint tile_size = 256 << (save_options->tiling - 1);
-        
-        gint i = 0;
-        guint p = 0;
-        
-        for (i = 0; i < MAX_TILES; i++)
+        // lossless images are never overlapped; black-white images are left
+        // to the quality-based setting
+        save_options->overlap = OVERLAP_AUTO;
+
+        if (save_options->image_quality < 100 && !IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormatBlackWhite))
         {
-            wmiSCP->uiTileY[i] = tile_size / 16;
-            p += tile_size;
-            if (p >= height)
-                break;
+            overlaps[overlap_count++] = OVERLAP_NONE;
+            overlaps[overlap_count++] = OVERLAP_ONE;
+            overlaps[overlap_count++] = OVERLAP_TWO;
         }
-        
-        wmiSCP->cNumOfSliceMinus1H = i;
-        
-        p = 0;
-        
-        for (i = 0; i < MAX_TILES; i++)
+    }
+
+    subsamplings[subsampling_count++] = save_options->subsampling;
+
+    if (color && get_chroma_detail_ratio(image) < CHROMA_DETAIL_RATIO)
+    {
+        subsamplings[subsampling_count++] = SUBSAMPLING_422;
+        subsamplings[subsampling_count++] = SUBSAMPLING_420;
+    }
+
+    if (overlap_count == 0 && subsampling_count == 1)
+        return;
+
+    crop_count = get_trial_crops(image, crops);
+
+    if (crop_count == 0)
+        return;
+
+    // the first trial is the non-adaptive result the others are measured against
+    trials[trial_count++].save_options = *save_options;
+
+    for (i = 0; i < MAX(overlap_count, 1); i++)
+        for (j = 0; j < subsampling_count; j++)
         {
-            wmiSCP->uiTileX[i] = tile_size / 16;
-            p += tile_size;
-            if (p >= width)
+            TrialTask* trial = &trials[trial_count++];
+
+            trial->save_options = *save_options;
+
+            if (overlap_count > 0)
+                trial->save_options.overlap = overlaps[i];
+
+            trial->save_options.subsampling = subsamplings[j];
+        }
+
+    group = task_group_new();
+
+    for (i = 0; i < trial_count; i++)
+    {
+        trials[i].save_options.tiling = TILING_NONE;
+        trials[i].save_options.index_table = FALSE;
+        trials[i].crops = crops;
+        trials[i].crop_count = crop_count;
+        trials[i].metric = save_options->metric;
+
+        task_group_push(group, run_trial_task, &trials[i]);
+    }
+
+    task_group_wait(group);
+    task_group_free(group);
+
+    tolerance = save_options->metric == METRIC_SSIM ? TRIAL_SSIM_TOLERANCE : TRIAL_PSNR_TOLERANCE;
+    best = baseline;
+
+    if (!Failed(trials[baseline].err))
+    {
+        for (i = 1; i < trial_count; i++)
+        {
+            if (Failed(trials[i].err) || get_trial_score(&trials[i]) < get_trial_score(&trials[baseline]) - tolerance)
+                continue;
+
+            if (trials[i].bytes < trials[best].bytes)
+                best = i;
+        }
+    }
+
+    save_options->overlap = trials[best].save_options.overlap;
+    save_options->subsampling = trials[best].save_options.subsampling;
+
+    for (i = 0; i < crop_count; i++)
+        g_free(crops[i].pixels);
+}
+
+// Copies up to TRIAL_CROPS crops, spread over the image, into packed RGB or
+// grayscale images.
+static guint get_trial_crops(const Image* image, Image* crops)
+{
+    guint   width = MIN(image->width, TRIAL_CROP_SIZE);
+    guint   height = MIN(image->height, TRIAL_CROP_SIZE);
+    guint   columns = image->width >= 2 * width ? 2 : 1;
+    guint   rows = image->height >= 2 * height ? 2 : 1;
+    guint   channels;
+    guint   bytes_per_pixel;
+    guint   count = 0;
+    guint   i, j, y, x;
+
+    if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormatBlackWhite) || width < 16 || height < 16)
+        return 0;
+
+    channels = IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat8bppGray) ? 1 : 3;
+    bytes_per_pixel = image->stride / image->width;
+
+    for (i = 0; i < rows; i++)
+        for (j = 0; j < columns; j++)
+        {
+            Image*  crop = &crops[count++];
+            guint   x0 = columns == 1 ? (image->width - width) / 2 : (image->width - width) * (1 + 2 * j) / 4;
+            guint   y0 = rows == 1 ? (image->height - height) / 2 : (image->height - height) * (1 + 2 * i) / 4;
+
+            memset(crop, 0, sizeof(*crop));
+            crop->width = width;
+            crop->height = height;
+            crop->stride = width * channels;
+            crop->resolution_x = crop->resolution_y = 72.0f;
+            crop->pixel_format = channels == 1 ? GUID_PKPixelFormat8bppGray : GUID_PKPixelFormat24bppRGB;
+            crop->pixels = g_malloc((gsize)crop->stride * height);
+
+            for (y = 0; y < height; y++)
+            {
+                const guchar*   src = image->pixels + (gsize)(y0 + y) * image->stride + (gsize)x0 * bytes_per_pixel;
+                guchar*         dst = crop->pixels + (gsize)y * crop->stride;
+
+                if (bytes_per_pixel == channels)
+                    memcpy(dst, src, crop->stride);
+                else
+                    for (x = 0; x < width; x++)
+                        memcpy(dst + x * 3, src + x * bytes_per_pixel, 3);
+            }
+        }
+
+    return count;
+}
+
+// Ratio of the horizontal chroma gradients to the luma gradients, sampled on
+// every fourth row.
+static gdouble get_chroma_detail_ratio(const Image* image)
+{
+    guint   bytes_per_pixel = image->stride / image->width;
+    guint64 luma = 0;
+    guint64 chroma = 0;
+    guint   x, y;
+
+    for (y = 0; y < image->height; y += 4)
+    {
+        const guchar*   p = image->pixels + (gsize)y * image->stride;
+        gint            last_y = 0, last_cb = 0, last_cr = 0;
+
+        for (x = 0; x < image->width; x++, p += bytes_per_pixel)
+        {
+            gint luma_value = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+            gint cb = p[2] - luma_value;
+            gint cr = p[0] - luma_value;
+
+            if (x > 0)
+            {
+                luma += ABS(luma_value - last_y);
+                chroma += ABS(cb - last_cb) + ABS(cr - last_cr);
+            }
+
+            last_y = luma_value;
+            last_cb = cb;
+            last_cr = cr;
+        }
+    }
+
+    return (gdouble)chroma / (2 * luma + 1);
+}
+
+static void run_trial_task(gpointer data)
+{
+    TrialTask*  trial = (TrialTask*)data;
+    gsize       buffer_size = (gsize)trial->crops[0].stride * trial->crops[0].height * 2 + 64 * 1024;
+    guchar*     buffer = g_malloc(buffer_size);
+    guchar*     pixels = g_malloc((gsize)trial->crops[0].stride * trial->crops[0].height);
+    gsize       size;
+    guint       i;
+
+    trial->bytes = 0;
+    trial->error_sum = 0.0;
+    trial->error_count = 0;
+    trial->err = WMP_errSuccess;
+
+    for (i = 0; i < trial->crop_count && !Failed(trial->err); i++)
+    {
+        trial->err = encode_trial(&trial->crops[i], &trial->save_options, buffer, buffer_size, &size);
+
+        if (!Failed(trial->err))
+            trial->err = decode_trial(buffer, size, &trial->crops[i], pixels);
+
+        if (!Failed(trial->err))
+        {
+            trial->bytes += size;
+            measure_error(&trial->crops[i], pixels, trial->metric, &trial->error_sum, &trial->error_count);
+        }
+    }
+
+    g_free(pixels);
+    g_free(buffer);
+}
+
+static ERR encode_trial(const Image* crop, const SaveOptions* save_options, guchar* buffer, gsize buffer_size, gsize* size)
+{
+    ERR                 err;
+    PKFactory*          factory;
+    PKCodecFactory*     codec_factory;
+    struct WMPStream*   stream = NULL;
+    PKImageEncode*      encoder = NULL;
+    CWMIStrCodecParam   wmiSCP;
+    size_t              pos;
+
+    Call(get_factories(&factory, &codec_factory));
+    Call(factory->CreateStreamFromMemory(&stream, buffer, buffer_size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpEncode, (void**)&encoder));
+
+    apply_save_options(save_options, crop->width, crop->height, crop->pixel_format, FALSE, &wmiSCP, NULL);
+
+    Call(encoder->Initialize(encoder, stream, &wmiSCP, sizeof(wmiSCP)));
+    Call(encoder->SetPixelFormat(encoder, crop->pixel_format));
+    Call(encoder->SetSize(encoder, crop->width, crop->height));
+    Call(encoder->SetResolution(encoder, crop->resolution_x, crop->resolution_y));
+    Call(encoder->WritePixels(encoder, crop->height, crop->pixels, crop->stride));
+    Call(stream->GetPos(stream, &pos));
+
+    *size = pos;
+
+Cleanup:
+    // the encoder closes the stream once it has been initialized with it
+    if (encoder && encoder->pStream == stream)
+        encoder->Release(&encoder);
+    else
+    {
+        if (encoder)
+            encoder->Release(&encoder);
+
+        if (stream)
+            stream->Close(&stream);
+    }
+
+    return err;
+}
+
+static ERR decode_trial(guchar* buffer, gsize size, const Image* crop, guchar* pixels)
+{
+    ERR                 err;
+    PKFactory*          factory;
+    PKCodecFactory*     codec_factory;
+    struct WMPStream*   stream = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKRect              rect;
+
+    Call(get_factories(&factory, &codec_factory));
+    Call(factory->CreateStreamFromMemory(&stream, buffer, size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpDecode, (void**)&decoder));
+    Call(decoder->Initialize(decoder, stream));
+
+    rect.X = 0;
+    rect.Y = 0;
+    rect.Width = crop->width;
+    rect.Height = crop->height;
+
+    Call(decoder->Copy(decoder, &rect, pixels, crop->stride));
+
+Cleanup:
+    if (decoder)
+        decoder->Release(&decoder);
+
+    // decoders only own streams they opened themselves
+    if (stream)
+        stream->Close(&stream);
+
+    return err;
+}
+
+// Adds the squared error (PSNR) or the SSIM of 8 x 8 windows at a distance of
+// 4 pixels (SSIM) of a decoded crop to sum and the number of terms to count.
+static void measure_error(const Image* crop, const guchar* pixels, MetricSetting metric, gdouble* sum, guint64* count)
+{
+    const gdouble   c1 = (0.01 * 255) * (0.01 * 255);
+    const gdouble   c2 = (0.03 * 255) * (0.03 * 255);
+    guint           channels = crop->stride / crop->width;
+    guint           x, y, c, i, j;
+
+    if (metric == METRIC_PSNR)
+    {
+        gsize length = (gsize)crop->stride * crop->height;
+        gsize k;
+
+        for (k = 0; k < length; k++)
+        {
+            gint d = crop->pixels[k] - pixels[k];
+            *sum += d * d;
+        }
+
+        *count += length;
+        return;
+    }
+
+    for (y = 0; y + 8 <= crop->height; y += 4)
+        for (x = 0; x + 8 <= crop->width; x += 4)
+            for (c = 0; c < channels; c++)
+            {
+                gdouble sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+                gdouble ma, mb, va, vb, cov;
+
+                for (j = 0; j < 8; j++)
+                    for (i = 0; i < 8; i++)
+                    {
+                        gsize   offset = (gsize)(y + j) * crop->stride + (x + i) * channels + c;
+                        gdouble pa = crop->pixels[offset];
+                        gdouble pb = pixels[offset];
+
+                        sa += pa;
+                        sb += pb;
+                        saa += pa * pa;
+                        sbb += pb * pb;
+                        sab += pa * pb;
+                    }
+
+                ma = sa / 64;
+                mb = sb / 64;
+                va = saa / 64 - ma * ma;
+                vb = sbb / 64 - mb * mb;
+                cov = sab / 64 - ma * mb;
+
+                *sum += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+                (*count)++;
+            }
+}
+
+static gdouble get_trial_score(const TrialTask* trial)
+{
+    if (trial->metric == METRIC_SSIM)
+        return trial->error_count > 0 ? trial->error_sum / trial->error_count : 0.0;
+
+    if (trial->error_sum == 0.0)
+        return 99.0;
+
+    return 10.0 * log10(255.0 * 255.0 * trial->error_count / trial->error_sum);
+}
+
+// Encodes the image with every lossless setting combination into memory and
+// writes the smallest result to stream. Encodes run on the shared workers, at
+// most GIMP_JXR_OPTIMIZE_THREADS at a time (all workers by default) and only
+// as many as fit GIMP_JXR_OPTIMIZE_MEMORY (1 GiB by default); those not
+// started within GIMP_JXR_OPTIMIZE_SECONDS are skipped. The first candidate
+// is what a plain lossless save writes and always runs.
+static ERR optimize_lossless(const Image* image, const SaveOptions* save_options, struct WMPStream* stream, Progress* progress)
+{
+    ERR                 err;
+    LosslessCandidate   candidates[2 * 4 * 2 * 2];
+    LosslessTask*       tasks;
+    LosslessSearch      search;
+    TaskGroup*          group;
+    guint               count;
+    guint               threads;
+    guint               finished;
+    gboolean            cancelled;
+    guint               i;
+
+    count = get_lossless_candidates(image, save_options, candidates);
+    threads = (guint)get_env_size("GIMP_JXR_OPTIMIZE_THREADS", get_worker_count());
+
+    memset(&search, 0, sizeof(search));
+    g_mutex_init(&search.mutex);
+    g_cond_init(&search.cond);
+    search.deadline = g_get_monotonic_time() + 
+        (gint64)get_env_size("GIMP_JXR_OPTIMIZE_SECONDS", DEFAULT_OPTIMIZE_SECONDS) * G_TIME_SPAN_SECOND;
+    search.budget = get_env_size("GIMP_JXR_OPTIMIZE_MEMORY", DEFAULT_OPTIMIZE_MEMORY);
+
+    if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppBGRA))
+        convert_rgba_bgra(image->pixels, image->width, image->height);
+
+    tasks = g_new(LosslessTask, count);
+    search.tasks = tasks;
+    search.count = count;
+
+    for (i = 0; i < count; i++)
+    {
+        tasks[i].image = image;
+        tasks[i].save_options = save_options;
+        tasks[i].candidate = candidates[i];
+        tasks[i].index = i;
+        tasks[i].verify = candidates[i].overlap != candidates[0].overlap ||
+            candidates[i].color_format != candidates[0].color_format;
+        tasks[i].capacity = (gsize)image->stride * image->height * 2 + 
+            image->color_context_size + image->xmp_metadata_size + 64 * 1024;
+        tasks[i].search = &search;
+    }
+
+    // each runner encodes candidates in order until none are left
+    group = task_group_new();
+
+    for (i = 0; i < MIN(MAX(threads, 1), count); i++)
+        task_group_push(group, run_lossless_runner, &search);
+
+    // on a worker (a batch save) there is no progress to report; waiting on
+    // the group there encodes candidates instead of blocking a worker
+    if (get_worker_index() < 0)
+    {
+        g_mutex_lock(&search.mutex);
+
+        while (search.finished < count)
+        {
+            g_cond_wait_until(&search.cond, &search.mutex, g_get_monotonic_time() + G_TIME_SPAN_SECOND / 10);
+            finished = search.finished;
+            g_mutex_unlock(&search.mutex);
+
+            cancelled = !progress_update(progress, (gdouble)finished / count);
+
+            g_mutex_lock(&search.mutex);
+            search.cancelled |= cancelled;
+        }
+
+        g_mutex_unlock(&search.mutex);
+    }
+
+    task_group_free(group);
+    g_free(tasks);
+
+    if (IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppBGRA))
+        convert_rgba_bgra(image->pixels, image->width, image->height);
+
+    FailIf(search.cancelled, ERR_CANCELLED);
+    FailIf(search.best == NULL, Failed(search.err) ? search.err : WMP_errFail);
+
+    trace_counter("lossless-best-bytes", search.best_size);
+
+    Call(stream->Write(stream, search.best, search.best_size));
+
+Cleanup:
+    if (search.best != NULL)
+        buffer_free(&search.best);
+
+    g_cond_clear(&search.cond);
+    g_mutex_clear(&search.mutex);
+
+    return err;
+}
+
+// Lists the setting combinations to try, starting with the plain lossless
+// settings. Tiling is only varied if none was requested, and the bitstream
+// order only if no index table was. Y-only coding is lossless for color
+// images whose pixels are all gray; results that change overlap or color
+// format are checked by decoding them. Alpha is always coded as a separate
+// plane; jxrlib's only other alpha mode codes the alpha plane alone.
+static guint get_lossless_candidates(const Image* image, const SaveOptions* save_options, LosslessCandidate* candidates)
+{
+    BITSTREAMFORMAT     bitstream_formats[2];
+    TilingSetting       tilings[4];
+    COLORFORMAT         color_formats[2];
+    OVERLAP             overlaps[2] = { OL_NONE, OL_ONE };
+    guint               bitstream_format_count = 0;
+    guint               tiling_count = 0;
+    guint               color_format_count = 0;
+    guint               count = 0;
+    guint               b, t, o, c;
+    gboolean            color;
+
+    color = IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat24bppRGB) ||
+        IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppBGRA);
+
+    bitstream_formats[bitstream_format_count++] = save_options->index_table ? FREQUENCY : SPATIAL;
+
+    if (!save_options->index_table)
+        bitstream_formats[bitstream_format_count++] = FREQUENCY;
+
+    tilings[tiling_count++] = save_options->tiling;
+
+    if (save_options->tiling == TILING_NONE)
+    {
+        tilings[tiling_count++] = TILING_256;
+        tilings[tiling_count++] = TILING_512;
+        tilings[tiling_count++] = TILING_1024;
+    }
+
+    color_formats[color_format_count++] = color ? (COLORFORMAT)save_options->subsampling : Y_ONLY;
+
+    if (color && save_options->subsampling != SUBSAMPLING_YONLY && is_gray(image))
+        color_formats[color_format_count++] = Y_ONLY;
+
+    for (b = 0; b < bitstream_format_count; b++)
+        for (t = 0; t < tiling_count; t++)
+            for (o = 0; o < G_N_ELEMENTS(overlaps); o++)
+                for (c = 0; c < color_format_count; c++)
+                {
+                    LosslessCandidate* candidate = &candidates[count++];
+
+                    candidate->bitstream_format = bitstream_formats[b];
+                    candidate->tiling = tilings[t];
+                    candidate->overlap = overlaps[o];
+                    candidate->color_format = color_formats[c];
+                }
+
+    return count;
+}
+
+static gboolean is_gray(const Image* image)
+{
+    guint   bytes_per_pixel = image->stride / image->width;
+    guint   x, y;
+
+    for (y = 0; y < image->height; y++)
+    {
+        const guchar* p = image->pixels + (gsize)y * image->stride;
+
+        for (x = 0; x < image->width; x++, p += bytes_per_pixel)
+            if (p[0] != p[1] || p[1] != p[2])
+                return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Encodes candidates in order until none are left. A candidate only starts
+// while the buffers reserved by all runners and the best result fit the
+// memory budget, or when no other candidate is running. Its output buffer is
+// capped at the best size found so far, so a candidate that cannot win fails
+// once it outgrows that instead of being encoded to the end. The pixels that
+// verifications decode to are allocated once per runner.
+static void run_lossless_runner(gpointer data)
+{
+    LosslessSearch*     search = (LosslessSearch*)data;
+    LosslessTask*       task;
+    guchar*             pixels = NULL;
+    guint64             pixels_reserved = 0;
+    guint64             verify_size;
+    gsize               capacity;
+    guint               next;
+
+    for (;;)
+    {
+        g_mutex_lock(&search->mutex);
+
+        next = search->next++;
+
+        if (next >= search->count)
+        {
+            g_mutex_unlock(&search->mutex);
+            break;
+        }
+
+        task = &search->tasks[next];
+        verify_size = task->verify && pixels == NULL ? (guint64)task->image->stride * task->image->height : 0;
+
+        for (;;)
+        {
+            capacity = search->best != NULL ? MIN(task->capacity, search->best_size) : task->capacity;
+
+            if (search->running == 0 || search->cancelled || search->in_use + capacity + verify_size <= search->budget)
                 break;
+
+            g_cond_wait(&search->cond, &search->mutex);
         }
+
+        search->running++;
+        search->in_use += capacity + verify_size;
+        pixels_reserved += verify_size;
+        g_mutex_unlock(&search->mutex);
+
+        if (verify_size > 0 && Failed(buffer_alloc(&pixels, verify_size)))
+            pixels = NULL;
+
+        run_lossless_task(task, capacity, pixels);
+    }
+
+    if (pixels != NULL)
+        buffer_free(&pixels);
+
+    g_mutex_lock(&search->mutex);
+    search->in_use -= pixels_reserved;
+    g_cond_broadcast(&search->cond);
+    g_mutex_unlock(&search->mutex);
+}
+
+// Encodes one candidate into a buffer of capacity bytes, which the runner has
+// reserved; pixels is the runner's verification buffer, if it has one
+static void run_lossless_task(LosslessTask* task, gsize capacity, guchar* pixels)
+{
+    LosslessSearch*     search = task->search;
+    ERR                 err = WMP_errSuccess;
+    guchar*             buffer = NULL;
+    gsize               size = 0;
+    gboolean            skip;
+
+    g_mutex_lock(&search->mutex);
+    skip = search->cancelled || (task->index > 0 && g_get_monotonic_time() > search->deadline);
+    g_mutex_unlock(&search->mutex);
+
+    if (!skip)
+    {
+        err = buffer_alloc(&buffer, capacity);
+
+        if (!Failed(err))
+            err = encode_lossless(task->image, task->save_options, &task->candidate, buffer, capacity, &size);
+
+        if (!Failed(err) && task->verify)
+            err = pixels != NULL ? verify_lossless(task->image, buffer, size, pixels) : WMP_errOutOfMemory;
+    }
+
+    g_mutex_lock(&search->mutex);
+
+    if (!skip && !Failed(err) && (search->best == NULL || size < search->best_size))
+    {
+        guchar* previous = search->best;
+        gsize   previous_capacity = search->best_capacity;
+
+        // the reservation of the buffer moves to the new best; that of the
+        // previous best is released below instead
+        search->best = buffer;
+        search->best_size = size;
+        search->best_capacity = capacity;
+        buffer = previous;
+        capacity = previous_capacity;
+    }
+
+    if (task->index == 0)
+        search->err = err;
+
+    search->in_use -= capacity;
+    search->running--;
+    search->finished++;
+    g_cond_broadcast(&search->cond);
+    g_mutex_unlock(&search->mutex);
+
+    if (buffer != NULL)
+        buffer_free(&buffer);
+}
+
+static ERR encode_lossless(const Image* image, const SaveOptions* save_options, const LosslessCandidate* candidate, guchar* buffer, gsize buffer_size, gsize* size)
+{
+    ERR                 err;
+    PKFactory*          factory;
+    PKCodecFactory*     codec_factory;
+    struct WMPStream*   stream = NULL;
+    PKImageEncode*      encoder = NULL;
+    CWMIStrCodecParam   wmiSCP;
+    SaveOptions         options = *save_options;
+    size_t              pos;
+
+    options.tiling = candidate->tiling;
+
+    Call(get_factories(&factory, &codec_factory));
+    Call(factory->CreateStreamFromMemory(&stream, buffer, buffer_size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpEncode, (void**)&encoder));
+
+    apply_save_options(&options, image->width, image->height, image->pixel_format, image->black_one, &wmiSCP, NULL);
+
+    wmiSCP.bfBitstreamFormat = candidate->bitstream_format;
+    wmiSCP.olOverlap = candidate->overlap;
+    wmiSCP.cfColorFormat = candidate->color_format;
+
+    Call(encoder->Initialize(encoder, stream, &wmiSCP, sizeof(wmiSCP)));
+
+    apply_save_options(&options, image->width, image->height, image->pixel_format, image->black_one, &wmiSCP, &encoder->WMP.wmiSCP_Alpha);
+
+    Call(encoder->SetPixelFormat(encoder, image->pixel_format));
+    Call(encoder->SetSize(encoder, image->width, image->height));
+    Call(encoder->SetResolution(encoder, image->resolution_x, image->resolution_y));
+
+    if (image->color_context_size != 0)
+    {
+        Call(encoder->SetColorContext(encoder, image->color_context, image->color_context_size));
+    }
+
+    if (image->xmp_metadata_size != 0)
+    {
+        Call(PKImageEncode_SetXMPMetadata_WMP(encoder, image->xmp_metadata, image->xmp_metadata_size));
+    }
+
+    Call(encoder->WritePixels(encoder, image->height, image->pixels, image->stride));
+    Call(stream->GetPos(stream, &pos));
+
+    *size = pos;
+
+Cleanup:
+    // the encoder closes the stream once it has been initialized with it
+    if (encoder && encoder->pStream == stream)
+        encoder->Release(&encoder);
+    else
+    {
+        if (encoder)
+            encoder->Release(&encoder);
+
+        if (stream)
+            stream->Close(&stream);
+    }
+
+    return err;
+}
+
+// Decodes an encoded candidate into pixels, which must hold the image, and
+// fails unless it matches the image exactly.
+static ERR verify_lossless(const Image* image, guchar* buffer, gsize size, guchar* pixels)
+{
+    ERR                 err;
+    PKFactory*          factory;
+    PKCodecFactory*     codec_factory;
+    struct WMPStream*   stream = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKRect              rect;
+    guint               y;
+
+    Call(get_factories(&factory, &codec_factory));
+    Call(factory->CreateStreamFromMemory(&stream, buffer, size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpDecode, (void**)&decoder));
+    Call(decoder->Initialize(decoder, stream));
+
+    decoder->WMP.wmiSCP.uAlphaMode = IsEqualGUID(&image->pixel_format, &GUID_PKPixelFormat32bppBGRA) ? 2 : 0;
+
+    rect.X = 0;
+    rect.Y = 0;
+    rect.Width = image->width;
+    rect.Height = image->height;
+
+    Call(decoder->Copy(decoder, &rect, pixels, image->stride));
+
+    for (y = 0; y < image->height; y++)
+        FailIf(memcmp(pixels + (gsize)y * image->stride, image->pixels + (gsize)y * image->stride, image->stride) != 0, WMP_errFail);
+
+Cleanup:
+    if (decoder)
+        decoder->Release(&decoder);
+
+    // decoders only own streams they opened themselves
+    if (stream)
+        stream->Close(&stream);
+
+    return err;
+}
+
+// Fills a tile size list in macroblock units from sizes in pixels, repeating
+// the last size until the tiles cover extent.
+static void set_tile_grid(const gint32* sizes, guint count, guint extent, U32* tiles, U32* num_tiles_minus1)
+{
+    guint i;
+    guint p = 0;
+
+    for (i = 0; i < MAX_TILES - 1; i++)
+    {
+        tiles[i] = sizes[MIN(i, count - 1)] / 16;
+        p += sizes[MIN(i, count - 1)];
+        if (p >= extent)
+            break;
+    }
+
+    *num_tiles_minus1 = i;
+}
+
+static gint32 get_random_access_tile_size(guint width, guint height)
+{
+    gint32 tile_size = 256;
+
+    while (tile_size < 4096 && 
+        (guint64)((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size) > RANDOM_ACCESS_MAX_TILES)
+        tile_size *= 2;
+
+    return tile_size;
+}
+
+static gboolean get_custom_tiles(const GimpParam* count_param, const GimpParam* sizes_param, gint32* sizes, gint* count)
+{
+    gint i;
+
+    if (count_param->data.d_int32 < 0 || count_param->data.d_int32 > MAX_CUSTOM_TILES)
+        return FALSE;
+
+    for (i = 0; i < count_param->data.d_int32; i++)
+    {
+        if (sizes_param->data.d_int32array[i] <= 0 || sizes_param->data.d_int32array[i] % 16 != 0)
+            return FALSE;
         
-        wmiSCP->cNumOfSliceMinus1V = i;
+        sizes[i] = sizes_param->data.d_int32array[i];
     }
+
+    *count = count_param->data.d_int32;
+
+    return TRUE;
 }
 
-static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled, gboolean subsampling_enabled)
+gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled, gboolean subsampling_enabled)
 {
     SaveGui     save_gui;
     gboolean    dialog_result;
@@ -564,7 +1630,7 @@ static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled,
     gtk_box_pack_start(GTK_BOX(save_gui.advanced_vbox), save_gui.advanced_frame, FALSE, FALSE, 0);
     gtk_widget_show(save_gui.advanced_frame);
     
-    save_gui.advanced_table = gtk_table_new(3, 2, FALSE);
+    save_gui.advanced_table = gtk_table_new(6, 2, FALSE);
     gtk_table_set_col_spacings(GTK_TABLE(save_gui.advanced_table), 6);
     gtk_table_set_row_spacings(GTK_TABLE(save_gui.advanced_table), 6);
     gtk_container_add(GTK_CONTAINER(save_gui.advanced_frame), save_gui.advanced_table);
@@ -580,8 +1646,9 @@ static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled,
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.overlap_combo_box), _("None"));
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.overlap_combo_box), _("One level"));
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.overlap_combo_box), _("Two level"));
+    gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.overlap_combo_box), _("Adapt to image"));
     gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui.overlap_combo_box), save_options->overlap);
-    gtk_widget_set_tooltip_text(save_gui.overlap_combo_box, _("Higher levels reduce block artifacts but may introduce blurring and increase decoding time."));
+    gtk_widget_set_tooltip_text(save_gui.overlap_combo_box, _("Higher levels reduce block artifacts but may introduce blurring and increase decoding time. \"Adapt to image\" picks the level that gives the smallest file in trial encodes."));
     gtk_label_set_mnemonic_widget(GTK_LABEL(save_gui.overlap_label), save_gui.overlap_combo_box);
     gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.overlap_combo_box, 1, 2, 0, 1, GTK_FILL, (GtkAttachOptions)0, 0, 0);
     gtk_widget_show(save_gui.overlap_combo_box);    
@@ -597,8 +1664,9 @@ static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled,
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.subsampling_combo_box), _("4:2:0"));
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.subsampling_combo_box), _("4:2:2"));
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.subsampling_combo_box), _("4:4:4"));
+    gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.subsampling_combo_box), _("Adapt to image"));
     gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui.subsampling_combo_box), save_options->subsampling);
-    gtk_widget_set_tooltip_text(save_gui.subsampling_combo_box, _("4:4:4 usually provides best size/quality tradeoff."));
+    gtk_widget_set_tooltip_text(save_gui.subsampling_combo_box, _("4:4:4 usually provides best size/quality tradeoff. \"Adapt to image\" picks the mode that gives the smallest file in trial encodes."));
     gtk_widget_set_sensitive(save_gui.subsampling_combo_box, subsampling_enabled);
     gtk_label_set_mnemonic_widget(GTK_LABEL(save_gui.subsampling_label), save_gui.subsampling_combo_box);
     gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.subsampling_combo_box, 1, 2, 1, 2, GTK_FILL, (GtkAttachOptions)0, 0, 0);
@@ -614,12 +1682,41 @@ static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled,
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.tiling_combo_box), _("256 x 256"));
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.tiling_combo_box), _("512 x 512"));
     gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.tiling_combo_box), _("1024 x 1024"));
+    gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.tiling_combo_box), _("Optimize for random access"));
+    if (save_options->tiling == TILING_CUSTOM)
+        gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.tiling_combo_box), _("Custom"));
     gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui.tiling_combo_box), save_options->tiling);
     gtk_widget_set_tooltip_text(save_gui.tiling_combo_box, _("Tiling optimizes the image for region decoding and is otherwise not needed."));
     gtk_label_set_mnemonic_widget(GTK_LABEL(save_gui.tiling_label), save_gui.tiling_combo_box);
     gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.tiling_combo_box, 1, 2, 2, 3, GTK_FILL, (GtkAttachOptions)0, 0, 0);
     gtk_widget_show(save_gui.tiling_combo_box); 
 
+    save_gui.index_table_check_button = gtk_check_button_new_with_mnemonic(_("Write _index table"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(save_gui.index_table_check_button), save_options->index_table);
+    gtk_widget_set_tooltip_text(save_gui.index_table_check_button, _("The index table lets viewers decode regions of the image without reading the whole file."));
+    gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.index_table_check_button, 0, 2, 3, 4, GTK_FILL, (GtkAttachOptions)0, 0, 0);
+    gtk_widget_show(save_gui.index_table_check_button); 
+
+    save_gui.metric_label = gtk_label_new_with_mnemonic(_("Opti_mize for:"));
+    gtk_misc_set_alignment(GTK_MISC(save_gui.metric_label), 0.0, 0.5);
+    gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.metric_label, 0, 1, 4, 5, GTK_FILL, (GtkAttachOptions)0, 0, 0);
+    gtk_widget_show(save_gui.metric_label);
+    
+    save_gui.metric_combo_box = gtk_combo_box_new_text();
+    gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.metric_combo_box), _("PSNR"));
+    gtk_combo_box_append_text(GTK_COMBO_BOX(save_gui.metric_combo_box), _("SSIM"));
+    gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui.metric_combo_box), save_options->metric);
+    gtk_widget_set_tooltip_text(save_gui.metric_combo_box, _("Quality measure the quantizer settings are tuned for."));
+    gtk_label_set_mnemonic_widget(GTK_LABEL(save_gui.metric_label), save_gui.metric_combo_box);
+    gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.metric_combo_box, 1, 2, 4, 5, GTK_FILL, (GtkAttachOptions)0, 0, 0);
+    gtk_widget_show(save_gui.metric_combo_box);
+
+    save_gui.optimize_lossless_check_button = gtk_check_button_new_with_mnemonic(_("Optimi_ze lossless size"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(save_gui.optimize_lossless_check_button), save_options->optimize_lossless);
+    gtk_widget_set_tooltip_text(save_gui.optimize_lossless_check_button, _("At quality 100, try several lossless encoder settings in parallel and keep the smallest file. Saving takes longer."));
+    gtk_table_attach(GTK_TABLE(save_gui.advanced_table), save_gui.optimize_lossless_check_button, 0, 2, 5, 6, GTK_FILL, (GtkAttachOptions)0, 0, 0);
+    gtk_widget_show(save_gui.optimize_lossless_check_button);
+
     save_gui.defaults_table = gtk_table_new(1, 3, FALSE);
     gtk_table_set_col_spacings(GTK_TABLE(save_gui.defaults_table), 6);
     gtk_box_pack_start(GTK_BOX(save_gui.vbox), save_gui.defaults_table, FALSE, FALSE, 0);
@@ -640,6 +1737,9 @@ static gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled,
     save_options->overlap = gtk_combo_box_get_active(GTK_COMBO_BOX(save_gui.overlap_combo_box));
     save_options->subsampling = gtk_combo_box_get_active(GTK_COMBO_BOX(save_gui.subsampling_combo_box));
     save_options->tiling = gtk_combo_box_get_active(GTK_COMBO_BOX(save_gui.tiling_combo_box));
+    save_options->index_table = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(save_gui.index_table_check_button));
+    save_options->metric = gtk_combo_box_get_active(GTK_COMBO_BOX(save_gui.metric_combo_box));
+    save_options->optimize_lossless = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(save_gui.optimize_lossless_check_button));
 
     gtk_widget_destroy(save_gui.dialog);
 
@@ -653,6 +1753,9 @@ static void load_save_gui_defaults(const SaveGui* save_gui)
     gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui->overlap_combo_box), DEFAULT_SAVE_OPTIONS.overlap);
     gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui->subsampling_combo_box), DEFAULT_SAVE_OPTIONS.subsampling);
     gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui->tiling_combo_box), DEFAULT_SAVE_OPTIONS.tiling);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(save_gui->index_table_check_button), DEFAULT_SAVE_OPTIONS.index_table);
+    gtk_combo_box_set_active(GTK_COMBO_BOX(save_gui->metric_combo_box), DEFAULT_SAVE_OPTIONS.metric);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(save_gui->optimize_lossless_check_button), DEFAULT_SAVE_OPTIONS.optimize_lossless);
 }
 
 /*static void open_help(const gchar* help_id, gpointer help_data)
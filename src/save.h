@@ -0,0 +1,72 @@
+#ifndef SAVE_H
+#define SAVE_H
+
+#include "file-jxr.h"
+#include <JXRGlue.h>
+#include "utils.h"
+
+typedef enum
+{
+    OVERLAP_AUTO,
+    OVERLAP_NONE,
+    OVERLAP_ONE,
+    OVERLAP_TWO,
+    OVERLAP_ADAPTIVE
+} OverlapSetting;
+
+typedef enum
+{
+    SUBSAMPLING_YONLY,
+    SUBSAMPLING_420,
+    SUBSAMPLING_422,
+    SUBSAMPLING_444,
+    SUBSAMPLING_ADAPTIVE
+} SubsamplingSetting;
+
+typedef enum
+{
+    TILING_NONE,
+    TILING_256,
+    TILING_512,
+    TILING_1024,
+    TILING_RANDOM_ACCESS,
+    TILING_CUSTOM
+} TilingSetting;
+
+// Order of the tables in qptables.h
+typedef enum
+{
+    METRIC_PSNR,
+    METRIC_SSIM
+} MetricSetting;
+
+// Maximum number of entries in a custom tile column or row list; the last
+// entry is repeated up to the edge of the image
+#define MAX_CUSTOM_TILES 256
+
+typedef struct
+{
+    gint                image_quality;
+    gint                alpha_quality;
+    OverlapSetting      overlap;
+    SubsamplingSetting  subsampling;
+    TilingSetting       tiling; 
+    gboolean            index_table;
+    MetricSetting       metric;
+    gboolean            optimize_lossless;
+    gboolean            skip_unchanged;     // keep outputs whose recorded digest matches
+    gint                tile_column_count;
+    gint32              tile_columns[MAX_CUSTOM_TILES];
+    gint                tile_row_count;
+    gint32              tile_rows[MAX_CUSTOM_TILES];
+} SaveOptions;
+
+extern const SaveOptions DEFAULT_SAVE_OPTIONS;
+
+void save(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+void save_derivatives(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+void save_layers(gint nparams, const GimpParam* param, gint* nreturn_vals, GimpParam** return_vals);
+ERR jxrlib_save(const gchar *filename, const Image* image, const SaveOptions* save_options, Progress* progress);
+gboolean show_options(SaveOptions* save_options, gboolean alpha_enabled, gboolean subsampling_enabled);
+
+#endif
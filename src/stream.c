@@ -0,0 +1,609 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // fallocate
+#endif
+
+#include "stream.h"
+#include "utils.h"
+#include "buffers.h"
+
+#ifdef G_OS_UNIX
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// Output stream for saving. Data is collected in a large buffer and written
+// with few, big writes into a temporary file next to the destination; only
+// stream_commit renames the temporary file over the destination, so a failed
+// or interrupted save never leaves a truncated image behind. Closing a stream
+// that was not committed deletes the temporary file.
+//
+// A destination that is a symbolic link is resolved first, so the link is
+// kept and the file it points to is replaced. Hard-linked files and links
+// that do not resolve, which a rename would break, are written in place
+// instead, as are files in directories where no temporary file can be
+// created. In-place writes keep the existing file until the buffer is
+// first flushed and truncate it to the new size on commit.
+//
+// If a size hint is given, the temporary file is preallocated on Linux
+// (disable with GIMP_JXR_PREALLOCATE=0) and trimmed to its final size on
+// commit. GIMP_JXR_FSYNC=1 flushes the data to disk before the rename. The
+// buffer size is set with GIMP_JXR_STREAM_BUFFER (4M by default).
+//
+// stream_create_temp returns a stream of the same kind whose file is deleted
+// right away, as scratch space for the encoder (planar alpha).
+//
+// stream_create_growing returns an input stream for files that are still
+// being written and for pipes and FIFOs ("-" is standard input). The data is
+// read sequentially into memory as the decoder asks for it, so the decoder
+// can seek back within what has arrived. Reads past the available data wait
+// for more; the stream ends when a pipe is closed or when a file has not
+// grown for GIMP_JXR_INCREMENTAL_TIMEOUT seconds (30 by default).
+//
+// On other platforms the output stream is a plain jxrlib file stream and no
+// temporary or growing streams are available.
+
+#ifdef G_OS_UNIX
+
+#define DEFAULT_BUFFER_SIZE (4 << 20)
+
+// Growing streams read in chunks of this size and check for new data of a
+// file at this interval, in microseconds
+#define GROWING_READ_SIZE (64 * 1024)
+#define GROWING_POLL_INTERVAL 20000
+#define DEFAULT_INCREMENTAL_TIMEOUT 30
+
+typedef struct
+{
+    gint        fd;
+    gchar*      temp_path;
+    gchar*      path;
+    guchar*     buffer;
+    gsize       capacity;
+    guint64     buffer_start;   // file offset of buffer[0]
+    gsize       buffer_length;
+    guint64     pos;
+    guint64     size;
+    gboolean    preallocated;
+    gboolean    in_place;       // writes go to path itself
+    gboolean    created;        // path did not exist before an in-place write
+    gboolean    committed;
+} AtomicStream;
+
+typedef struct
+{
+    gint        fd;
+    gboolean    pipe;
+    GByteArray* data;       // everything read so far
+    guint64     pos;
+    gboolean    ended;
+    gint64      timeout;
+} GrowingStream;
+
+static ERR create_stream(struct WMPStream** stream, const gchar* filename, guint64 size_hint, gboolean allow_in_place);
+static gboolean resolve_path(const gchar* filename, gchar** path);
+static ERR atomic_close(struct WMPStream** pme);
+static Bool atomic_eos(struct WMPStream* me);
+static ERR atomic_read(struct WMPStream* me, void* pv, size_t cb);
+static ERR atomic_write(struct WMPStream* me, const void* pv, size_t cb);
+static ERR atomic_set_pos(struct WMPStream* me, size_t offPos);
+static ERR atomic_get_pos(struct WMPStream* me, size_t* poffPos);
+static ERR flush_buffer(AtomicStream* s);
+static ERR write_at(gint fd, const guchar* data, gsize size, guint64 offset);
+static void set_file_mode(gint fd, const gchar* path);
+static void growing_fill(GrowingStream* s, guint64 size);
+static ERR growing_close(struct WMPStream** pme);
+static Bool growing_eos(struct WMPStream* me);
+static ERR growing_read(struct WMPStream* me, void* pv, size_t cb);
+static ERR growing_write(struct WMPStream* me, const void* pv, size_t cb);
+static ERR growing_set_pos(struct WMPStream* me, size_t offPos);
+static ERR growing_get_pos(struct WMPStream* me, size_t* poffPos);
+
+ERR stream_create_atomic(struct WMPStream** stream, const gchar* filename, guint64 size_hint)
+{
+    return create_stream(stream, filename, size_hint, TRUE);
+}
+
+// Creates a read/write stream backed by an unlinked file in the directory of
+// filename.
+ERR stream_create_temp(struct WMPStream** stream, const gchar* filename)
+{
+    ERR             err;
+    AtomicStream*   s;
+
+    Call(create_stream(stream, filename, 0, FALSE));
+
+    s = (AtomicStream*)(*stream)->state.pvObj;
+
+    g_unlink(s->temp_path);
+    g_free(s->temp_path);
+    s->temp_path = NULL;
+
+Cleanup:
+    return err;
+}
+
+// Scratch streams (allow_in_place FALSE) fail instead of writing in place.
+static ERR create_stream(struct WMPStream** stream, const gchar* filename, guint64 size_hint, gboolean allow_in_place)
+{
+    ERR             err = WMP_errSuccess;
+    AtomicStream*   s;
+    GStatBuf        st;
+    gboolean        resolved;
+    gboolean        exists;
+    gchar*          dir;
+    gchar*          base;
+    gchar*          name;
+
+    *stream = NULL;
+
+    s = g_new0(AtomicStream, 1);
+    s->fd = -1;
+    s->capacity = (gsize)get_env_size("GIMP_JXR_STREAM_BUFFER", DEFAULT_BUFFER_SIZE);
+    s->capacity = MAX(s->capacity, 64 * 1024);
+
+    resolved = resolve_path(filename, &s->path);
+    s->in_place = !resolved && allow_in_place;
+
+    exists = g_stat(s->path, &st) == 0;
+
+    // renaming over a file with other hard links would detach it from them
+    if (exists && S_ISREG(st.st_mode) && st.st_nlink > 1 && allow_in_place)
+        s->in_place = TRUE;
+
+    if (!s->in_place)
+    {
+        dir = g_path_get_dirname(s->path);
+        base = g_path_get_basename(s->path);
+        name = g_strdup_printf(".%s.XXXXXX", base);
+        s->temp_path = g_build_filename(dir, name, NULL);
+        g_free(dir);
+        g_free(base);
+        g_free(name);
+
+        s->fd = g_mkstemp(s->temp_path);
+
+        if (s->fd < 0)
+        {
+            g_free(s->temp_path);
+            s->temp_path = NULL;
+            s->in_place = allow_in_place;
+        }
+    }
+
+    if (s->in_place)
+    {
+        s->fd = g_open(s->path, O_RDWR | O_CREAT, 0666);
+        // unlinking a dangling link on failure would remove the link
+        s->created = !exists && resolved;
+    }
+
+    FailIf(s->fd < 0, WMP_errFileIO);
+
+    Call(buffer_alloc(&s->buffer, s->capacity));
+
+#ifdef __linux__
+    if (size_hint > 0 && get_env_size("GIMP_JXR_PREALLOCATE", 1) != 0)
+        s->preallocated = fallocate(s->fd, 0, 0, (off_t)size_hint) == 0;
+#endif
+
+    *stream = g_new0(struct WMPStream, 1);
+    (*stream)->state.pvObj = s;
+    (*stream)->fMem = FALSE;
+    (*stream)->Close = atomic_close;
+    (*stream)->EOS = atomic_eos;
+    (*stream)->Read = atomic_read;
+    (*stream)->Write = atomic_write;
+    (*stream)->SetPos = atomic_set_pos;
+    (*stream)->GetPos = atomic_get_pos;
+
+Cleanup:
+    if (Failed(err))
+    {
+        if (s->fd >= 0)
+        {
+            close(s->fd);
+
+            if (s->temp_path != NULL)
+                g_unlink(s->temp_path);
+            else if (s->created)
+                g_unlink(s->path);
+        }
+
+        buffer_free(&s->buffer);
+        g_free(s->temp_path);
+        g_free(s->path);
+        g_free(s);
+    }
+
+    return err;
+}
+
+// Writes out all buffered data and moves the temporary file to the
+// destination, or trims the destination when writing in place. Must be called
+// after the encoder has finished writing and before it is released.
+ERR stream_commit(struct WMPStream* stream)
+{
+    ERR             err;
+    AtomicStream*   s = (AtomicStream*)stream->state.pvObj;
+
+    Call(flush_buffer(s));
+
+    // a file written in place may have been longer before
+    if (s->preallocated || s->in_place)
+        FailIf(ftruncate(s->fd, (off_t)s->size) != 0, WMP_errFileIO);
+
+    if (get_env_size("GIMP_JXR_FSYNC", 0) != 0)
+    {
+#ifdef __linux__
+        FailIf(fdatasync(s->fd) != 0, WMP_errFileIO);
+#else
+        FailIf(fsync(s->fd) != 0, WMP_errFileIO);
+#endif
+    }
+
+    if (!s->in_place)
+    {
+        set_file_mode(s->fd, s->path);
+
+        FailIf(g_rename(s->temp_path, s->path) != 0, WMP_errFileIO);
+    }
+
+    s->committed = TRUE;
+
+Cleanup:
+    return err;
+}
+
+static ERR atomic_close(struct WMPStream** pme)
+{
+    AtomicStream* s = (AtomicStream*)(*pme)->state.pvObj;
+
+    close(s->fd);
+
+    if (!s->committed && s->temp_path != NULL)
+        g_unlink(s->temp_path);
+    else if (!s->committed && s->created)
+        g_unlink(s->path);
+
+    buffer_free(&s->buffer);
+    g_free(s->temp_path);
+    g_free(s->path);
+    g_free(s);
+    g_free(*pme);
+
+    *pme = NULL;
+
+    return WMP_errSuccess;
+}
+
+static Bool atomic_eos(struct WMPStream* me)
+{
+    AtomicStream* s = (AtomicStream*)me->state.pvObj;
+
+    return s->pos >= s->size;
+}
+
+static ERR atomic_read(struct WMPStream* me, void* pv, size_t cb)
+{
+    ERR             err;
+    AtomicStream*   s = (AtomicStream*)me->state.pvObj;
+    guchar*         data = (guchar*)pv;
+    gssize          n;
+
+    Call(flush_buffer(s));
+
+    while (cb > 0)
+    {
+        n = pread(s->fd, data, cb, (off_t)s->pos);
+
+        FailIf(n <= 0, WMP_errFileIO);
+
+        data += n;
+        cb -= n;
+        s->pos += n;
+    }
+
+Cleanup:
+    return err;
+}
+
+static ERR atomic_write(struct WMPStream* me, const void* pv, size_t cb)
+{
+    ERR             err = WMP_errSuccess;
+    AtomicStream*   s = (AtomicStream*)me->state.pvObj;
+    const guchar*   data = (const guchar*)pv;
+    gsize           offset;
+    gsize           n;
+
+    // jxrlib seeks back to patch offsets; start a new buffer if the write
+    // does not continue or overwrite the buffered range
+    if (s->pos < s->buffer_start || s->pos > s->buffer_start + s->buffer_length)
+        Call(flush_buffer(s));
+
+    if (s->buffer_length == 0)
+        s->buffer_start = s->pos;
+
+    if (s->buffer_length == 0 && cb >= s->capacity)
+    {
+        Call(write_at(s->fd, data, cb, s->pos));
+        s->pos += cb;
+        cb = 0;
+    }
+
+    while (cb > 0)
+    {
+        offset = (gsize)(s->pos - s->buffer_start);
+        n = MIN(cb, s->capacity - offset);
+
+        if (n == 0)
+        {
+            Call(flush_buffer(s));
+            s->buffer_start = s->pos;
+            continue;
+        }
+
+        memcpy(s->buffer + offset, data, n);
+
+        s->buffer_length = MAX(s->buffer_length, offset + n);
+        s->pos += n;
+        data += n;
+        cb -= n;
+    }
+
+Cleanup:
+    s->size = MAX(s->size, s->pos);
+
+    return err;
+}
+
+static ERR atomic_set_pos(struct WMPStream* me, size_t offPos)
+{
+    AtomicStream* s = (AtomicStream*)me->state.pvObj;
+
+    s->pos = offPos;
+
+    return WMP_errSuccess;
+}
+
+static ERR atomic_get_pos(struct WMPStream* me, size_t* poffPos)
+{
+    AtomicStream* s = (AtomicStream*)me->state.pvObj;
+
+    *poffPos = (size_t)s->pos;
+
+    return WMP_errSuccess;
+}
+
+static ERR flush_buffer(AtomicStream* s)
+{
+    ERR err = WMP_errSuccess;
+
+    if (s->buffer_length > 0)
+    {
+        Call(write_at(s->fd, s->buffer, s->buffer_length, s->buffer_start));
+        s->buffer_length = 0;
+    }
+
+Cleanup:
+    return err;
+}
+
+static ERR write_at(gint fd, const guchar* data, gsize size, guint64 offset)
+{
+    ERR     err = WMP_errSuccess;
+    gssize  n;
+
+    while (size > 0)
+    {
+        n = pwrite(fd, data, size, (off_t)offset);
+
+        FailIf(n <= 0, WMP_errFileIO);
+
+        data += n;
+        size -= n;
+        offset += n;
+    }
+
+Cleanup:
+    return err;
+}
+
+// Returns the file that a symbolic link points to in path, or filename itself
+// if it is not a link. Fails with filename in path if the link does not
+// resolve, because its target does not exist or cannot be reached.
+static gboolean resolve_path(const gchar* filename, gchar** path)
+{
+    gchar* resolved;
+
+    if (!g_file_test(filename, G_FILE_TEST_IS_SYMLINK))
+    {
+        *path = g_strdup(filename);
+        return TRUE;
+    }
+
+    resolved = realpath(filename, NULL);
+
+    if (resolved == NULL)
+    {
+        *path = g_strdup(filename);
+        return FALSE;
+    }
+
+    *path = g_strdup(resolved);
+    free(resolved);
+
+    return TRUE;
+}
+
+// mkstemp creates files readable only by the owner; give the result the mode
+// of the file it replaces, or the default mode for new files.
+static void set_file_mode(gint fd, const gchar* path)
+{
+    GStatBuf    st;
+    mode_t      mask;
+
+    if (g_stat(path, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    else
+    {
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+}
+
+ERR stream_create_growing(struct WMPStream** stream, const gchar* filename)
+{
+    ERR             err = WMP_errSuccess;
+    GrowingStream*  s;
+    GStatBuf        st;
+    gint            fd;
+
+    *stream = NULL;
+
+    fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO) : g_open(filename, O_RDONLY, 0);
+
+    FailIf(fd < 0, WMP_errFileIO);
+
+    s = g_new0(GrowingStream, 1);
+    s->fd = fd;
+    s->pipe = fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+    s->data = g_byte_array_new();
+    s->timeout = (gint64)get_env_size("GIMP_JXR_INCREMENTAL_TIMEOUT", DEFAULT_INCREMENTAL_TIMEOUT) * G_TIME_SPAN_SECOND;
+
+    *stream = g_new0(struct WMPStream, 1);
+    (*stream)->state.pvObj = s;
+    (*stream)->fMem = FALSE;
+    (*stream)->Close = growing_close;
+    (*stream)->EOS = growing_eos;
+    (*stream)->Read = growing_read;
+    (*stream)->Write = growing_write;
+    (*stream)->SetPos = growing_set_pos;
+    (*stream)->GetPos = growing_get_pos;
+
+Cleanup:
+    return err;
+}
+
+// Reads until size bytes are available or the stream has ended.
+static void growing_fill(GrowingStream* s, guint64 size)
+{
+    guchar  chunk[GROWING_READ_SIZE];
+    gint64  last_data = g_get_monotonic_time();
+    gssize  n;
+
+    while (s->data->len < size && !s->ended)
+    {
+        n = read(s->fd, chunk, sizeof(chunk));
+
+        if (n > 0)
+        {
+            g_byte_array_append(s->data, chunk, (guint)n);
+            last_data = g_get_monotonic_time();
+        }
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 || s->pipe || g_get_monotonic_time() - last_data > s->timeout)
+            s->ended = TRUE;
+        else
+            g_usleep(GROWING_POLL_INTERVAL);
+    }
+}
+
+static ERR growing_close(struct WMPStream** pme)
+{
+    GrowingStream* s = (GrowingStream*)(*pme)->state.pvObj;
+
+    close(s->fd);
+
+    g_byte_array_free(s->data, TRUE);
+    g_free(s);
+    g_free(*pme);
+
+    *pme = NULL;
+
+    return WMP_errSuccess;
+}
+
+static Bool growing_eos(struct WMPStream* me)
+{
+    GrowingStream* s = (GrowingStream*)me->state.pvObj;
+
+    growing_fill(s, s->pos + 1);
+
+    return s->pos >= s->data->len;
+}
+
+static ERR growing_read(struct WMPStream* me, void* pv, size_t cb)
+{
+    ERR             err = WMP_errSuccess;
+    GrowingStream*  s = (GrowingStream*)me->state.pvObj;
+
+    growing_fill(s, s->pos + cb);
+
+    FailIf(s->pos + cb > s->data->len, WMP_errFileIO);
+
+    memcpy(pv, s->data->data + s->pos, cb);
+    s->pos += cb;
+
+Cleanup:
+    return err;
+}
+
+static ERR growing_write(struct WMPStream* me, const void* pv, size_t cb)
+{
+    return WMP_errFileIO;
+}
+
+static ERR growing_set_pos(struct WMPStream* me, size_t offPos)
+{
+    GrowingStream* s = (GrowingStream*)me->state.pvObj;
+
+    s->pos = offPos;
+
+    return WMP_errSuccess;
+}
+
+static ERR growing_get_pos(struct WMPStream* me, size_t* poffPos)
+{
+    GrowingStream* s = (GrowingStream*)me->state.pvObj;
+
+    *poffPos = (size_t)s->pos;
+
+    return WMP_errSuccess;
+}
+
+#else
+
+ERR stream_create_atomic(struct WMPStream** stream, const gchar* filename, guint64 size_hint)
+{
+    ERR         err;
+    PKFactory*  factory;
+
+    Call(get_factories(&factory, NULL));
+    Call(factory->CreateStreamFromFilename(stream, filename, "wb"));
+
+Cleanup:
+    return err;
+}
+
+ERR stream_create_temp(struct WMPStream** stream, const gchar* filename)
+{
+    return WMP_errNotYetImplemented;
+}
+
+ERR stream_commit(struct WMPStream* stream)
+{
+    return WMP_errSuccess;
+}
+
+ERR stream_create_growing(struct WMPStream** stream, const gchar* filename)
+{
+    return WMP_errNotYetImplemented;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "file-jxr.h"
+#include <JXRGlue.h>
+
+ERR stream_create_atomic(struct WMPStream** stream, const gchar* filename, guint64 size_hint);
+ERR stream_create_temp(struct WMPStream** stream, const gchar* filename);
+ERR stream_commit(struct WMPStream* stream);
+ERR stream_create_growing(struct WMPStream** stream, const gchar* filename);
+
+#endif
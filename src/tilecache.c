@@ -0,0 +1,315 @@
+#include "tilecache.h"
+#include "utils.h"
+#include <glib/gstdio.h>
+
+// Decoded tiles of region loads are kept on disk below GIMP_JXR_TILE_CACHE,
+// one directory per source file. The directory name is a hash of the file's
+// path, size, modification time and its first and last 64 KiB, so that a
+// changed file never hits stale tiles. Each tile is a small header followed
+// by the packed 8-bit pixels and is read through a memory mapping. Tiles are
+// written atomically (temporary file and rename), so concurrent plug-in
+// processes can share the cache. Reading a tile refreshes its modification
+// time; once the cache outgrows GIMP_JXR_TILE_CACHE_SIZE (1G by default) the
+// least recently used tiles are deleted.
+
+#define HASHED_BYTES    (64 * 1024)
+#define TILE_MAGIC      "JXRT"
+
+struct TileCache
+{
+    gchar*      root;
+    gchar*      dir;
+    guint64     written;
+};
+
+typedef struct
+{
+    gchar       magic[4];
+    guint32     width;
+    guint32     height;
+    guint32     bytes_per_pixel;
+} TileHeader;
+
+typedef struct
+{
+    gchar*      path;
+    guint64     size;
+    gint64      mtime;
+} CacheEntry;
+
+static gchar* get_file_key(const gchar* filename);
+static gchar* get_tile_path(TileCache* cache, const TileInfo* tile);
+static void evict(TileCache* cache);
+static gint compare_entries(gconstpointer a, gconstpointer b);
+
+TileCache* tile_cache_open(const gchar* filename)
+{
+    const gchar*    root = g_getenv("GIMP_JXR_TILE_CACHE");
+    TileCache*      cache;
+    gchar*          key;
+
+    if (root == NULL || *root == '\0')
+        return NULL;
+
+    key = get_file_key(filename);
+
+    if (key == NULL)
+        return NULL;
+
+    cache = g_new0(TileCache, 1);
+    cache->root = g_strdup(root);
+    cache->dir = g_build_filename(root, key, NULL);
+
+    g_free(key);
+
+    return cache;
+}
+
+// Copies the width x height rectangle at x, y of a cached tile to pixels.
+// Returns FALSE if the tile is not cached or the entry does not match.
+gboolean tile_cache_read(TileCache* cache, const TileInfo* tile, guint x, guint y, guint width, guint height, guchar* pixels, gsize stride)
+{
+    gchar*              path;
+    GMappedFile*        mapping;
+    const TileHeader*   header;
+    const guchar*       src;
+    gsize               tile_stride;
+    gboolean            valid;
+    guint               i;
+
+    if (cache == NULL)
+        return FALSE;
+
+    path = get_tile_path(cache, tile);
+    mapping = g_mapped_file_new(path, FALSE, NULL);
+
+    if (mapping == NULL)
+    {
+        g_free(path);
+        return FALSE;
+    }
+
+    header = (const TileHeader*)g_mapped_file_get_contents(mapping);
+    tile_stride = (gsize)tile->width * tile->bytes_per_pixel;
+
+    valid = g_mapped_file_get_length(mapping) == sizeof(TileHeader) + tile_stride * tile->height &&
+        memcmp(header->magic, TILE_MAGIC, 4) == 0 &&
+        header->width == tile->width &&
+        header->height == tile->height &&
+        header->bytes_per_pixel == tile->bytes_per_pixel;
+
+    if (valid)
+    {
+        src = (const guchar*)(header + 1) + y * tile_stride + (gsize)x * tile->bytes_per_pixel;
+
+        for (i = 0; i < height; i++)
+            memcpy(pixels + i * stride, src + i * tile_stride, (gsize)width * tile->bytes_per_pixel);
+
+        g_utime(path, NULL);
+    }
+
+    g_mapped_file_unref(mapping);
+    g_free(path);
+
+    return valid;
+}
+
+void tile_cache_write(TileCache* cache, const TileInfo* tile, const guchar* pixels, gsize stride)
+{
+    gchar*          path;
+    gchar*          contents;
+    TileHeader*     header;
+    gsize           tile_stride;
+    gsize           length;
+    guint           i;
+
+    if (cache == NULL)
+        return;
+
+    if (g_mkdir_with_parents(cache->dir, 0700) != 0)
+        return;
+
+    tile_stride = (gsize)tile->width * tile->bytes_per_pixel;
+    length = sizeof(TileHeader) + tile_stride * tile->height;
+    contents = g_malloc(length);
+
+    header = (TileHeader*)contents;
+    memcpy(header->magic, TILE_MAGIC, 4);
+    header->width = tile->width;
+    header->height = tile->height;
+    header->bytes_per_pixel = tile->bytes_per_pixel;
+
+    for (i = 0; i < tile->height; i++)
+        memcpy(contents + sizeof(TileHeader) + i * tile_stride, pixels + i * stride, tile_stride);
+
+    path = get_tile_path(cache, tile);
+
+    if (g_file_set_contents(path, contents, length, NULL))
+        cache->written += length;
+
+    g_free(path);
+    g_free(contents);
+}
+
+void tile_cache_close(TileCache* cache)
+{
+    if (cache == NULL)
+        return;
+
+    if (cache->written > 0)
+        evict(cache);
+
+    g_free(cache->root);
+    g_free(cache->dir);
+    g_free(cache);
+}
+
+static gchar* get_file_key(const gchar* filename)
+{
+    GStatBuf    st;
+    FILE*       file;
+    GChecksum*  checksum;
+    guchar*     data;
+    gsize       read;
+    gchar*      path;
+    gchar*      identity;
+    gchar*      key;
+
+    if (g_stat(filename, &st) != 0)
+        return NULL;
+
+    file = g_fopen(filename, "rb");
+
+    if (file == NULL)
+        return NULL;
+
+    if (g_path_is_absolute(filename))
+        path = g_strdup(filename);
+    else
+    {
+        gchar* cwd = g_get_current_dir();
+        path = g_build_filename(cwd, filename, NULL);
+        g_free(cwd);
+    }
+
+    identity = g_strdup_printf("%s\n%" G_GUINT64_FORMAT "\n%" G_GINT64_FORMAT "\n", path, (guint64)st.st_size, (gint64)st.st_mtime);
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, (const guchar*)identity, -1);
+
+    data = g_malloc(HASHED_BYTES);
+
+    read = fread(data, 1, HASHED_BYTES, file);
+    g_checksum_update(checksum, data, read);
+
+    if ((guint64)st.st_size > 2 * HASHED_BYTES && fseek(file, -HASHED_BYTES, SEEK_END) == 0)
+    {
+        read = fread(data, 1, HASHED_BYTES, file);
+        g_checksum_update(checksum, data, read);
+    }
+
+    key = g_strdup(g_checksum_get_string(checksum));
+
+    g_free(data);
+    g_checksum_free(checksum);
+    g_free(identity);
+    g_free(path);
+    fclose(file);
+
+    return key;
+}
+
+static gchar* get_tile_path(TileCache* cache, const TileInfo* tile)
+{
+    gchar* name = g_strdup_printf("%u-%u-%u.tile", tile->scale, tile->column, tile->row);
+    gchar* path = g_build_filename(cache->dir, name, NULL);
+
+    g_free(name);
+
+    return path;
+}
+
+// Deletes the least recently used tiles of all cached files until the cache
+// is back below 90% of its size cap.
+static void evict(TileCache* cache)
+{
+    guint64         cap = get_env_size("GIMP_JXR_TILE_CACHE_SIZE", G_GUINT64_CONSTANT(1) << 30);
+    guint64         total = 0;
+    GArray*         entries;
+    GDir*           root_dir;
+    const gchar*    dir_name;
+    guint           i;
+
+    root_dir = g_dir_open(cache->root, 0, NULL);
+
+    if (root_dir == NULL)
+        return;
+
+    entries = g_array_new(FALSE, FALSE, sizeof(CacheEntry));
+
+    while ((dir_name = g_dir_read_name(root_dir)) != NULL)
+    {
+        gchar*          dir_path = g_build_filename(cache->root, dir_name, NULL);
+        GDir*           dir = g_dir_open(dir_path, 0, NULL);
+        const gchar*    name;
+
+        if (dir != NULL)
+        {
+            while ((name = g_dir_read_name(dir)) != NULL)
+            {
+                CacheEntry  entry;
+                GStatBuf    st;
+
+                entry.path = g_build_filename(dir_path, name, NULL);
+
+                if (g_str_has_suffix(name, ".tile") && g_stat(entry.path, &st) == 0)
+                {
+                    entry.size = st.st_size;
+                    entry.mtime = st.st_mtime;
+                    total += entry.size;
+                    g_array_append_val(entries, entry);
+                }
+                else
+                    g_free(entry.path);
+            }
+
+            g_dir_close(dir);
+        }
+
+        g_free(dir_path);
+    }
+
+    g_dir_close(root_dir);
+
+    if (total > cap)
+    {
+        g_array_sort(entries, compare_entries);
+
+        for (i = 0; i < entries->len && total > cap / 10 * 9; i++)
+        {
+            CacheEntry* entry = &g_array_index(entries, CacheEntry, i);
+            gchar*      dir_path;
+
+            if (g_unlink(entry->path) == 0)
+                total -= entry->size;
+
+            // drop the directory of a source file once its last tile is gone
+            dir_path = g_path_get_dirname(entry->path);
+            g_rmdir(dir_path);
+            g_free(dir_path);
+        }
+    }
+
+    for (i = 0; i < entries->len; i++)
+        g_free(g_array_index(entries, CacheEntry, i).path);
+
+    g_array_free(entries, TRUE);
+}
+
+static gint compare_entries(gconstpointer a, gconstpointer b)
+{
+    gint64 mtime_a = ((const CacheEntry*)a)->mtime;
+    gint64 mtime_b = ((const CacheEntry*)b)->mtime;
+
+    return mtime_a < mtime_b ? -1 : mtime_a > mtime_b ? 1 : 0;
+}
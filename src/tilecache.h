@@ -0,0 +1,26 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include "file-jxr.h"
+
+// Edge length of cached tiles, in pixels of the scaled image
+#define TILE_CACHE_TILE_SIZE 256
+
+typedef struct TileCache TileCache;
+
+typedef struct
+{
+    guint   scale;
+    guint   column;
+    guint   row;
+    guint   width;
+    guint   height;
+    guint   bytes_per_pixel;
+} TileInfo;
+
+TileCache* tile_cache_open(const gchar* filename);
+gboolean tile_cache_read(TileCache* cache, const TileInfo* tile, guint x, guint y, guint width, guint height, guchar* pixels, gsize stride);
+void tile_cache_write(TileCache* cache, const TileInfo* tile, const guchar* pixels, gsize stride);
+void tile_cache_close(TileCache* cache);
+
+#endif
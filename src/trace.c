@@ -0,0 +1,150 @@
+#include "trace.h"
+#include <glib/gstdio.h>
+
+#ifdef G_OS_WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+    const gchar*    name;
+    gchar           phase;
+    gint            thread_id;
+    gint64          start;
+    gint64          duration;
+    guint64         value;
+} TraceEvent;
+
+gboolean trace_active = FALSE;
+
+static gchar*       trace_filename = NULL;
+static gboolean     trace_started = FALSE;  // the file has been created
+static gint         trace_pid;
+static GArray*      trace_events = NULL;
+static GMutex       trace_mutex;
+static gint         trace_next_thread_id = 0;
+static GPrivate     trace_thread_id = G_PRIVATE_INIT(NULL);
+
+static gint get_thread_id();
+static void add_event(const TraceEvent* event);
+
+// Every plug-in process writes a file of its own, with its process id added
+// to the name (trace.json becomes trace-<pid>.json), so that the separate
+// processes of a batch do not overwrite each other's traces.
+void trace_init()
+{
+    const gchar*    path;
+    const gchar*    dot;
+
+    if (trace_events != NULL)
+        return;
+
+    path = g_getenv("GIMP_JXR_TRACE");
+
+    if (path == NULL || *path == '\0')
+        return;
+
+    trace_pid = getpid();
+    dot = strrchr(path, '.');
+
+    if (dot != NULL && strpbrk(dot, "/\\") == NULL)
+        trace_filename = g_strdup_printf("%.*s-%d%s", (gint)(dot - path), path, trace_pid, dot);
+    else
+        trace_filename = g_strdup_printf("%s-%d", path, trace_pid);
+
+    trace_events = g_array_new(FALSE, FALSE, sizeof(TraceEvent));
+    trace_active = TRUE;
+}
+
+void trace_span(const gchar* name, gint64 start)
+{
+    TraceEvent event;
+
+    event.name      = name;
+    event.phase     = 'X';
+    event.thread_id = get_thread_id();
+    event.start     = start;
+    event.duration  = g_get_monotonic_time() - start;
+    event.value     = 0;
+
+    add_event(&event);
+}
+
+void trace_counter(const gchar* name, guint64 value)
+{
+    TraceEvent event;
+
+    event.name      = name;
+    event.phase     = 'C';
+    event.thread_id = get_thread_id();
+    event.start     = g_get_monotonic_time();
+    event.duration  = 0;
+    event.value     = value;
+
+    add_event(&event);
+}
+
+// Appends the events recorded since the last flush and forgets them, so that
+// a resident process only writes each event once. The file is in the JSON
+// array format without the closing bracket, which the viewers accept and
+// which later flushes can append to.
+void trace_flush()
+{
+    FILE*   file;
+    guint   i;
+
+    if (!trace_active)
+        return;
+
+    g_mutex_lock(&trace_mutex);
+
+    file = g_fopen(trace_filename, trace_started ? "a" : "w");
+
+    if (file != NULL)
+    {
+        if (!trace_started)
+            fputs("[\n", file);
+
+        for (i = 0; i < trace_events->len; i++)
+        {
+            TraceEvent* event = &g_array_index(trace_events, TraceEvent, i);
+
+            if (event->phase == 'X')
+                fprintf(file, "{\"name\":\"%s\",\"cat\":\"jxr\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT "},\n",
+                    event->name, trace_pid, event->thread_id, event->start, event->duration);
+            else
+                fprintf(file, "{\"name\":\"%s\",\"cat\":\"jxr\",\"ph\":\"C\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT ",\"args\":{\"bytes\":%" G_GUINT64_FORMAT "}},\n",
+                    event->name, trace_pid, event->thread_id, event->start, event->value);
+        }
+
+        fclose(file);
+        trace_started = TRUE;
+    }
+
+    g_array_set_size(trace_events, 0);
+
+    g_mutex_unlock(&trace_mutex);
+}
+
+static gint get_thread_id()
+{
+    gint id = GPOINTER_TO_INT(g_private_get(&trace_thread_id));
+
+    if (id == 0)
+    {
+        id = g_atomic_int_add(&trace_next_thread_id, 1) + 1;
+        g_private_set(&trace_thread_id, GINT_TO_POINTER(id));
+    }
+
+    return id;
+}
+
+static void add_event(const TraceEvent* event)
+{
+    g_mutex_lock(&trace_mutex);
+    g_array_append_vals(trace_events, event, 1);
+    g_mutex_unlock(&trace_mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "file-jxr.h"
+
+// Tracing is enabled by pointing GIMP_JXR_TRACE at a file; each process writes
+// its events to that name with its process id added, in Chrome trace-event
+// format (chrome://tracing, Perfetto).
+extern gboolean trace_active;
+
+void trace_init();
+void trace_flush();
+void trace_span(const gchar* name, gint64 start);
+void trace_counter(const gchar* name, guint64 value);
+
+// Both macros compile down to a single flag test when tracing is disabled.
+#define trace_begin()               (trace_active ? g_get_monotonic_time() : 0)
+#define trace_end(name, start)      do { if (trace_active) trace_span(name, start); } while (0)
+#define trace_count(name, value)    do { if (trace_active) trace_counter(name, value); } while (0)
+
+#endif
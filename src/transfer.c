@@ -0,0 +1,69 @@
+#include "transfer.h"
+#include "trace.h"
+
+// Pixels are moved between the plug-in's buffers and GIMP drawables by
+// iterating over pixel regions, which hands out GIMP's tiles one at a time;
+// each tile crosses the pipe to the core once and is copied straight to or
+// from its place in the buffer. gimp_pixel_rgn_get_rect/set_rect go through
+// an intermediate copy and may fetch tiles at the edges of a rectangle again
+// for the next one.
+//
+// Callers transfer bands of TRANSFER_ROWS rows, so that bands start on tile
+// boundaries, and size libgimp's tile cache with transfer_set_cache.
+
+static guint64 transferred_tiles = 0;
+
+// Makes libgimp's tile cache hold the tiles of a band of the given size, so
+// that tiles straddling two bands (layers not aligned with the canvas) are
+// not fetched twice.
+void transfer_set_cache(guint width, guint rows)
+{
+    guint tile_width = gimp_tile_width();
+    guint tile_height = gimp_tile_height();
+
+    gimp_tile_cache_ntiles(((width + tile_width - 1) / tile_width + 1) * ((rows + tile_height - 1) / tile_height + 1));
+}
+
+void transfer_get_rect(GimpDrawable* drawable, guchar* pixels, gsize stride, gint x, gint y, guint width, guint height)
+{
+    GimpPixelRgn    pixel_rgn;
+    gpointer        iter;
+    guchar*         dst;
+    gint            i;
+
+    gimp_pixel_rgn_init(&pixel_rgn, drawable, x, y, width, height, FALSE, FALSE);
+
+    for (iter = gimp_pixel_rgns_register(1, &pixel_rgn); iter != NULL; iter = gimp_pixel_rgns_process(iter))
+    {
+        dst = pixels + (gsize)(pixel_rgn.y - y) * stride + (gsize)(pixel_rgn.x - x) * pixel_rgn.bpp;
+
+        for (i = 0; i < pixel_rgn.h; i++)
+            memcpy(dst + i * stride, pixel_rgn.data + (gsize)i * pixel_rgn.rowstride, (gsize)pixel_rgn.w * pixel_rgn.bpp);
+
+        transferred_tiles++;
+    }
+
+    trace_count("gimp-tiles", transferred_tiles);
+}
+
+void transfer_set_rect(GimpDrawable* drawable, const guchar* pixels, gsize stride, gint x, gint y, guint width, guint height)
+{
+    GimpPixelRgn    pixel_rgn;
+    gpointer        iter;
+    const guchar*   src;
+    gint            i;
+
+    gimp_pixel_rgn_init(&pixel_rgn, drawable, x, y, width, height, TRUE, FALSE);
+
+    for (iter = gimp_pixel_rgns_register(1, &pixel_rgn); iter != NULL; iter = gimp_pixel_rgns_process(iter))
+    {
+        src = pixels + (gsize)(pixel_rgn.y - y) * stride + (gsize)(pixel_rgn.x - x) * pixel_rgn.bpp;
+
+        for (i = 0; i < pixel_rgn.h; i++)
+            memcpy(pixel_rgn.data + (gsize)i * pixel_rgn.rowstride, src + i * stride, (gsize)pixel_rgn.w * pixel_rgn.bpp);
+
+        transferred_tiles++;
+    }
+
+    trace_count("gimp-tiles", transferred_tiles);
+}
@@ -0,0 +1,10 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "file-jxr.h"
+
+void transfer_set_cache(guint width, guint rows);
+void transfer_get_rect(GimpDrawable* drawable, guchar* pixels, gsize stride, gint x, gint y, guint width, guint height);
+void transfer_set_rect(GimpDrawable* drawable, const guchar* pixels, gsize stride, gint x, gint y, guint width, guint height);
+
+#endif
@@ -1,5 +1,11 @@
 #include "file-jxr.h"
 #include <JXRGlue.h>
+#include "utils.h"
+#include "pixelformats.h"
+
+static GMutex           factory_mutex;
+static PKFactory*       shared_factory = NULL;
+static PKCodecFactory*  shared_codec_factory = NULL;
 
 guint get_bits_per_pixel(const PKPixelFormatGUID* pixel_format)
 {    
@@ -12,48 +18,35 @@ guint get_bits_per_pixel(const PKPixelFormatGUID* pixel_format)
     return pixel_info.cbitUnit;
 }
 
-ERR convert_bw_indexed(const guchar* pixels, guint width, guint height, guchar** conv_pixels)
+void convert_bw_indexed(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride)
 {
-    ERR             err;
-    guint           stride;
     const guchar*   src;
     guchar*         dst;
     const guchar*   end;
     guint           n;
 
-    err = PKAllocAligned(conv_pixels, width * height, 128);
+    dst = conv_pixels;    
+    end = pixels + (gsize)height * stride; 
     
-    if (Failed(err))
-        return err;
-        
-    stride = (width + 7) / 8;
-
-    src = pixels;
-    dst = *conv_pixels;    
-    end = pixels + height * stride; 
-    
-    while (src < end)
+    for (src = pixels; src < end; src += stride)
     {
+        const guchar* line = src;
         const guchar* line_end = src + width / 8;
     
-        while (src < line_end)
+        while (line < line_end)
         {
             for (n = 0; n < 8; n++)
-                *(dst++) = (*src >> (7 - n)) & 0x01;
+                *(dst++) = (*line >> (7 - n)) & 0x01;
             
-            src++;
+            line++;
         }
         
         if (width % 8 != 0)
         {
             for (n = 0; n < width % 8; n++)
-                *(dst++) = (*src >> (7 - n)) & 0x01;
-
-            src++;
+                *(dst++) = (*line >> (7 - n)) & 0x01;
         }
     }
-
-    return err;
 }
 
 void convert_indexed_bw(guchar* pixels, guint width, guint height)
@@ -61,6 +54,7 @@ void convert_indexed_bw(guchar* pixels, guint width, guint height)
     guint y;
     guint x;
     guint n;
+    guchar bits;
     
     guchar* src = pixels;
     guchar* dst = pixels;
@@ -75,12 +69,14 @@ void convert_indexed_bw(guchar* pixels, guint width, guint height)
             dst++;
         }
         
+        // collected before the store: in the first rows of images narrower
+        // than 8 pixels dst still points at pixels not read yet
         if (width % 8 != 0)
         {
-            *dst = 0x00;
+            bits = 0x00;
             for (n = 0; n < width % 8; n++)
-                *dst |= *(src++) << (7 - n);
-            dst++;
+                bits |= *(src++) << (7 - n);
+            *(dst++) = bits;
         }
     }
 }
@@ -104,6 +100,251 @@ void convert_rgba_bgra(guchar* pixels, guint width, guint height)
         }
 }
 
+// Copies rows of width * bytes_per_pixel bytes from a buffer with the given
+// stride into a packed buffer. Both buffers may be the same.
+void compact_stride(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride, guint bytes_per_pixel)
+{
+    guint           y;
+    const guchar*   src;
+    guchar*         dst;
+    guint           new_stride = width * bytes_per_pixel;
+    
+    for (y = 0; y < height; y++)
+    {
+        src = pixels + (gsize)y * stride;
+        dst = conv_pixels + (gsize)y * new_stride;
+        g_memmove(dst, src, new_stride);
+    }
+}
+
+// Reduces an image by an integer factor, averaging scale x scale blocks. The
+// output is (width + scale - 1) / scale pixels wide and packed; blocks at the
+// right and bottom edges average the pixels they cover.
+void downsample_box(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride, guint bytes_per_pixel, guint scale)
+{
+    guint           x, y, c, i, j;
+    guint           block_width, block_height;
+    guint           sum;
+    const guchar*   src;
+    guchar*         dst = conv_pixels;
+
+    for (y = 0; y < height; y += scale)
+    {
+        block_height = MIN(scale, height - y);
+
+        for (x = 0; x < width; x += scale)
+        {
+            block_width = MIN(scale, width - x);
+
+            for (c = 0; c < bytes_per_pixel; c++)
+            {
+                sum = 0;
+
+                for (j = 0; j < block_height; j++)
+                {
+                    src = pixels + (gsize)(y + j) * stride + (gsize)x * bytes_per_pixel + c;
+
+                    for (i = 0; i < block_width; i++)
+                        sum += src[i * bytes_per_pixel];
+                }
+
+                *(dst++) = (guchar)((sum + block_width * block_height / 2) / (block_width * block_height));
+            }
+        }
+    }
+}
+
+// Scales pixels down to conv_width x conv_height by averaging the area each
+// output pixel covers. Weights are exact integers (the overlap of source and
+// output pixels on a grid of width * conv_width), so the result does not
+// depend on the platform. Rows are scaled horizontally into 32-bit sums and
+// accumulated vertically over whole rows, which keeps the inner loops simple
+// enough for the compiler to vectorize.
+void resample_area(const guchar* pixels, guint width, guint height, guint stride, guchar* conv_pixels, guint conv_width, guint conv_height, guint bytes_per_pixel)
+{
+    guint       span = (width + conv_width - 1) / conv_width + 1;
+    guint*      first = g_new(guint, conv_width);
+    guint32*    weights = g_new0(guint32, (gsize)conv_width * span);
+    guint32*    row = g_new(guint32, (gsize)conv_width * bytes_per_pixel);
+    guint64*    sums = g_new(guint64, (gsize)conv_width * bytes_per_pixel);
+    guint64     denominator = (guint64)width * height;
+    gsize       row_length = (gsize)conv_width * bytes_per_pixel;
+    guint       x, y, i, c;
+    gsize       k;
+
+    // output pixel x covers [x * width, (x + 1) * width), source pixel i
+    // covers [i * conv_width, (i + 1) * conv_width)
+    for (x = 0; x < conv_width; x++)
+    {
+        guint64 start = (guint64)x * width;
+        guint64 end = start + width;
+
+        first[x] = (guint)(start / conv_width);
+
+        for (i = 0; i < span && first[x] + i < width; i++)
+        {
+            guint64 pixel_start = (guint64)(first[x] + i) * conv_width;
+            guint64 pixel_end = pixel_start + conv_width;
+
+            if (pixel_start < end)
+                weights[(gsize)x * span + i] = (guint32)(MIN(end, pixel_end) - MAX(start, pixel_start));
+        }
+    }
+
+    for (y = 0; y < conv_height; y++)
+    {
+        guint64 start = (guint64)y * height;
+        guint64 end = start + height;
+        guint   source_y;
+
+        memset(sums, 0, row_length * sizeof(guint64));
+
+        for (source_y = (guint)(start / conv_height); source_y < height && (guint64)source_y * conv_height < end; source_y++)
+        {
+            guint64         pixel_start = (guint64)source_y * conv_height;
+            guint32         weight = (guint32)(MIN(end, pixel_start + conv_height) - MAX(start, pixel_start));
+            const guchar*   src = pixels + (gsize)source_y * stride;
+
+            for (x = 0; x < conv_width; x++)
+            {
+                const guint32*  w = weights + (gsize)x * span;
+                const guchar*   p = src + (gsize)first[x] * bytes_per_pixel;
+
+                for (c = 0; c < bytes_per_pixel; c++)
+                {
+                    guint32 sum = 0;
+
+                    for (i = 0; i < span && first[x] + i < width; i++)
+                        sum += w[i] * p[i * bytes_per_pixel + c];
+
+                    row[x * bytes_per_pixel + c] = sum;
+                }
+            }
+
+            for (k = 0; k < row_length; k++)
+                sums[k] += (guint64)weight * row[k];
+        }
+
+        for (k = 0; k < row_length; k++)
+            conv_pixels[(gsize)y * row_length + k] = (guchar)((sums[k] + denominator / 2) / denominator);
+    }
+
+    g_free(sums);
+    g_free(row);
+    g_free(weights);
+    g_free(first);
+}
+
+// The factories only hold function tables, so one instance of each is kept
+// for the lifetime of the process instead of being recreated for every call.
+ERR get_factories(PKFactory** factory, PKCodecFactory** codec_factory)
+{
+    ERR err = WMP_errSuccess;
+
+    g_mutex_lock(&factory_mutex);
+
+    if (shared_factory == NULL)
+        Call(PKCreateFactory(&shared_factory, PK_SDK_VERSION));
+
+    if (shared_codec_factory == NULL)
+        Call(PKCreateCodecFactory(&shared_codec_factory, WMP_SDK_VERSION));
+
+    if (factory != NULL)
+        *factory = shared_factory;
+
+    if (codec_factory != NULL)
+        *codec_factory = shared_codec_factory;
+
+Cleanup:
+    g_mutex_unlock(&factory_mutex);
+
+    return err;
+}
+
+void release_factories()
+{
+    g_mutex_lock(&factory_mutex);
+
+    if (shared_codec_factory != NULL)
+        shared_codec_factory->Release(&shared_codec_factory);
+
+    if (shared_factory != NULL)
+        shared_factory->Release(&shared_factory);
+
+    g_mutex_unlock(&factory_mutex);
+}
+
+// Reads a byte count from an environment variable. The value may carry a
+// K, M or G suffix; unset or malformed variables yield the default.
+guint64 get_env_size(const gchar* name, guint64 default_value)
+{
+    const gchar*    value = g_getenv(name);
+    gchar*          end;
+    guint64         size;
+
+    if (value == NULL || *value == '\0')
+        return default_value;
+
+    size = g_ascii_strtoull(value, &end, 10);
+
+    if (end == value)
+        return default_value;
+
+    switch (*end)
+    {
+    case 'G': case 'g':
+        size <<= 10;
+    case 'M': case 'm':
+        size <<= 10;
+    case 'K': case 'k':
+        size <<= 10;
+    }
+
+    return size;
+}
+
+void progress_init(Progress* progress)
+{
+    progress->start = 0.0;
+    progress->span = 1.0;
+    progress->step = -1;
+    progress->cancelled = FALSE;
+}
+
+void progress_set_stage(Progress* progress, gdouble start, gdouble span)
+{
+    if (progress == NULL)
+        return;
+
+    progress->start = start;
+    progress->span = span;
+}
+
+// Takes the fraction of the current stage that is done.
+gboolean progress_update(Progress* progress, gdouble fraction)
+{
+    gint step;
+
+    if (progress == NULL)
+        return TRUE;
+
+    if (progress->cancelled)
+        return FALSE;
+
+    step = (gint)((progress->start + fraction * progress->span) * PROGRESS_STEPS);
+
+    if (step > progress->step)
+    {
+        progress->step = step;
+
+        // the call fails once the user has cancelled the progress
+        if (!gimp_progress_update((gdouble)step / PROGRESS_STEPS))
+            progress->cancelled = TRUE;
+    }
+
+    return !progress->cancelled;
+}
+
 gboolean has_blackwhite_colormap(gint32 image_ID, gboolean* black_one)
 {
     guchar*     colormap;
@@ -133,172 +374,16 @@ gboolean has_blackwhite_colormap(gint32 image_ID, gboolean* black_one)
 
 gchar* get_pixel_format_mnemonic(const PKPixelFormatGUID* pixel_format)
 {
-    if (memcmp(pixel_format, "\x24\xC3\xDD\x6F\x03\x4E\xFE\x4B\xB1\x85\x3D\x77\x76\x8D\xC9", 15) != 0)
+    guint   i;
+
+    if (memcmp(pixel_format, PIXEL_FORMAT_GUID_PREFIX, 15) != 0)
         return NULL;
 
-    switch (pixel_format->Data4[7])
-    {
-        case 0x0D:
-            return "24bppRGB";
-        case 0x0C:
-            return "24bppBGR";
-        case 0x0E:
-            return "32bppBGR";
-        case 0x15:
-            return "48bppRGB";
-        case 0x12:
-            return "48bppRGBFixedPoint";
-        case 0x3B:
-            return "48bppRGBHalf";
-        case 0x18:
-            return "96bppRGBFixedPoint";
-        case 0x40:
-            return "64bppRGBFixedPoint";
-        case 0x42:
-            return "64bppRGBHalf";
-        case 0x41:
-            return "128bppRGBFixedPoint";
-        case 0x1B:
-            return "128bppRGBFloat";
-        case 0x0F:
-            return "32bppBGRA";
-        case 0x16:
-            return "64bppRGBA";
-        case 0x1D:
-            return "64bppRGBAFixedPoint";
-        case 0x3A:
-            return "64bppRGBAHalf";
-        case 0x1E:
-            return "128bppRGBAFixedPoint";
-        case 0x19:
-            return "128bppRGBAFloat";
-        case 0x10:
-            return "32bppPBGRA";
-        case 0x17:
-            return "64bppPRGBA";
-        case 0x1A:
-            return "128bppPRGBAFloat";
-        case 0x1C:
-            return "32bppCMYK";
-        case 0x2C:
-            return "40bppCMYKAlpha";
-        case 0x1F:
-            return "64bppCMYK";
-        case 0x2D:
-            return "80bppCMYKAlpha";
-        case 0x20:
-            return "24bpp3Channels";
-        case 0x21:
-            return "32bpp4Channels";
-        case 0x22:
-            return "40bpp5Channels";
-        case 0x23:
-            return "48bpp6Channels";
-        case 0x24:
-            return "56bpp7Channels";
-        case 0x25:
-            return "64bpp8Channels";
-        case 0x2E:
-            return "32bpp3ChannelsAlpha";
-        case 0x2F:
-            return "40bpp4ChannelsAlpha";
-        case 0x30:
-            return "48bpp5ChannelsAlpha";
-        case 0x31:
-            return "56bpp6ChannelsAlpha";
-        case 0x32:
-            return "64bpp7ChannelsAlpha";
-        case 0x33:
-            return "72bpp8ChannelsAlpha";
-        case 0x26:
-            return "48bpp3Channels";
-        case 0x27:
-            return "64bpp4Channels";
-        case 0x28:
-            return "80bpp5Channels";
-        case 0x29:
-            return "96bpp6Channels";
-        case 0x2A:
-            return "112bpp7Channels";
-        case 0x2B:
-            return "128bpp8Channels";
-        case 0x34:
-            return "64bpp3ChannelsAlpha";
-        case 0x35:
-            return "80bpp4ChannelsAlpha";
-        case 0x36:
-            return "96bpp5ChannelsAlpha";
-        case 0x37:
-            return "112bpp6ChannelsAlpha";
-        case 0x38:
-            return "128bpp7ChannelsAlpha";
-        case 0x39:
-            return "144bpp8ChannelsAlpha";
-        case 0x08:
-            return "8bppGray";
-        case 0x0B:
-            return "16bppGray";
-        case 0x13:
-            return "16bppGrayFixedPoint";
-        case 0x3E:
-            return "16bppGrayHalf";
-        case 0x3F:
-            return "32bppGrayFixedPoint";
-        case 0x11:
-            return "32bppGrayFloat";
-        case 0x05:
-            return "BlackWhite";
-        case 0x09:
-            return "16bppBGR555";
-        case 0x0A:
-            return "16bppBGR565";
-        case 0x14:
-            return "32bppBGR101010";
-        case 0x3D:
-            return "32bppRGBE";
-        case 0x54:
-            return "32bppCMYKDIRECT";
-        case 0x55:
-            return "64bppCMYKDIRECT";
-        case 0x56:
-            return "40bppCMYKDIRECTAlpha";
-        case 0x43:
-            return "80bppCMYKDIRECTAlpha";
-        case 0x44:
-            return "12bppYCC420";
-        case 0x45:
-            return "16bppYCC422";
-        case 0x46:
-            return "20bppYCC422";
-        case 0x47:
-            return "32bppYCC422";
-        case 0x48:
-            return "24bppYCC444";
-        case 0x49:
-            return "30bppYCC444";
-        case 0x4A:
-            return "48bppYCC444";
-        case 0x4B:
-            return "48bppYCC444FixedPoint";
-        case 0x4C:
-            return "20bppYCC420Alpha";
-        case 0x4D:
-            return "24bppYCC422Alpha";
-        case 0x4E:
-            return "30bppYCC422Alpha";
-        case 0x4F:
-            return "48bppYCC422Alpha";
-        case 0x50:
-            return "32bppYCC444Alpha";
-        case 0x51:
-            return "40bppYCC444Alpha";
-        case 0x52:
-            return "64bppYCC444Alpha";
-        case 0x53:
-            return "64bppYCC444AlphaFixedPoint";
-        default:
-            return NULL;        
-    }
+    for (i = 0; i < G_N_ELEMENTS(pixel_format_names); i++)
+        if (pixel_format_names[i].id == pixel_format->Data4[7])
+            return (gchar*)pixel_format_names[i].mnemonic;
+
+    return NULL;
 }
 
 // the following metadata helper functions have been copied from jxrlib as they are missing in libjxr Debian packages
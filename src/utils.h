@@ -5,11 +5,41 @@
 #include <JXRGlue.h>
 
 guint get_bits_per_pixel(const PKPixelFormatGUID* pixel_format);
-ERR convert_bw_indexed(const guchar* pixels, guint width, guint height, guchar** conv_pixels);
+void convert_bw_indexed(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride);
 void convert_indexed_bw(guchar* pixels, guint width, guint height);
 void convert_rgba_bgra(guchar* pixels, guint width, guint height);
+void compact_stride(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride, guint bytes_per_pixel);
+void downsample_box(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride, guint bytes_per_pixel, guint scale);
+void resample_area(const guchar* pixels, guint width, guint height, guint stride, guchar* conv_pixels, guint conv_width, guint conv_height, guint bytes_per_pixel);
 gboolean has_blackwhite_colormap(gint32 image_ID, gboolean* black_one);
 gchar* get_pixel_format_mnemonic(const PKPixelFormatGUID* pixel_format);
+ERR get_factories(PKFactory** factory, PKCodecFactory** codec_factory);
+void release_factories();
+guint64 get_env_size(const gchar* name, guint64 default_value);
+
+// Rows per band moved to or from GIMP, a multiple of the GIMP tile height
+#define TRANSFER_ROWS 256
+
+// Returned when the user cancels a load or save; outside jxrlib's error range
+#define ERR_CANCELLED (-1000)
+
+// Progress of a load or save, split into stages that each cover a part of the
+// progress bar. progress_update reports at most PROGRESS_STEPS updates per
+// image and returns FALSE once the user has cancelled. A NULL Progress (work
+// on worker threads) reports nothing and never cancels.
+#define PROGRESS_STEPS 100
+
+typedef struct
+{
+    gdouble     start;
+    gdouble     span;
+    gint        step;
+    gboolean    cancelled;
+} Progress;
+
+void progress_init(Progress* progress);
+void progress_set_stage(Progress* progress, gdouble start, gdouble span);
+gboolean progress_update(Progress* progress, gdouble fraction);
 
 typedef struct
 {
@@ -24,6 +54,8 @@ typedef struct
     guchar*           xmp_metadata;
     guint             xmp_metadata_size;
     gboolean          black_one;
+    gboolean          lossy_conversion;
+    gboolean          color_converted;    // pixels converted from color_context to sRGB
     guchar*           pixels;
 } Image;
 
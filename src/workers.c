@@ -0,0 +1,337 @@
+#include "workers.h"
+#include "utils.h"
+#include "trace.h"
+
+// All parallel work of the plug-in goes through one process-wide pool of
+// worker threads, so that loads, saves and batch procedures running at the
+// same time share one thread budget instead of each adding threads of their
+// own. The budget is GIMP_JXR_THREADS if set, otherwise GIMP's num-processors
+// preference, otherwise the number of processors. Work is submitted in task
+// groups; waiting on a group runs its queued tasks on the waiting thread as
+// well, so groups may be waited on from inside other tasks without
+// deadlocking the pool.
+//
+// Every pushed task puts a ticket naming its group on the deque of one
+// worker. Tasks pushed from a worker go to the front of its own deque, so
+// nested work stays with the thread that created it; tasks pushed from other
+// threads are dealt to the workers in turn. A worker takes tickets from the
+// front of its own deque and, once that is empty, steals from the back of the
+// others. A task pushed with an affinity is dealt to that worker, which runs
+// it before the other tasks of its group; another thread only takes it when
+// nothing else is left.
+
+typedef struct
+{
+    TaskFunc    func;
+    gpointer    data;
+    gint        affinity;       // preferred worker, -1 for any
+} Task;
+
+struct _TaskGroup
+{
+    GMutex      mutex;
+    GCond       cond;
+    GQueue      pending;
+    guint       running;
+    gint        ref_count;
+};
+
+typedef struct
+{
+    GMutex      mutex;
+    GQueue      tickets;        // TaskGroup*
+    gint        index;
+} Worker;
+
+static GMutex       pool_mutex;
+static GCond        pool_cond;
+static Worker*      workers = NULL;
+static guint        worker_count = 0;
+static guint        queued = 0;         // tickets on all deques
+static guint        next_worker = 0;    // worker that gets the next outside push
+static gint         steal_count = 0;
+
+static GPrivate     current_worker = G_PRIVATE_INIT(NULL);
+
+static guint get_thread_budget();
+static gpointer run_worker(gpointer data);
+static TaskGroup* take_ticket(Worker* worker);
+static void push_ticket(TaskGroup* group, gint affinity);
+static gboolean run_next_task(TaskGroup* group, gint worker);
+static void task_group_unref(TaskGroup* group);
+
+// Starts the workers. Called from the main thread before any procedure runs,
+// since the preference can only be queried from there.
+void workers_init()
+{
+    guint i;
+
+    g_mutex_lock(&pool_mutex);
+
+    if (workers == NULL)
+    {
+        worker_count = get_thread_budget();
+        workers = g_new0(Worker, worker_count);
+
+        for (i = 0; i < worker_count; i++)
+        {
+            g_mutex_init(&workers[i].mutex);
+            g_queue_init(&workers[i].tickets);
+            workers[i].index = i;
+        }
+
+        for (i = 0; i < worker_count; i++)
+            g_thread_unref(g_thread_new("file-jxr-worker", run_worker, &workers[i]));
+    }
+
+    g_mutex_unlock(&pool_mutex);
+}
+
+guint get_worker_count()
+{
+    workers_init();
+
+    return worker_count;
+}
+
+gint get_worker_index()
+{
+    Worker* worker = (Worker*)g_private_get(&current_worker);
+
+    return worker != NULL ? worker->index : -1;
+}
+
+TaskGroup* task_group_new()
+{
+    TaskGroup* group = g_new0(TaskGroup, 1);
+
+    g_mutex_init(&group->mutex);
+    g_cond_init(&group->cond);
+    g_queue_init(&group->pending);
+    group->ref_count = 1;
+
+    workers_init();
+
+    return group;
+}
+
+void task_group_push(TaskGroup* group, TaskFunc func, gpointer data)
+{
+    task_group_push_to(group, -1, func, data);
+}
+
+// Pushes a task that should run on worker (taken modulo the worker count),
+// for example one that works on buffers that worker filled; -1 for any
+void task_group_push_to(TaskGroup* group, gint worker, TaskFunc func, gpointer data)
+{
+    Task* task = g_new(Task, 1);
+
+    task->func = func;
+    task->data = data;
+    task->affinity = worker >= 0 ? worker % (gint)worker_count : -1;
+
+    g_mutex_lock(&group->mutex);
+    g_queue_push_tail(&group->pending, task);
+    g_mutex_unlock(&group->mutex);
+
+    g_atomic_int_inc(&group->ref_count);
+    push_ticket(group, task->affinity);
+}
+
+void task_group_wait(TaskGroup* group)
+{
+    while (run_next_task(group, get_worker_index()))
+        ;
+
+    g_mutex_lock(&group->mutex);
+
+    while (group->running > 0)
+        g_cond_wait(&group->cond, &group->mutex);
+
+    g_mutex_unlock(&group->mutex);
+}
+
+void task_group_free(TaskGroup* group)
+{
+    task_group_wait(group);
+    task_group_unref(group);
+}
+
+static guint get_thread_budget()
+{
+    guint64     count;
+    gchar*      value;
+
+    count = get_env_size("GIMP_JXR_THREADS", 0);
+
+    if (count == 0)
+    {
+        value = gimp_gimprc_query("num-processors");
+
+        if (value != NULL)
+            count = g_ascii_strtoull(value, NULL, 10);
+
+        g_free(value);
+    }
+
+    if (count == 0)
+        count = g_get_num_processors();
+
+    return (guint)CLAMP(count, 1, 256);
+}
+
+static gpointer run_worker(gpointer data)
+{
+    Worker*     worker = (Worker*)data;
+    TaskGroup*  group;
+
+    g_private_set(&current_worker, worker);
+
+    for (;;)
+    {
+        group = take_ticket(worker);
+
+        if (group != NULL)
+        {
+            run_next_task(group, worker->index);
+            task_group_unref(group);
+            continue;
+        }
+
+        g_mutex_lock(&pool_mutex);
+
+        while (queued == 0)
+            g_cond_wait(&pool_cond, &pool_mutex);
+
+        g_mutex_unlock(&pool_mutex);
+    }
+
+    return NULL;
+}
+
+// Takes a ticket from the front of the worker's own deque or, failing that,
+// from the back of another one. The count of queued tickets is changed under
+// the deque's lock, so a worker never sleeps while a ticket is waiting.
+static TaskGroup* take_ticket(Worker* worker)
+{
+    TaskGroup*  group;
+    Worker*     victim;
+    guint       i;
+
+    for (i = 0; i < worker_count; i++)
+    {
+        victim = &workers[(worker->index + i) % worker_count];
+
+        g_mutex_lock(&victim->mutex);
+
+        group = (TaskGroup*)(i == 0 ? g_queue_pop_head(&victim->tickets) : g_queue_pop_tail(&victim->tickets));
+
+        if (group != NULL)
+        {
+            g_mutex_lock(&pool_mutex);
+            queued--;
+            g_mutex_unlock(&pool_mutex);
+        }
+
+        g_mutex_unlock(&victim->mutex);
+
+        if (group != NULL)
+        {
+            if (i > 0)
+                trace_count("worker-steals", g_atomic_int_add(&steal_count, 1) + 1);
+
+            return group;
+        }
+    }
+
+    return NULL;
+}
+
+static void push_ticket(TaskGroup* group, gint affinity)
+{
+    gint        self = get_worker_index();
+    Worker*     worker;
+
+    if (affinity >= 0)
+        worker = &workers[affinity];
+    else if (self >= 0)
+        worker = &workers[self];
+    else
+    {
+        g_mutex_lock(&pool_mutex);
+        worker = &workers[next_worker++ % worker_count];
+        g_mutex_unlock(&pool_mutex);
+    }
+
+    g_mutex_lock(&worker->mutex);
+
+    if (worker->index == self)
+        g_queue_push_head(&worker->tickets, group);
+    else
+        g_queue_push_tail(&worker->tickets, group);
+
+    g_mutex_lock(&pool_mutex);
+    queued++;
+    g_cond_signal(&pool_cond);
+    g_mutex_unlock(&pool_mutex);
+
+    g_mutex_unlock(&worker->mutex);
+}
+
+// Runs one pending task of group, preferring one bound to worker, then one
+// bound to no worker, then any
+static gboolean run_next_task(TaskGroup* group, gint worker)
+{
+    Task*   task = NULL;
+    GList*  link;
+    GList*  unbound = NULL;
+
+    g_mutex_lock(&group->mutex);
+
+    for (link = group->pending.head; link != NULL; link = link->next)
+    {
+        Task* candidate = (Task*)link->data;
+
+        if (worker >= 0 && candidate->affinity == worker)
+            break;
+
+        if (unbound == NULL && candidate->affinity < 0)
+            unbound = link;
+    }
+
+    if (link == NULL)
+        link = unbound != NULL ? unbound : group->pending.head;
+
+    if (link == NULL)
+    {
+        g_mutex_unlock(&group->mutex);
+        return FALSE;
+    }
+
+    task = (Task*)link->data;
+    g_queue_delete_link(&group->pending, link);
+
+    group->running++;
+    g_mutex_unlock(&group->mutex);
+
+    task->func(task->data);
+    g_free(task);
+
+    g_mutex_lock(&group->mutex);
+    group->running--;
+    if (group->running == 0 && g_queue_is_empty(&group->pending))
+        g_cond_broadcast(&group->cond);
+    g_mutex_unlock(&group->mutex);
+
+    return TRUE;
+}
+
+static void task_group_unref(TaskGroup* group)
+{
+    if (g_atomic_int_dec_and_test(&group->ref_count))
+    {
+        g_mutex_clear(&group->mutex);
+        g_cond_clear(&group->cond);
+        g_free(group);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "file-jxr.h"
+
+typedef void (*TaskFunc)(gpointer data);
+
+typedef struct _TaskGroup TaskGroup;
+
+void workers_init();
+guint get_worker_count();
+gint get_worker_index();
+TaskGroup* task_group_new();
+void task_group_push(TaskGroup* group, TaskFunc func, gpointer data);
+void task_group_push_to(TaskGroup* group, gint worker, TaskFunc func, gpointer data);
+void task_group_wait(TaskGroup* group);
+void task_group_free(TaskGroup* group);
+
+#endif
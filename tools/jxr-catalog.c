@@ -0,0 +1,540 @@
+// Builds and queries a catalog of JPEG XR files.
+//
+//     jxr-catalog scan [-j N] CATALOG DIRECTORY...
+//     jxr-catalog query [filters] CATALOG
+//
+// scan walks the directories on a thread pool and reads only the container
+// and image headers of each .jxr, .wdp and .hdp file: size, pixel format,
+// resolution, tiling, bitstream order and the sizes of the embedded ICC
+// profile and XMP packet. No pixels are decoded. If CATALOG already exists,
+// files whose size and modification time match their entry are not opened
+// again, so a re-scan costs little more than the directory walk. Symbolic
+// links are not followed. The new catalog replaces the old one atomically.
+//
+// The catalog is a header, an array of fixed-size records sorted by path and
+// a table of NUL-terminated paths, all in host byte order. query maps it and
+// tests the records in place. Matching paths are printed one per line; with
+// --long each line also has the pixel format, width, height, tile columns,
+// tile rows, ICC profile size and XMP size, separated by tabs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <JXRGlue.h>
+
+#include "../src/pixelformats.h"
+
+#define CATALOG_MAGIC       "JXRCAT01"
+
+// Record.format of pixel formats outside the jxrlib family
+#define FORMAT_UNKNOWN      0xFF
+
+#define RECORD_UNREADABLE   0x01    // the headers could not be read
+#define RECORD_FREQUENCY    0x02    // frequency ordered bitstream (index table)
+
+typedef struct
+{
+    gchar       magic[8];
+    guint64     record_count;
+    guint64     paths_size;
+} CatalogHeader;
+
+typedef struct
+{
+    gint64      mtime;
+    guint64     file_size;
+    guint64     path_offset;
+    guint32     width;
+    guint32     height;
+    gfloat      resolution_x;
+    gfloat      resolution_y;
+    guint32     icc_size;
+    guint32     xmp_size;
+    guint16     tile_columns;
+    guint16     tile_rows;
+    guint8      format;         // last byte of the pixel format GUID
+    guint8      flags;
+    guint16     reserved;
+} Record;
+
+typedef struct
+{
+    GMappedFile*            file;
+    const CatalogHeader*    header;
+    const Record*           records;
+    const gchar*            paths;
+} Catalog;
+
+typedef struct
+{
+    GMutex          mutex;
+    GCond           cond;
+    guint           pending;        // directories queued or being listed
+    GThreadPool*    pool;
+    GHashTable*     previous;       // path -> Record of the existing catalog
+    GArray*         records;
+    GString*        paths;
+    guint64         read_count;
+    guint64         unreadable_count;
+} Scan;
+
+static gint         jobs = 0;
+static gchar*       format = NULL;
+static gboolean     tiled = FALSE;
+static gboolean     untiled = FALSE;
+static gboolean     index_table = FALSE;
+static gint64       min_pixels = 0;
+static gint64       max_pixels = 0;
+static gint         min_dimension = 0;
+static gboolean     with_icc = FALSE;
+static gboolean     with_xmp = FALSE;
+static gboolean     unreadable = FALSE;
+static gboolean     long_output = FALSE;
+
+static PKCodecFactory*  codec_factory;
+
+static GOptionEntry option_entries[] =
+{
+    { "jobs",           'j', 0, G_OPTION_ARG_INT,       &jobs,          "scan: Number of files read in parallel (default: 4 per processor)", "N" },
+    { "format",         'f', 0, G_OPTION_ARG_STRING,    &format,        "query: Pixel format, e.g. 128bppRGBAFloat", "NAME" },
+    { "tiled",          't', 0, G_OPTION_ARG_NONE,      &tiled,         "query: Images with more than one tile", NULL },
+    { "untiled",        'u', 0, G_OPTION_ARG_NONE,      &untiled,       "query: Images with a single tile", NULL },
+    { "index-table",    'x', 0, G_OPTION_ARG_NONE,      &index_table,   "query: Images in frequency order, with an index table", NULL },
+    { "min-pixels",     0,   0, G_OPTION_ARG_INT64,     &min_pixels,    "query: At least N pixels (width times height)", "N" },
+    { "max-pixels",     0,   0, G_OPTION_ARG_INT64,     &max_pixels,    "query: At most N pixels", "N" },
+    { "min-dimension",  'd', 0, G_OPTION_ARG_INT,       &min_dimension, "query: Width or height of at least N pixels", "N" },
+    { "icc",            0,   0, G_OPTION_ARG_NONE,      &with_icc,      "query: Images with an ICC profile", NULL },
+    { "xmp",            0,   0, G_OPTION_ARG_NONE,      &with_xmp,      "query: Images with XMP metadata", NULL },
+    { "unreadable",     0,   0, G_OPTION_ARG_NONE,      &unreadable,    "query: Files whose headers could not be read instead", NULL },
+    { "long",           'l', 0, G_OPTION_ARG_NONE,      &long_output,   "query: Print the properties of each file", NULL },
+    { NULL }
+};
+
+static int scan(const gchar* filename, gchar** directories, gint count);
+static int query(const gchar* filename);
+static gboolean open_catalog(const gchar* filename, Catalog* catalog);
+static const gchar* get_record_path(const Catalog* catalog, const Record* record);
+static gboolean write_catalog(const gchar* filename, GArray* records, const GString* paths);
+static void push_directory(Scan* scan, gchar* path);
+static void scan_directory(gpointer data, gpointer user_data);
+static gboolean is_jxr_file(const gchar* name);
+static void read_header(const gchar* filename, Record* record);
+static gint compare_paths(gconstpointer a, gconstpointer b, gpointer user_data);
+static gint get_format_id(const gchar* name);
+static const gchar* get_format_name(guint8 id);
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* context;
+    GError*         error = NULL;
+
+    context = g_option_context_new("scan CATALOG DIRECTORY... | query CATALOG - catalog JPEG XR files by their headers");
+    g_option_context_add_main_entries(context, option_entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (argc >= 4 && strcmp(argv[1], "scan") == 0)
+        return scan(argv[2], argv + 3, argc - 3);
+
+    if (argc == 3 && strcmp(argv[1], "query") == 0)
+        return query(argv[2]);
+
+    fprintf(stderr, "Usage: %s scan [-j N] CATALOG DIRECTORY...\n", argv[0]);
+    fprintf(stderr, "       %s query [filters] CATALOG\n", argv[0]);
+    return 1;
+}
+
+static int scan(const gchar* filename, gchar** directories, gint count)
+{
+    Scan        scan;
+    Catalog     previous;
+    gboolean    has_previous;
+    gint64      start;
+    guint64     i;
+
+    if (Failed(PKCreateCodecFactory(&codec_factory, WMP_SDK_VERSION)))
+    {
+        fprintf(stderr, "Could not initialize jxrlib.\n");
+        return 1;
+    }
+
+    start = g_get_monotonic_time();
+
+    g_mutex_init(&scan.mutex);
+    g_cond_init(&scan.cond);
+    scan.pending = 0;
+    scan.records = g_array_new(FALSE, FALSE, sizeof(Record));
+    scan.paths = g_string_new(NULL);
+    scan.read_count = 0;
+    scan.unreadable_count = 0;
+
+    // entries of the existing catalog are looked up by the workers; the table
+    // is not changed while they run
+    scan.previous = g_hash_table_new(g_str_hash, g_str_equal);
+    has_previous = g_file_test(filename, G_FILE_TEST_EXISTS) && open_catalog(filename, &previous);
+
+    if (has_previous)
+    {
+        for (i = 0; i < previous.header->record_count; i++)
+        {
+            const gchar* path = get_record_path(&previous, &previous.records[i]);
+
+            if (path != NULL)
+                g_hash_table_insert(scan.previous, (gpointer)path, (gpointer)&previous.records[i]);
+        }
+    }
+
+    // reading headers mostly waits for the disk
+    scan.pool = g_thread_pool_new(scan_directory, &scan, jobs > 0 ? jobs : 4 * (gint)g_get_num_processors(), FALSE, NULL);
+
+    for (i = 0; i < (guint64)count; i++)
+        push_directory(&scan, g_strdup(directories[i]));
+
+    g_mutex_lock(&scan.mutex);
+
+    while (scan.pending > 0)
+        g_cond_wait(&scan.cond, &scan.mutex);
+
+    g_mutex_unlock(&scan.mutex);
+
+    g_thread_pool_free(scan.pool, FALSE, TRUE);
+
+    g_array_sort_with_data(scan.records, compare_paths, scan.paths->str);
+
+    // the old catalog is no longer needed and has to be unmapped before it
+    // can be replaced on some systems
+    g_hash_table_destroy(scan.previous);
+
+    if (has_previous)
+        g_mapped_file_unref(previous.file);
+
+    if (!write_catalog(filename, scan.records, scan.paths))
+    {
+        fprintf(stderr, "Could not write %s.\n", filename);
+        return 1;
+    }
+
+    fprintf(stderr, "%u files, %" G_GUINT64_FORMAT " read, %" G_GUINT64_FORMAT " unchanged, %" G_GUINT64_FORMAT " unreadable, %.1f s\n",
+        scan.records->len, scan.read_count, scan.records->len - scan.read_count, scan.unreadable_count,
+        (g_get_monotonic_time() - start) / 1e6);
+
+    g_array_free(scan.records, TRUE);
+    g_string_free(scan.paths, TRUE);
+    g_mutex_clear(&scan.mutex);
+    g_cond_clear(&scan.cond);
+
+    codec_factory->Release(&codec_factory);
+
+    return 0;
+}
+
+static int query(const gchar* filename)
+{
+    Catalog     catalog;
+    gint        format_id = -1;
+    guint64     i;
+
+    if (format != NULL && (format_id = get_format_id(format)) < 0)
+    {
+        fprintf(stderr, "Unknown pixel format %s.\n", format);
+        return 1;
+    }
+
+    if (!open_catalog(filename, &catalog))
+    {
+        fprintf(stderr, "%s is not a readable catalog.\n", filename);
+        return 1;
+    }
+
+    for (i = 0; i < catalog.header->record_count; i++)
+    {
+        const Record*   record = &catalog.records[i];
+        const gchar*    path = get_record_path(&catalog, record);
+        guint64         pixels = (guint64)record->width * record->height;
+        guint           tiles = (guint)record->tile_columns * record->tile_rows;
+
+        if (path == NULL || ((record->flags & RECORD_UNREADABLE) != 0) != unreadable)
+            continue;
+
+        if (!unreadable &&
+            ((format_id >= 0 && record->format != format_id) ||
+             (tiled && tiles <= 1) ||
+             (untiled && tiles > 1) ||
+             (index_table && (record->flags & RECORD_FREQUENCY) == 0) ||
+             (min_pixels > 0 && pixels < (guint64)min_pixels) ||
+             (max_pixels > 0 && pixels > (guint64)max_pixels) ||
+             (min_dimension > 0 && MAX(record->width, record->height) < (guint32)min_dimension) ||
+             (with_icc && record->icc_size == 0) ||
+             (with_xmp && record->xmp_size == 0)))
+            continue;
+
+        if (long_output && !unreadable)
+            printf("%s\t%s\t%u\t%u\t%u\t%u\t%u\t%u\n", path, get_format_name(record->format),
+                record->width, record->height, record->tile_columns, record->tile_rows, record->icc_size, record->xmp_size);
+        else
+            printf("%s\n", path);
+    }
+
+    g_mapped_file_unref(catalog.file);
+
+    return 0;
+}
+
+static gboolean open_catalog(const gchar* filename, Catalog* catalog)
+{
+    const gchar*    data;
+    gsize           size;
+
+    catalog->file = g_mapped_file_new(filename, FALSE, NULL);
+
+    if (catalog->file == NULL)
+        return FALSE;
+
+    data = g_mapped_file_get_contents(catalog->file);
+    size = g_mapped_file_get_length(catalog->file);
+
+    catalog->header = (const CatalogHeader*)data;
+    catalog->records = (const Record*)(data + sizeof(CatalogHeader));
+    catalog->paths = data + sizeof(CatalogHeader);
+
+    if (size < sizeof(CatalogHeader) ||
+        memcmp(catalog->header->magic, CATALOG_MAGIC, sizeof(catalog->header->magic)) != 0 ||
+        catalog->header->record_count > (size - sizeof(CatalogHeader)) / sizeof(Record) ||
+        catalog->header->paths_size != size - sizeof(CatalogHeader) - catalog->header->record_count * sizeof(Record) ||
+        (catalog->header->paths_size > 0 && data[size - 1] != '\0'))
+    {
+        g_mapped_file_unref(catalog->file);
+        return FALSE;
+    }
+
+    catalog->paths += catalog->header->record_count * sizeof(Record);
+
+    return TRUE;
+}
+
+static const gchar* get_record_path(const Catalog* catalog, const Record* record)
+{
+    return record->path_offset < catalog->header->paths_size ? catalog->paths + record->path_offset : NULL;
+}
+
+// Writes a temporary file next to filename and renames it over filename, so
+// that a catalog being queried is never seen half written.
+static gboolean write_catalog(const gchar* filename, GArray* records, const GString* paths)
+{
+    CatalogHeader   header;
+    gchar*          temp_filename = g_strconcat(filename, ".tmp", NULL);
+    FILE*           file;
+    gboolean        written;
+
+    memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+    header.record_count = records->len;
+    header.paths_size = paths->len;
+
+    file = g_fopen(temp_filename, "wb");
+
+    if (file == NULL)
+    {
+        g_free(temp_filename);
+        return FALSE;
+    }
+
+    written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        (records->len == 0 || fwrite(records->data, sizeof(Record), records->len, file) == records->len) &&
+        (paths->len == 0 || fwrite(paths->str, 1, paths->len, file) == paths->len);
+
+    written = fclose(file) == 0 && written && g_rename(temp_filename, filename) == 0;
+
+    if (!written)
+        g_unlink(temp_filename);
+
+    g_free(temp_filename);
+
+    return written;
+}
+
+static void push_directory(Scan* scan, gchar* path)
+{
+    g_mutex_lock(&scan->mutex);
+    scan->pending++;
+    g_mutex_unlock(&scan->mutex);
+
+    g_thread_pool_push(scan->pool, path, NULL);
+}
+
+// Lists one directory, queues its subdirectories and catalogs its JPEG XR
+// files. The records are collected locally and added to the scan at the end,
+// so the lock is taken once per directory.
+static void scan_directory(gpointer data, gpointer user_data)
+{
+    gchar*          path = (gchar*)data;
+    Scan*           scan = (Scan*)user_data;
+    GDir*           dir;
+    const gchar*    name;
+    GArray*         records = g_array_new(FALSE, FALSE, sizeof(Record));
+    GString*        paths = g_string_new(NULL);
+    guint64         read_count = 0;
+    guint64         unreadable_count = 0;
+    guint           i;
+
+    dir = g_dir_open(path, 0, NULL);
+
+    while (dir != NULL && (name = g_dir_read_name(dir)) != NULL)
+    {
+        gchar*          filename = g_build_filename(path, name, NULL);
+        const Record*   previous;
+        Record          record;
+        GStatBuf        st;
+
+        if (g_lstat(filename, &st) != 0)
+        {
+            g_free(filename);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            push_directory(scan, filename);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode) || !is_jxr_file(name))
+        {
+            g_free(filename);
+            continue;
+        }
+
+        previous = (const Record*)g_hash_table_lookup(scan->previous, filename);
+
+        if (previous != NULL && previous->mtime == (gint64)st.st_mtime && previous->file_size == (guint64)st.st_size)
+            record = *previous;
+        else
+        {
+            memset(&record, 0, sizeof(record));
+            record.mtime = st.st_mtime;
+            record.file_size = st.st_size;
+
+            read_header(filename, &record);
+            read_count++;
+        }
+
+        if (record.flags & RECORD_UNREADABLE)
+            unreadable_count++;
+
+        record.path_offset = paths->len;
+        g_string_append_len(paths, filename, strlen(filename) + 1);
+        g_array_append_val(records, record);
+
+        g_free(filename);
+    }
+
+    if (dir != NULL)
+        g_dir_close(dir);
+
+    g_mutex_lock(&scan->mutex);
+
+    for (i = 0; i < records->len; i++)
+        g_array_index(records, Record, i).path_offset += scan->paths->len;
+
+    g_array_append_vals(scan->records, records->data, records->len);
+    g_string_append_len(scan->paths, paths->str, paths->len);
+    scan->read_count += read_count;
+    scan->unreadable_count += unreadable_count;
+
+    scan->pending--;
+    g_cond_signal(&scan->cond);
+
+    g_mutex_unlock(&scan->mutex);
+
+    g_array_free(records, TRUE);
+    g_string_free(paths, TRUE);
+    g_free(path);
+}
+
+// The extensions jxrlib picks a decoder by
+static gboolean is_jxr_file(const gchar* name)
+{
+    const gchar* extension = strrchr(name, '.');
+
+    return extension != NULL &&
+        (g_ascii_strcasecmp(extension, ".jxr") == 0 ||
+         g_ascii_strcasecmp(extension, ".wdp") == 0 ||
+         g_ascii_strcasecmp(extension, ".hdp") == 0);
+}
+
+// Creating the decoder parses the container and the image header; nothing
+// past them is read
+static void read_header(const gchar* filename, Record* record)
+{
+    ERR                 err;
+    PKImageDecode*      decoder = NULL;
+    PKPixelFormatGUID   pixel_format;
+    I32                 width, height;
+    Float               resolution_x, resolution_y;
+    U32                 size;
+
+    record->flags = RECORD_UNREADABLE;
+
+    Call(codec_factory->CreateDecoderFromFile(filename, &decoder));
+    Call(decoder->GetSize(decoder, &width, &height));
+    Call(decoder->GetPixelFormat(decoder, &pixel_format));
+    Call(decoder->GetResolution(decoder, &resolution_x, &resolution_y));
+
+    record->width = width;
+    record->height = height;
+    record->resolution_x = resolution_x;
+    record->resolution_y = resolution_y;
+    record->format = memcmp(&pixel_format, PIXEL_FORMAT_GUID_PREFIX, 15) == 0 ? pixel_format.Data4[7] : FORMAT_UNKNOWN;
+    record->tile_columns = decoder->WMP.wmiSCP.cNumOfSliceMinus1V + 1;
+    record->tile_rows = decoder->WMP.wmiSCP.cNumOfSliceMinus1H + 1;
+
+    size = 0;
+    Call(decoder->GetColorContext(decoder, NULL, &size));
+    record->icc_size = size;
+
+    size = 0;
+    Call(_PKImageDecode_GetXMPMetadata_WMP(decoder, NULL, &size));
+    record->xmp_size = size;
+
+    record->flags = decoder->WMP.wmiSCP.bfBitstreamFormat == FREQUENCY ? RECORD_FREQUENCY : 0;
+
+Cleanup:
+    if (decoder)
+        decoder->Release(&decoder);
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const gchar* paths = (const gchar*)user_data;
+
+    return strcmp(paths + ((const Record*)a)->path_offset, paths + ((const Record*)b)->path_offset);
+}
+
+static gint get_format_id(const gchar* name)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(pixel_format_names); i++)
+        if (g_ascii_strcasecmp(pixel_format_names[i].mnemonic, name) == 0)
+            return pixel_format_names[i].id;
+
+    return -1;
+}
+
+static const gchar* get_format_name(guint8 id)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(pixel_format_names); i++)
+        if (pixel_format_names[i].id == id)
+            return pixel_format_names[i].mnemonic;
+
+    return "unknown";
+}
@@ -0,0 +1,307 @@
+// Prints checksums of what jxrlib makes of a fixed set of images, so that two
+// builds of the library can be compared.
+//
+//     jxrlib-digest
+//
+// Every case generates the same test image (an odd size, gradients plus
+// noise from a fixed seed), encodes it in memory with the case's pixel
+// format, quantizer, overlap, subsampling, tiling and bitstream order, and
+// decodes it again through a format converter into the pixel format the
+// plug-in loads it as. One line per case gives the size of the encoded
+// stream and SHA-1 checksums of the stream and of the decoded pixels. The
+// cases cover lossless and lossy coding, planar alpha, 16-bit and floating
+// point formats and their conversion to 8 bits. The tool exits with status 1
+// if a case fails.
+//
+// make jxrlib-check builds the tool against the stock library and against
+// the one built for make optimized and fails if their output differs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <JXRGlue.h>
+
+#define IMAGE_WIDTH     517
+#define IMAGE_HEIGHT    389
+
+typedef enum
+{
+    SAMPLE_8,
+    SAMPLE_16,
+    SAMPLE_FLOAT
+} SampleType;
+
+typedef struct
+{
+    const gchar*                name;
+    const PKPixelFormatGUID*    pixel_format;
+    guint                       channels;
+    SampleType                  sample_type;
+    const PKPixelFormatGUID*    target_format;
+    guint                       target_bytes_per_pixel;
+    COLORFORMAT                 color_format;
+    guint8                      qp;
+    guint8                      alpha_qp;
+    OVERLAP                     overlap;
+    guint                       tile_size;          // in pixels, 0 = one tile
+    BITSTREAMFORMAT             bitstream_format;
+} DigestCase;
+
+static const DigestCase CASES[] =
+{
+    { "gray-lossless",      &GUID_PKPixelFormat8bppGray,        1, SAMPLE_8,     &GUID_PKPixelFormat8bppGray,  1, Y_ONLY,  1,  0,  OL_ONE,  0,   SPATIAL },
+    { "gray-tiles",         &GUID_PKPixelFormat8bppGray,        1, SAMPLE_8,     &GUID_PKPixelFormat8bppGray,  1, Y_ONLY,  40, 0,  OL_TWO,  128, FREQUENCY },
+    { "rgb-lossless",       &GUID_PKPixelFormat24bppRGB,        3, SAMPLE_8,     &GUID_PKPixelFormat24bppRGB,  3, YUV_444, 1,  0,  OL_ONE,  0,   SPATIAL },
+    { "rgb-420",            &GUID_PKPixelFormat24bppRGB,        3, SAMPLE_8,     &GUID_PKPixelFormat24bppRGB,  3, YUV_420, 60, 0,  OL_TWO,  0,   SPATIAL },
+    { "rgb-422-tiles",      &GUID_PKPixelFormat24bppRGB,        3, SAMPLE_8,     &GUID_PKPixelFormat24bppRGB,  3, YUV_422, 30, 0,  OL_ONE,  128, FREQUENCY },
+    { "rgb-444-no-overlap", &GUID_PKPixelFormat24bppRGB,        3, SAMPLE_8,     &GUID_PKPixelFormat24bppRGB,  3, YUV_444, 20, 0,  OL_NONE, 0,   SPATIAL },
+    { "bgra-alpha",         &GUID_PKPixelFormat32bppBGRA,       4, SAMPLE_8,     &GUID_PKPixelFormat32bppRGBA, 4, YUV_444, 20, 10, OL_ONE,  256, SPATIAL },
+    { "rgb48",              &GUID_PKPixelFormat48bppRGB,        3, SAMPLE_16,    &GUID_PKPixelFormat24bppRGB,  3, YUV_444, 30, 0,  OL_TWO,  0,   SPATIAL },
+    { "rgba-float",         &GUID_PKPixelFormat128bppRGBAFloat, 4, SAMPLE_FLOAT, &GUID_PKPixelFormat32bppRGBA, 4, YUV_444, 30, 30, OL_ONE,  0,   SPATIAL }
+};
+
+static PKFactory*       factory;
+static PKCodecFactory*  codec_factory;
+
+static gsize get_sample_size(SampleType sample_type);
+static void fill_pattern(const DigestCase* digest_case, guchar* pixels);
+static void set_codec_params(const DigestCase* digest_case, CWMIStrCodecParam* wmiSCP);
+static void set_tile_grid(guint tile_size, guint extent, U32* tiles, U32* num_tiles_minus1);
+static ERR encode(const DigestCase* digest_case, const guchar* pixels, guchar* buffer, gsize buffer_size, gsize* size);
+static ERR decode(const DigestCase* digest_case, guchar* buffer, gsize size, guchar* pixels);
+
+int main(int argc, char* argv[])
+{
+    gboolean    passed = TRUE;
+    guint       i;
+
+    if (Failed(PKCreateFactory(&factory, PK_SDK_VERSION)) || Failed(PKCreateCodecFactory(&codec_factory, WMP_SDK_VERSION)))
+    {
+        fprintf(stderr, "Could not initialize jxrlib.\n");
+        return 1;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(CASES); i++)
+    {
+        const DigestCase*   digest_case = &CASES[i];
+        gsize               raw_size = (gsize)IMAGE_WIDTH * IMAGE_HEIGHT * digest_case->channels * get_sample_size(digest_case->sample_type);
+        gsize               decoded_size = (gsize)IMAGE_WIDTH * IMAGE_HEIGHT * digest_case->target_bytes_per_pixel;
+        gsize               buffer_size = raw_size * 2 + 64 * 1024;
+        guchar*             pixels = g_malloc(raw_size);
+        guchar*             buffer = g_malloc(buffer_size);
+        guchar*             decoded = g_malloc0(decoded_size);
+        gchar*              stream_sum;
+        gchar*              pixel_sum;
+        gsize               size;
+        ERR                 err;
+
+        fill_pattern(digest_case, pixels);
+
+        err = encode(digest_case, pixels, buffer, buffer_size, &size);
+
+        if (!Failed(err))
+            err = decode(digest_case, buffer, size, decoded);
+
+        if (Failed(err))
+        {
+            printf("%-20s failed with error %d\n", digest_case->name, err);
+            passed = FALSE;
+        }
+        else
+        {
+            stream_sum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, buffer, size);
+            pixel_sum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, decoded, decoded_size);
+
+            printf("%-20s %8lu bytes  stream %s  pixels %s\n", digest_case->name, (gulong)size, stream_sum, pixel_sum);
+
+            g_free(pixel_sum);
+            g_free(stream_sum);
+        }
+
+        g_free(decoded);
+        g_free(buffer);
+        g_free(pixels);
+    }
+
+    return passed ? 0 : 1;
+}
+
+static gsize get_sample_size(SampleType sample_type)
+{
+    switch (sample_type)
+    {
+    case SAMPLE_16:
+        return 2;
+    case SAMPLE_FLOAT:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Smooth gradients that differ per channel, plus noise from a fixed seed, so
+// that all subbands carry coefficients. Alpha gets a gradient of its own.
+static void fill_pattern(const DigestCase* digest_case, guchar* pixels)
+{
+    guint32 seed = 12345;
+    gsize   i = 0;
+    guint   x, y, c;
+
+    for (y = 0; y < IMAGE_HEIGHT; y++)
+        for (x = 0; x < IMAGE_WIDTH; x++)
+            for (c = 0; c < digest_case->channels; c++)
+            {
+                guint noise;
+                guint value;
+
+                seed = seed * 1103515245 + 12345;
+                noise = seed >> 24;
+
+                if (c == 3)
+                    value = (x + y) * 255 / (IMAGE_WIDTH + IMAGE_HEIGHT);
+                else
+                    value = ((x * (c + 1) + y * (3 - c)) / 3 + (noise & 0x0F)) & 0xFF;
+
+                switch (digest_case->sample_type)
+                {
+                case SAMPLE_8:
+                    pixels[i] = (guchar)value;
+                    break;
+                case SAMPLE_16:
+                    ((guint16*)pixels)[i] = (guint16)(value << 8 | noise);
+                    break;
+                case SAMPLE_FLOAT:
+                    ((gfloat*)pixels)[i] = value / 255.0f + noise / 65536.0f;
+                    break;
+                }
+
+                i++;
+            }
+}
+
+static void set_codec_params(const DigestCase* digest_case, CWMIStrCodecParam* wmiSCP)
+{
+    memset(wmiSCP, 0, sizeof(*wmiSCP));
+
+    wmiSCP->bVerbose = FALSE;
+    wmiSCP->bdBitDepth = BD_LONG;
+    wmiSCP->bfBitstreamFormat = digest_case->bitstream_format;
+    wmiSCP->bProgressiveMode = TRUE;
+    wmiSCP->sbSubband = SB_ALL;
+    wmiSCP->uAlphaMode = digest_case->channels == 4 ? 2 : 0;
+    wmiSCP->cfColorFormat = digest_case->color_format;
+    wmiSCP->olOverlap = digest_case->overlap;
+
+    wmiSCP->uiDefaultQPIndex = digest_case->qp;
+    wmiSCP->uiDefaultQPIndexU = digest_case->qp;
+    wmiSCP->uiDefaultQPIndexV = digest_case->qp;
+    wmiSCP->uiDefaultQPIndexYHP = digest_case->qp;
+    wmiSCP->uiDefaultQPIndexUHP = digest_case->qp;
+    wmiSCP->uiDefaultQPIndexVHP = digest_case->qp;
+    wmiSCP->uiDefaultQPIndexAlpha = digest_case->alpha_qp;
+
+    if (digest_case->tile_size != 0)
+    {
+        set_tile_grid(digest_case->tile_size, IMAGE_HEIGHT, wmiSCP->uiTileY, &wmiSCP->cNumOfSliceMinus1H);
+        set_tile_grid(digest_case->tile_size, IMAGE_WIDTH, wmiSCP->uiTileX, &wmiSCP->cNumOfSliceMinus1V);
+    }
+}
+
+// Same layout as set_tile_grid in src/save.c: tile sizes in macroblocks
+static void set_tile_grid(guint tile_size, guint extent, U32* tiles, U32* num_tiles_minus1)
+{
+    guint i;
+    guint p = 0;
+
+    for (i = 0; i < MAX_TILES - 1; i++)
+    {
+        tiles[i] = tile_size / 16;
+        p += tile_size;
+        if (p >= extent)
+            break;
+    }
+
+    *num_tiles_minus1 = i;
+}
+
+static ERR encode(const DigestCase* digest_case, const guchar* pixels, guchar* buffer, gsize buffer_size, gsize* size)
+{
+    ERR                 err;
+    struct WMPStream*   stream = NULL;
+    PKImageEncode*      encoder = NULL;
+    CWMIStrCodecParam   wmiSCP;
+    size_t              pos;
+
+    Call(factory->CreateStreamFromMemory(&stream, buffer, buffer_size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpEncode, (void**)&encoder));
+
+    set_codec_params(digest_case, &wmiSCP);
+
+    Call(encoder->Initialize(encoder, stream, &wmiSCP, sizeof(wmiSCP)));
+
+    if (digest_case->channels == 4)
+        encoder->WMP.wmiSCP_Alpha.uiDefaultQPIndex = digest_case->alpha_qp;
+
+    Call(encoder->SetPixelFormat(encoder, *digest_case->pixel_format));
+    Call(encoder->SetSize(encoder, IMAGE_WIDTH, IMAGE_HEIGHT));
+    Call(encoder->SetResolution(encoder, 72.0f, 72.0f));
+    Call(encoder->WritePixels(encoder, IMAGE_HEIGHT, (U8*)pixels,
+        IMAGE_WIDTH * digest_case->channels * get_sample_size(digest_case->sample_type)));
+    Call(stream->GetPos(stream, &pos));
+
+    *size = pos;
+
+Cleanup:
+    // the encoder closes the stream once it has been initialized with it
+    if (encoder && encoder->pStream == stream)
+        encoder->Release(&encoder);
+    else
+    {
+        if (encoder)
+            encoder->Release(&encoder);
+
+        if (stream)
+            stream->Close(&stream);
+    }
+
+    return err;
+}
+
+// Decodes the way create_converter in src/load.c sets up the plug-in's loads
+static ERR decode(const DigestCase* digest_case, guchar* buffer, gsize size, guchar* pixels)
+{
+    ERR                 err;
+    struct WMPStream*   stream = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKFormatConverter*  converter = NULL;
+    PKRect              rect;
+
+    Call(factory->CreateStreamFromMemory(&stream, buffer, size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpDecode, (void**)&decoder));
+    Call(decoder->Initialize(decoder, stream));
+    Call(codec_factory->CreateFormatConverter(&converter));
+    Call(converter->Initialize(converter, decoder, NULL, *digest_case->target_format));
+
+    decoder->WMP.wmiSCP.uAlphaMode = IsEqualGUID(digest_case->target_format, &GUID_PKPixelFormat32bppRGBA) ? 2 : 0;
+
+    rect.X = 0;
+    rect.Y = 0;
+    rect.Width = IMAGE_WIDTH;
+    rect.Height = IMAGE_HEIGHT;
+
+    Call(converter->Copy(converter, &rect, pixels, IMAGE_WIDTH * digest_case->target_bytes_per_pixel));
+
+Cleanup:
+    if (converter)
+        converter->Release(&converter);
+
+    if (decoder)
+        decoder->Release(&decoder);
+
+    // decoders only own streams they opened themselves
+    if (stream)
+        stream->Close(&stream);
+
+    return err;
+}
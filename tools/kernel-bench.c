@@ -0,0 +1,446 @@
+// Checks and times the pixel kernels of src/utils.c.
+//
+//     kernel-bench [-r N] [-s SIZE]
+//
+// Every kernel is first run on odd widths (width % 8 != 0), a tall image and
+// buffers that start 0, 1 and 3 bytes past an aligned address, and its output
+// is compared byte for byte with a plain scalar reference. The tool stops
+// with exit status 1 at the first mismatch. The kernels are then timed on a
+// SIZE x SIZE image (4001 by default), best of N runs (5 by default), and
+// the cost is printed in cycles per pixel where a cycle counter is available
+// (x86) and in nanoseconds per pixel. get_bits_per_pixel is timed per call.
+//
+// Build with make kernel-bench.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/utils.h"
+#include "../src/pixelformats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#endif
+
+// Start offsets of the buffers under test from an aligned address
+static const guint OFFSETS[] = { 0, 1, 3 };
+
+static const guint WIDTHS[] = { 1, 3, 7, 9, 13, 31, 33, 255, 257, 1001 };
+
+// Tall enough that row addressing errors past 2^16 rows show up
+#define TALL_HEIGHT 70001
+#define TALL_WIDTH  9
+
+typedef void (*BenchFunc)(gpointer data);
+
+typedef struct
+{
+    const guchar*   src;
+    guchar*         dst;
+    guint           width;
+    guint           height;
+    guint           stride;
+    guint           bytes_per_pixel;
+} KernelArgs;
+
+static gint         runs = 5;
+static gint         size = 4001;
+
+static GOptionEntry option_entries[] =
+{
+    { "runs",   'r', 0, G_OPTION_ARG_INT,   &runs,  "Timed runs per kernel, the best one counts (default: 5)", "N" },
+    { "size",   's', 0, G_OPTION_ARG_INT,   &size,  "Width and height of the timed image (default: 4001)", "SIZE" },
+    { NULL }
+};
+
+static gboolean check_bw_indexed(guint width, guint height, guint offset);
+static gboolean check_indexed_bw(guint width, guint height, guint offset);
+static gboolean check_rgba_bgra(guint width, guint height, guint offset);
+static gboolean check_compact_stride(guint width, guint height, guint bytes_per_pixel, guint offset);
+static gboolean check_bits_per_pixel();
+static gboolean check_all(guint width, guint height);
+static void ref_bw_indexed(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride);
+static void ref_indexed_bw(const guchar* pixels, guchar* conv_pixels, guint width, guint height);
+static void ref_rgba_bgra(guchar* pixels, guint width, guint height);
+static void ref_compact_stride(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride, guint bytes_per_pixel);
+static guchar* alloc_misaligned(gsize size, guint offset, guchar** block);
+static void fill_random(guchar* data, gsize size, guint32 mask);
+static gboolean report(const gchar* kernel, guint width, guint height, guint offset, const guchar* a, const guchar* b, gsize size);
+static void bench(const gchar* kernel, BenchFunc func, gpointer data, guint64 count, const gchar* unit);
+static void bench_bw_indexed(gpointer data);
+static void bench_indexed_bw(gpointer data);
+static void bench_rgba_bgra(gpointer data);
+static void bench_compact_stride(gpointer data);
+static void bench_bits_per_pixel(gpointer data);
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* context;
+    GError*         error = NULL;
+    KernelArgs      args;
+    guchar*         src_block;
+    guchar*         dst_block;
+    guint           i;
+
+    context = g_option_context_new("- check and time the pixel kernels");
+    g_option_context_add_main_entries(context, option_entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (runs < 1 || size < 8)
+    {
+        fprintf(stderr, "Usage: %s [-r N] [-s SIZE]\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(WIDTHS); i++)
+        if (!check_all(WIDTHS[i], 37))
+            return 1;
+
+    if (!check_all(TALL_WIDTH, TALL_HEIGHT) || !check_bits_per_pixel())
+        return 1;
+
+    printf("All kernels match the scalar references.\n");
+
+    // odd size and misaligned buffers for timing as well
+    args.width = size | 1;
+    args.height = size;
+    args.stride = args.width * 4 + 3;
+    args.bytes_per_pixel = 4;
+    args.src = alloc_misaligned((gsize)args.stride * args.height, 1, &src_block);
+    args.dst = alloc_misaligned((gsize)args.stride * args.height, 3, &dst_block);
+
+    fill_random((guchar*)args.src, (gsize)args.stride * args.height, 0xFF);
+
+    bench("convert_bw_indexed", bench_bw_indexed, &args, (guint64)args.width * args.height, "pixel");
+
+    fill_random(args.dst, (gsize)args.width * args.height, 0x01);
+    bench("convert_indexed_bw", bench_indexed_bw, &args, (guint64)args.width * args.height, "pixel");
+
+    bench("convert_rgba_bgra", bench_rgba_bgra, &args, (guint64)args.width * args.height, "pixel");
+    bench("compact_stride", bench_compact_stride, &args, (guint64)args.width * args.height, "pixel");
+    bench("get_bits_per_pixel", bench_bits_per_pixel, NULL, G_N_ELEMENTS(pixel_format_names), "call");
+
+    g_free(src_block);
+    g_free(dst_block);
+
+    return 0;
+}
+
+static gboolean check_all(guint width, guint height)
+{
+    static const guint  BYTES_PER_PIXEL[] = { 1, 2, 3, 4, 6, 8, 16 };
+    guint               o, b;
+
+    for (o = 0; o < G_N_ELEMENTS(OFFSETS); o++)
+    {
+        if (!check_bw_indexed(width, height, OFFSETS[o]) ||
+            !check_indexed_bw(width, height, OFFSETS[o]) ||
+            !check_rgba_bgra(width, height, OFFSETS[o]))
+            return FALSE;
+
+        for (b = 0; b < G_N_ELEMENTS(BYTES_PER_PIXEL); b++)
+            if (!check_compact_stride(width, height, BYTES_PER_PIXEL[b], OFFSETS[o]))
+                return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean check_bw_indexed(guint width, guint height, guint offset)
+{
+    guint       stride = (width + 7) / 8 + 3;
+    gsize       size = (gsize)width * height;
+    guchar*     blocks[3];
+    guchar*     src = alloc_misaligned((gsize)stride * height, offset, &blocks[0]);
+    guchar*     dst = alloc_misaligned(size, offset, &blocks[1]);
+    guchar*     ref = alloc_misaligned(size, 0, &blocks[2]);
+    gboolean    ok;
+
+    fill_random(src, (gsize)stride * height, 0xFF);
+
+    convert_bw_indexed(src, dst, width, height, stride);
+    ref_bw_indexed(src, ref, width, height, stride);
+
+    ok = report("convert_bw_indexed", width, height, offset, dst, ref, size);
+
+    g_free(blocks[0]);
+    g_free(blocks[1]);
+    g_free(blocks[2]);
+
+    return ok;
+}
+
+static gboolean check_indexed_bw(guint width, guint height, guint offset)
+{
+    gsize       size = (gsize)width * height;
+    gsize       packed_size = (gsize)(width + 7) / 8 * height;
+    guchar*     blocks[2];
+    guchar*     pixels = alloc_misaligned(size, offset, &blocks[0]);
+    guchar*     ref = alloc_misaligned(packed_size, 0, &blocks[1]);
+    gboolean    ok;
+
+    fill_random(pixels, size, 0x01);
+
+    ref_indexed_bw(pixels, ref, width, height);
+    convert_indexed_bw(pixels, width, height);
+
+    ok = report("convert_indexed_bw", width, height, offset, pixels, ref, packed_size);
+
+    g_free(blocks[0]);
+    g_free(blocks[1]);
+
+    return ok;
+}
+
+static gboolean check_rgba_bgra(guint width, guint height, guint offset)
+{
+    gsize       size = (gsize)width * height * 4;
+    guchar*     blocks[2];
+    guchar*     pixels = alloc_misaligned(size, offset, &blocks[0]);
+    guchar*     ref = alloc_misaligned(size, 0, &blocks[1]);
+    gboolean    ok;
+
+    fill_random(pixels, size, 0xFF);
+    memcpy(ref, pixels, size);
+
+    convert_rgba_bgra(pixels, width, height);
+    ref_rgba_bgra(ref, width, height);
+
+    ok = report("convert_rgba_bgra", width, height, offset, pixels, ref, size);
+
+    g_free(blocks[0]);
+    g_free(blocks[1]);
+
+    return ok;
+}
+
+// Checks both the separate and the in-place form
+static gboolean check_compact_stride(guint width, guint height, guint bytes_per_pixel, guint offset)
+{
+    guint       stride = width * bytes_per_pixel + 5;
+    gsize       size = (gsize)stride * height;
+    gsize       packed_size = (gsize)width * bytes_per_pixel * height;
+    guchar*     blocks[3];
+    guchar*     src = alloc_misaligned(size, offset, &blocks[0]);
+    guchar*     dst = alloc_misaligned(packed_size, (offset + 1) % 4, &blocks[1]);
+    guchar*     ref = alloc_misaligned(packed_size, 0, &blocks[2]);
+    gboolean    ok;
+
+    fill_random(src, size, 0xFF);
+
+    ref_compact_stride(src, ref, width, height, stride, bytes_per_pixel);
+    compact_stride(src, dst, width, height, stride, bytes_per_pixel);
+
+    ok = report("compact_stride", width, height, offset, dst, ref, packed_size);
+
+    if (ok)
+    {
+        compact_stride(src, src, width, height, stride, bytes_per_pixel);
+        ok = report("compact_stride (in place)", width, height, offset, src, ref, packed_size);
+    }
+
+    g_free(blocks[0]);
+    g_free(blocks[1]);
+    g_free(blocks[2]);
+
+    return ok;
+}
+
+// The reference is the bit count in the mnemonic of every format whose name
+// starts with it; the YCC and CMYKDIRECT formats are internal to jxrlib and
+// left out
+static gboolean check_bits_per_pixel()
+{
+    PKPixelFormatGUID   pixel_format;
+    guint               expected;
+    guint               bits;
+    guint               i;
+
+    memcpy(&pixel_format, PIXEL_FORMAT_GUID_PREFIX, 15);
+
+    for (i = 0; i < G_N_ELEMENTS(pixel_format_names); i++)
+    {
+        const gchar* name = pixel_format_names[i].mnemonic;
+
+        if (strstr(name, "YCC") != NULL || strstr(name, "DIRECT") != NULL)
+            continue;
+
+        expected = strcmp(name, "BlackWhite") == 0 ? 1 : (guint)strtoul(name, NULL, 10);
+        pixel_format.Data4[7] = pixel_format_names[i].id;
+        bits = get_bits_per_pixel(&pixel_format);
+
+        if (bits != expected)
+        {
+            fprintf(stderr, "get_bits_per_pixel: %s returns %u, expected %u\n", name, bits, expected);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void ref_bw_indexed(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride)
+{
+    guint x, y;
+
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            conv_pixels[(gsize)y * width + x] = (pixels[(gsize)y * stride + x / 8] >> (7 - x % 8)) & 0x01;
+}
+
+static void ref_indexed_bw(const guchar* pixels, guchar* conv_pixels, guint width, guint height)
+{
+    guint   stride = (width + 7) / 8;
+    guint   x, y;
+
+    memset(conv_pixels, 0, (gsize)stride * height);
+
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            conv_pixels[(gsize)y * stride + x / 8] |= pixels[(gsize)y * width + x] << (7 - x % 8);
+}
+
+static void ref_rgba_bgra(guchar* pixels, guint width, guint height)
+{
+    gsize   count = (gsize)width * height;
+    gsize   i;
+    guchar  tmp;
+
+    for (i = 0; i < count; i++)
+    {
+        tmp = pixels[i * 4];
+        pixels[i * 4] = pixels[i * 4 + 2];
+        pixels[i * 4 + 2] = tmp;
+    }
+}
+
+static void ref_compact_stride(const guchar* pixels, guchar* conv_pixels, guint width, guint height, guint stride, guint bytes_per_pixel)
+{
+    gsize   row = (gsize)width * bytes_per_pixel;
+    gsize   i;
+    guint   y;
+
+    for (y = 0; y < height; y++)
+        for (i = 0; i < row; i++)
+            conv_pixels[y * row + i] = pixels[(gsize)y * stride + i];
+}
+
+// Returns a buffer of size bytes that starts offset bytes past a 64-byte
+// boundary; block is what has to be freed
+static guchar* alloc_misaligned(gsize size, guint offset, guchar** block)
+{
+    *block = g_malloc(size + 64 + offset);
+
+    return (guchar*)(((guintptr)*block + 63) & ~(guintptr)63) + offset;
+}
+
+static void fill_random(guchar* data, gsize size, guint32 mask)
+{
+    gsize i;
+
+    for (i = 0; i < size; i++)
+        data[i] = (guchar)(g_random_int() & mask);
+}
+
+static gboolean report(const gchar* kernel, guint width, guint height, guint offset, const guchar* a, const guchar* b, gsize size)
+{
+    gsize i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (a[i] != b[i])
+        {
+            fprintf(stderr, "%s: mismatch at byte %" G_GSIZE_FORMAT " for %u x %u at offset %u (0x%02X, expected 0x%02X)\n",
+                kernel, i, width, height, offset, a[i], b[i]);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void bench(const gchar* kernel, BenchFunc func, gpointer data, guint64 count, const gchar* unit)
+{
+    gint64      best_time = G_MAXINT64;
+    guint64     best_cycles = G_MAXUINT64;
+    gint64      time;
+    gint        i;
+
+    for (i = 0; i < runs; i++)
+    {
+#ifdef HAVE_CYCLES
+        guint64 cycles = __rdtsc();
+#endif
+        time = g_get_monotonic_time();
+
+        func(data);
+
+        time = g_get_monotonic_time() - time;
+        best_time = MIN(best_time, time);
+#ifdef HAVE_CYCLES
+        cycles = __rdtsc() - cycles;
+        best_cycles = MIN(best_cycles, cycles);
+#endif
+    }
+
+#ifdef HAVE_CYCLES
+    printf("%-20s %8.3f cycles/%-5s %8.3f ns/%s\n", kernel, (gdouble)best_cycles / count, unit, 1000.0 * best_time / count, unit);
+#else
+    printf("%-20s %8.3f ns/%s\n", kernel, 1000.0 * best_time / count, unit);
+#endif
+}
+
+static void bench_bw_indexed(gpointer data)
+{
+    KernelArgs* args = (KernelArgs*)data;
+
+    convert_bw_indexed(args->src, args->dst, args->width, args->height, (args->width + 7) / 8 + 3);
+}
+
+// Packs in place; runs after the first pack their own output again, which
+// takes the same work as packing 0/1 indices
+static void bench_indexed_bw(gpointer data)
+{
+    KernelArgs* args = (KernelArgs*)data;
+
+    convert_indexed_bw(args->dst, args->width, args->height);
+}
+
+static void bench_rgba_bgra(gpointer data)
+{
+    KernelArgs* args = (KernelArgs*)data;
+
+    convert_rgba_bgra(args->dst, args->width, args->height);
+}
+
+static void bench_compact_stride(gpointer data)
+{
+    KernelArgs* args = (KernelArgs*)data;
+
+    compact_stride(args->src, args->dst, args->width, args->height, args->stride, args->bytes_per_pixel);
+}
+
+// Counted per lookup instead of per pixel
+static void bench_bits_per_pixel(gpointer data)
+{
+    PKPixelFormatGUID   pixel_format;
+    volatile guint      bits;
+    guint               i;
+
+    memcpy(&pixel_format, PIXEL_FORMAT_GUID_PREFIX, 15);
+
+    for (i = 0; i < G_N_ELEMENTS(pixel_format_names); i++)
+    {
+        pixel_format.Data4[7] = pixel_format_names[i].id;
+        bits = get_bits_per_pixel(&pixel_format);
+    }
+}
@@ -0,0 +1,727 @@
+// Calibrates the quantizer tables in src/qptables.h on a corpus of images.
+//
+//     qp-calibrate [options] image... > src/qptables.h
+//
+// The images are JPEG XR files (preferably lossless) or binary PPM/PGM files.
+// For every row of the current tables, the tool encodes each image with QP
+// sets around the row, offsetting luma, chroma and highpass QPs by a triple
+// of steps, and decodes the results again to measure bits per pixel, PSNR and
+// SSIM. A metric's new row is the QP set with the best average score among
+// those that do not take more bits than the current row, so that a quality
+// setting keeps its file size and gains quality. All metrics are scored from
+// the same encodes. Encodes run in parallel on all processors.
+//
+// The tables are written to standard output and a report of old and new
+// rates and scores to standard error. Subsampling modes left out with -m keep
+// their current rows.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <JXRGlue.h>
+
+#include "../src/qptables.h"
+
+typedef enum
+{
+    METRIC_PSNR,
+    METRIC_SSIM
+} Metric;
+
+typedef struct
+{
+    guint       width;
+    guint       height;
+    guint       channels;
+    guchar*     pixels;
+} Picture;
+
+typedef struct
+{
+    guint8      qp[6];
+} QpSet;
+
+// Sums over the corpus for one table row and subsampling mode
+typedef struct
+{
+    GMutex      mutex;
+    guint       count;
+    QpSet*      candidates;
+    guint64*    bytes;
+    gdouble*    scores[QP_METRIC_COUNT];
+} Cell;
+
+typedef struct
+{
+    const Picture*  picture;
+    guint           subsampling;
+    guint           row;
+    Cell*           cell;
+} CalibrationTask;
+
+static const gchar* METRIC_NAMES[QP_METRIC_COUNT] = { "PSNR", "SSIM" };
+static const gchar* SUBSAMPLING_NAMES[QP_SUBSAMPLINGS] = { "Y-only", "4:2:0", "4:2:2", "4:4:4" };
+
+static gint         jobs = 0;
+static gint         radius = 6;
+static gint         step = 3;
+static gint         crop = 512;
+static gchar*       modes = "y,420,422,444";
+
+static PKFactory*       factory;
+static PKCodecFactory*  codec_factory;
+
+static GOptionEntry option_entries[] =
+{
+    { "jobs",   'j', 0, G_OPTION_ARG_INT,       &jobs,      "Number of parallel encodes (default: number of processors)", "N" },
+    { "radius", 'r', 0, G_OPTION_ARG_INT,       &radius,    "Largest QP offset tried around each row (default: 6)", "N" },
+    { "step",   's', 0, G_OPTION_ARG_INT,       &step,      "Step between QP offsets (default: 3)", "N" },
+    { "crop",   'c', 0, G_OPTION_ARG_INT,       &crop,      "Crop images to at most N x N pixels around their center, 0 to disable (default: 512)", "N" },
+    { "modes",  'm', 0, G_OPTION_ARG_STRING,    &modes,     "Subsampling modes to calibrate (default: y,420,422,444)", "LIST" },
+    { NULL }
+};
+
+static gboolean parse_modes(const gchar* list, gboolean* selected);
+static gboolean read_picture(const gchar* filename, Picture* picture);
+static gboolean read_pnm(const gchar* filename, Picture* picture);
+static ERR read_jxr(const gchar* filename, Picture* picture);
+static void crop_picture(Picture* picture, guint size);
+static void to_gray(const Picture* picture, Picture* gray);
+static void init_cell(Cell* cell, guint subsampling, guint row);
+static void add_candidates(GArray* candidates, const guint8* base, gboolean chroma);
+static void run_calibration_task(gpointer data, gpointer user_data);
+static void set_codec_params(CWMIStrCodecParam* wmiSCP, guint subsampling, guint row, const QpSet* qp_set);
+static ERR encode(const Picture* picture, guint subsampling, guint row, const QpSet* qp_set, guchar* buffer, gsize buffer_size, gsize* size);
+static ERR decode(guchar* buffer, gsize size, Picture* picture);
+static gdouble get_psnr(const Picture* a, const Picture* b);
+static gdouble get_ssim(const Picture* a, const Picture* b);
+static guint select_row(const Cell* cell, Metric metric, guint baseline);
+static void write_tables(const guint8 tables[QP_METRIC_COUNT][QP_SUBSAMPLINGS][QP_TABLE_ROWS][6], guint image_count);
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* context;
+    GError*         error = NULL;
+    gboolean        selected[QP_SUBSAMPLINGS];
+    Picture*        pictures;
+    Picture*        grays;
+    guint           picture_count;
+    guint64         pixels = 0;
+    Cell            cells[QP_SUBSAMPLINGS][QP_TABLE_ROWS];
+    guint8          tables[QP_METRIC_COUNT][QP_SUBSAMPLINGS][QP_TABLE_ROWS][6];
+    GThreadPool*    pool;
+    guint           i, s, r, m;
+
+    context = g_option_context_new("IMAGE... - calibrate the JPEG XR quantizer tables");
+    g_option_context_add_main_entries(context, option_entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (argc < 2 || radius < 0 || step < 1 || !parse_modes(modes, selected))
+    {
+        fprintf(stderr, "Usage: %s [options] image...\n", argv[0]);
+        return 1;
+    }
+
+    if (Failed(PKCreateFactory(&factory, PK_SDK_VERSION)) || Failed(PKCreateCodecFactory(&codec_factory, WMP_SDK_VERSION)))
+    {
+        fprintf(stderr, "Could not initialize jxrlib.\n");
+        return 1;
+    }
+
+    pictures = g_new0(Picture, argc - 1);
+    grays = g_new0(Picture, argc - 1);
+    picture_count = 0;
+
+    for (i = 1; i < (guint)argc; i++)
+    {
+        if (!read_picture(argv[i], &pictures[picture_count]))
+        {
+            fprintf(stderr, "Skipping %s: not a readable 8-bit image.\n", argv[i]);
+            continue;
+        }
+
+        if (crop > 0)
+            crop_picture(&pictures[picture_count], crop);
+
+        to_gray(&pictures[picture_count], &grays[picture_count]);
+        pixels += (guint64)pictures[picture_count].width * pictures[picture_count].height;
+        picture_count++;
+    }
+
+    if (picture_count == 0)
+    {
+        fprintf(stderr, "No images to calibrate with.\n");
+        return 1;
+    }
+
+    memcpy(tables, qp_tables, sizeof(tables));
+
+    pool = g_thread_pool_new(run_calibration_task, NULL, jobs > 0 ? jobs : (gint)g_get_num_processors(), FALSE, NULL);
+
+    for (s = 0; s < QP_SUBSAMPLINGS; s++)
+    {
+        if (!selected[s])
+            continue;
+
+        for (r = 0; r < QP_TABLE_ROWS; r++)
+        {
+            init_cell(&cells[s][r], s, r);
+
+            for (i = 0; i < picture_count; i++)
+            {
+                CalibrationTask* task = g_new(CalibrationTask, 1);
+
+                // Y-only is how grayscale images are coded, so it is
+                // calibrated on the luma of the corpus
+                task->picture = s == Y_ONLY ? &grays[i] : &pictures[i];
+                task->subsampling = s;
+                task->row = r;
+                task->cell = &cells[s][r];
+
+                g_thread_pool_push(pool, task, NULL);
+            }
+        }
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for (s = 0; s < QP_SUBSAMPLINGS; s++)
+    {
+        if (!selected[s])
+            continue;
+
+        for (m = 0; m < QP_METRIC_COUNT; m++)
+        {
+            fprintf(stderr, "%s, %s\n", METRIC_NAMES[m], SUBSAMPLING_NAMES[s]);
+
+            for (r = 0; r < QP_TABLE_ROWS; r++)
+            {
+                const Cell* cell = &cells[s][r];
+                guint       best = select_row(cell, (Metric)m, m);
+
+                fprintf(stderr, "  %4.1f: %6.3f bpp %8.4f -> %6.3f bpp %8.4f\n", r / 10.0,
+                    8.0 * cell->bytes[m] / pixels, cell->scores[m][m] / picture_count,
+                    8.0 * cell->bytes[best] / pixels, cell->scores[m][best] / picture_count);
+
+                memcpy(tables[m][s][r], cell->candidates[best].qp, 6);
+            }
+        }
+    }
+
+    write_tables((const guint8 (*)[QP_SUBSAMPLINGS][QP_TABLE_ROWS][6])tables, picture_count);
+
+    return 0;
+}
+
+static gboolean parse_modes(const gchar* list, gboolean* selected)
+{
+    gchar**     names = g_strsplit(list, ",", -1);
+    guint       i;
+    gboolean    valid;
+
+    memset(selected, 0, QP_SUBSAMPLINGS * sizeof(gboolean));
+
+    for (i = 0; names[i] != NULL; i++)
+    {
+        if (strcmp(names[i], "y") == 0)
+            selected[Y_ONLY] = TRUE;
+        else if (strcmp(names[i], "420") == 0)
+            selected[YUV_420] = TRUE;
+        else if (strcmp(names[i], "422") == 0)
+            selected[YUV_422] = TRUE;
+        else if (strcmp(names[i], "444") == 0)
+            selected[YUV_444] = TRUE;
+        else
+            break;
+    }
+
+    valid = i > 0 && names[i] == NULL;
+
+    g_strfreev(names);
+
+    return valid;
+}
+
+static gboolean read_picture(const gchar* filename, Picture* picture)
+{
+    if (g_str_has_suffix(filename, ".ppm") || g_str_has_suffix(filename, ".pgm") || g_str_has_suffix(filename, ".pnm"))
+        return read_pnm(filename, picture);
+    else
+        return !Failed(read_jxr(filename, picture));
+}
+
+static gboolean read_pnm(const gchar* filename, Picture* picture)
+{
+    FILE*   file = fopen(filename, "rb");
+    gchar   magic[3] = { 0 };
+    guint   max_value;
+    gsize   size;
+    gint    c;
+
+    if (file == NULL)
+        return FALSE;
+
+    if (fscanf(file, "%2s", magic) != 1 || (strcmp(magic, "P6") != 0 && strcmp(magic, "P5") != 0))
+    {
+        fclose(file);
+        return FALSE;
+    }
+
+    // skip comments between the header fields
+    while ((c = fgetc(file)) != EOF && (g_ascii_isspace(c) || c == '#'))
+        if (c == '#')
+            while ((c = fgetc(file)) != EOF && c != '\n');
+
+    ungetc(c, file);
+
+    if (fscanf(file, "%u %u %u", &picture->width, &picture->height, &max_value) != 3 || max_value != 255 ||
+        picture->width == 0 || picture->height == 0)
+    {
+        fclose(file);
+        return FALSE;
+    }
+
+    fgetc(file);
+
+    picture->channels = magic[1] == '6' ? 3 : 1;
+    size = (gsize)picture->width * picture->height * picture->channels;
+    picture->pixels = g_malloc(size);
+
+    if (fread(picture->pixels, 1, size, file) != size)
+    {
+        g_free(picture->pixels);
+        fclose(file);
+        return FALSE;
+    }
+
+    fclose(file);
+
+    return TRUE;
+}
+
+static ERR read_jxr(const gchar* filename, Picture* picture)
+{
+    ERR                 err;
+    PKImageDecode*      decoder = NULL;
+    PKFormatConverter*  converter = NULL;
+    PKRect              rect;
+    I32                 width, height;
+
+    Call(codec_factory->CreateDecoderFromFile(filename, &decoder));
+    Call(decoder->GetSize(decoder, &width, &height));
+    Call(codec_factory->CreateFormatConverter(&converter));
+    Call(converter->Initialize(converter, decoder, NULL, GUID_PKPixelFormat24bppRGB));
+
+    picture->width = width;
+    picture->height = height;
+    picture->channels = 3;
+    picture->pixels = g_malloc((gsize)width * height * 3);
+
+    rect.X = 0;
+    rect.Y = 0;
+    rect.Width = width;
+    rect.Height = height;
+
+    Call(converter->Copy(converter, &rect, picture->pixels, width * 3));
+
+Cleanup:
+    if (Failed(err) && picture->pixels != NULL)
+    {
+        g_free(picture->pixels);
+        picture->pixels = NULL;
+    }
+
+    if (converter)
+        converter->Release(&converter);
+
+    if (decoder)
+        decoder->Release(&decoder);
+
+    return err;
+}
+
+static void crop_picture(Picture* picture, guint size)
+{
+    guint   width = MIN(picture->width, size);
+    guint   height = MIN(picture->height, size);
+    guint   x = (picture->width - width) / 2;
+    guint   y = (picture->height - height) / 2;
+    guchar* pixels;
+    guint   i;
+
+    if (width == picture->width && height == picture->height)
+        return;
+
+    pixels = g_malloc((gsize)width * height * picture->channels);
+
+    for (i = 0; i < height; i++)
+        memcpy(pixels + (gsize)i * width * picture->channels,
+            picture->pixels + ((gsize)(y + i) * picture->width + x) * picture->channels,
+            (gsize)width * picture->channels);
+
+    g_free(picture->pixels);
+
+    picture->pixels = pixels;
+    picture->width = width;
+    picture->height = height;
+}
+
+static void to_gray(const Picture* picture, Picture* gray)
+{
+    gsize count = (gsize)picture->width * picture->height;
+    gsize i;
+
+    gray->width = picture->width;
+    gray->height = picture->height;
+    gray->channels = 1;
+    gray->pixels = g_malloc(count);
+
+    if (picture->channels == 1)
+        memcpy(gray->pixels, picture->pixels, count);
+    else
+        for (i = 0; i < count; i++)
+        {
+            const guchar* p = picture->pixels + i * 3;
+            gray->pixels[i] = (guchar)((299 * p[0] + 587 * p[1] + 114 * p[2] + 500) / 1000);
+        }
+}
+
+// The first candidate of a cell is the current row of each metric's table,
+// followed by the offsets around both rows.
+static void init_cell(Cell* cell, guint subsampling, guint row)
+{
+    GArray* candidates = g_array_new(FALSE, FALSE, sizeof(QpSet));
+    guint   m;
+
+    for (m = 0; m < QP_METRIC_COUNT; m++)
+    {
+        QpSet qp_set;
+
+        memcpy(qp_set.qp, qp_tables[m][subsampling][row], 6);
+        g_array_append_val(candidates, qp_set);
+    }
+
+    for (m = 0; m < QP_METRIC_COUNT; m++)
+        add_candidates(candidates, qp_tables[m][subsampling][row], subsampling != Y_ONLY);
+
+    g_mutex_init(&cell->mutex);
+    cell->count = candidates->len;
+    cell->candidates = (QpSet*)g_array_free(candidates, FALSE);
+    cell->bytes = g_new0(guint64, cell->count);
+
+    for (m = 0; m < QP_METRIC_COUNT; m++)
+        cell->scores[m] = g_new0(gdouble, cell->count);
+}
+
+// Adds the QP sets that offset the luma, chroma and highpass QPs of base by
+// multiples of step
+static void add_candidates(GArray* candidates, const guint8* base, gboolean chroma)
+{
+    gint    dy, dc, dh;
+    gint    i;
+
+    for (dy = -radius; dy <= radius; dy += step)
+        for (dc = chroma ? -radius : 0; dc <= (chroma ? radius : 0); dc += step)
+            for (dh = -radius; dh <= radius; dh += step)
+            {
+                QpSet qp_set;
+
+                if (dy == 0 && dc == 0 && dh == 0)
+                    continue;
+
+                for (i = 0; i < 6; i++)
+                {
+                    gint qp = base[i] + dy + (i % 3 != 0 ? dc : 0) + (i >= 3 ? dh : 0);
+                    qp_set.qp[i] = (guint8)CLAMP(qp, 1, 255);
+                }
+
+                g_array_append_val(candidates, qp_set);
+            }
+}
+
+static void run_calibration_task(gpointer data, gpointer user_data)
+{
+    CalibrationTask*    task = (CalibrationTask*)data;
+    Cell*               cell = task->cell;
+    gsize               raw_size = (gsize)task->picture->width * task->picture->height * task->picture->channels;
+    gsize               buffer_size = raw_size * 2 + 64 * 1024;
+    guchar*             buffer = g_malloc(buffer_size);
+    Picture             decoded = *task->picture;
+    guint64*            bytes = g_new0(guint64, cell->count);
+    gdouble*            scores[QP_METRIC_COUNT];
+    gsize               size;
+    guint               i, m;
+
+    decoded.pixels = g_malloc(raw_size);
+
+    for (m = 0; m < QP_METRIC_COUNT; m++)
+        scores[m] = g_new0(gdouble, cell->count);
+
+    for (i = 0; i < cell->count; i++)
+    {
+        if (Failed(encode(task->picture, task->subsampling, task->row, &cell->candidates[i], buffer, buffer_size, &size)) ||
+            Failed(decode(buffer, size, &decoded)))
+        {
+            // a failed encode must never be selected
+            bytes[i] = G_MAXUINT32;
+            continue;
+        }
+
+        bytes[i] = size;
+        scores[METRIC_PSNR][i] = get_psnr(task->picture, &decoded);
+        scores[METRIC_SSIM][i] = get_ssim(task->picture, &decoded);
+    }
+
+    g_mutex_lock(&cell->mutex);
+
+    for (i = 0; i < cell->count; i++)
+    {
+        cell->bytes[i] += bytes[i];
+
+        for (m = 0; m < QP_METRIC_COUNT; m++)
+            cell->scores[m][i] += scores[m][i];
+    }
+
+    g_mutex_unlock(&cell->mutex);
+
+    for (m = 0; m < QP_METRIC_COUNT; m++)
+        g_free(scores[m]);
+
+    g_free(bytes);
+    g_free(decoded.pixels);
+    g_free(buffer);
+    g_free(task);
+}
+
+// Matches apply_save_options in src/save.c for the quality of a table row,
+// including the overlap the "auto" setting picks there.
+static void set_codec_params(CWMIStrCodecParam* wmiSCP, guint subsampling, guint row, const QpSet* qp_set)
+{
+    gfloat quality = row <= 8 ? row / 10.0f : 0.8f + (row / 10.0f - 0.8f) / 1.5f;
+
+    memset(wmiSCP, 0, sizeof(*wmiSCP));
+
+    wmiSCP->bVerbose = FALSE;
+    wmiSCP->bdBitDepth = BD_LONG;
+    wmiSCP->bfBitstreamFormat = SPATIAL;
+    wmiSCP->bProgressiveMode = TRUE;
+    wmiSCP->sbSubband = SB_ALL;
+    wmiSCP->cfColorFormat = (COLORFORMAT)subsampling;
+    wmiSCP->olOverlap = quality >= 0.5f ? OL_ONE : OL_TWO;
+
+    wmiSCP->uiDefaultQPIndex    = qp_set->qp[0];
+    wmiSCP->uiDefaultQPIndexU   = qp_set->qp[1];
+    wmiSCP->uiDefaultQPIndexV   = qp_set->qp[2];
+    wmiSCP->uiDefaultQPIndexYHP = qp_set->qp[3];
+    wmiSCP->uiDefaultQPIndexUHP = qp_set->qp[4];
+    wmiSCP->uiDefaultQPIndexVHP = qp_set->qp[5];
+}
+
+static ERR encode(const Picture* picture, guint subsampling, guint row, const QpSet* qp_set, guchar* buffer, gsize buffer_size, gsize* size)
+{
+    ERR                 err;
+    struct WMPStream*   stream = NULL;
+    PKImageEncode*      encoder = NULL;
+    CWMIStrCodecParam   wmiSCP;
+    size_t              pos;
+
+    Call(factory->CreateStreamFromMemory(&stream, buffer, buffer_size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpEncode, (void**)&encoder));
+
+    set_codec_params(&wmiSCP, subsampling, row, qp_set);
+
+    Call(encoder->Initialize(encoder, stream, &wmiSCP, sizeof(wmiSCP)));
+    Call(encoder->SetPixelFormat(encoder, picture->channels == 1 ? GUID_PKPixelFormat8bppGray : GUID_PKPixelFormat24bppRGB));
+    Call(encoder->SetSize(encoder, picture->width, picture->height));
+    Call(encoder->SetResolution(encoder, 72.0f, 72.0f));
+    Call(encoder->WritePixels(encoder, picture->height, picture->pixels, picture->width * picture->channels));
+    Call(stream->GetPos(stream, &pos));
+
+    *size = pos;
+
+Cleanup:
+    // the encoder closes the stream once it has been initialized with it
+    if (encoder && encoder->pStream == stream)
+        encoder->Release(&encoder);
+    else
+    {
+        if (encoder)
+            encoder->Release(&encoder);
+
+        if (stream)
+            stream->Close(&stream);
+    }
+
+    return err;
+}
+
+static ERR decode(guchar* buffer, gsize size, Picture* picture)
+{
+    ERR                 err;
+    struct WMPStream*   stream = NULL;
+    PKImageDecode*      decoder = NULL;
+    PKRect              rect;
+
+    Call(factory->CreateStreamFromMemory(&stream, buffer, size));
+    Call(codec_factory->CreateCodec(&IID_PKImageWmpDecode, (void**)&decoder));
+    Call(decoder->Initialize(decoder, stream));
+
+    rect.X = 0;
+    rect.Y = 0;
+    rect.Width = picture->width;
+    rect.Height = picture->height;
+
+    Call(decoder->Copy(decoder, &rect, picture->pixels, picture->width * picture->channels));
+
+Cleanup:
+    if (decoder)
+        decoder->Release(&decoder);
+
+    // decoders only own streams they opened themselves
+    if (stream)
+        stream->Close(&stream);
+
+    return err;
+}
+
+static gdouble get_psnr(const Picture* a, const Picture* b)
+{
+    gsize   count = (gsize)a->width * a->height * a->channels;
+    gdouble sum = 0.0;
+    gsize   i;
+
+    for (i = 0; i < count; i++)
+    {
+        gint d = a->pixels[i] - b->pixels[i];
+        sum += d * d;
+    }
+
+    if (sum == 0.0)
+        return 99.0;
+
+    return 10.0 * log10(255.0 * 255.0 * count / sum);
+}
+
+// SSIM over 8 x 8 windows at a distance of 4 pixels, averaged over all
+// windows and channels
+static gdouble get_ssim(const Picture* a, const Picture* b)
+{
+    const gdouble   c1 = (0.01 * 255) * (0.01 * 255);
+    const gdouble   c2 = (0.03 * 255) * (0.03 * 255);
+    gsize           stride = (gsize)a->width * a->channels;
+    gdouble         total = 0.0;
+    guint           windows = 0;
+    guint           x, y, c, i, j;
+
+    if (a->width < 8 || a->height < 8)
+        return get_psnr(a, b) >= 99.0 ? 1.0 : 0.0;
+
+    for (y = 0; y + 8 <= a->height; y += 4)
+        for (x = 0; x + 8 <= a->width; x += 4)
+            for (c = 0; c < a->channels; c++)
+            {
+                gdouble sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+                gdouble ma, mb, va, vb, cov;
+
+                for (j = 0; j < 8; j++)
+                    for (i = 0; i < 8; i++)
+                    {
+                        gsize   offset = (y + j) * stride + (gsize)(x + i) * a->channels + c;
+                        gdouble pa = a->pixels[offset];
+                        gdouble pb = b->pixels[offset];
+
+                        sa += pa;
+                        sb += pb;
+                        saa += pa * pa;
+                        sbb += pb * pb;
+                        sab += pa * pb;
+                    }
+
+                ma = sa / 64;
+                mb = sb / 64;
+                va = saa / 64 - ma * ma;
+                vb = sbb / 64 - mb * mb;
+                cov = sab / 64 - ma * mb;
+
+                total += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+                windows++;
+            }
+
+    return total / windows;
+}
+
+// Returns the candidate with the best score for metric that does not take
+// more bytes than the current row; ties go to the smaller file.
+static guint select_row(const Cell* cell, Metric metric, guint baseline)
+{
+    guint best = baseline;
+    guint i;
+
+    for (i = 0; i < cell->count; i++)
+    {
+        if (cell->bytes[i] > cell->bytes[baseline])
+            continue;
+
+        if (cell->scores[metric][i] > cell->scores[metric][best] ||
+            (cell->scores[metric][i] == cell->scores[metric][best] && cell->bytes[i] < cell->bytes[best]))
+            best = i;
+    }
+
+    return best;
+}
+
+static void write_tables(const guint8 tables[QP_METRIC_COUNT][QP_SUBSAMPLINGS][QP_TABLE_ROWS][6], guint image_count)
+{
+    guint m, s, r;
+
+    printf("// Quantizer indices for Y, U, V, Y highpass, U highpass and V highpass at the\n");
+    printf("// quality steps 0.0, 0.1, ..., 1.1, per metric and chroma subsampling mode.\n");
+    printf("// Regenerate with tools/qp-calibrate instead of editing this file.\n");
+    printf("//\n");
+    printf("// Calibrated on %u images.\n", image_count);
+    printf("\n");
+    printf("#ifndef QPTABLES_H\n");
+    printf("#define QPTABLES_H\n");
+    printf("\n");
+    printf("#define QP_METRIC_COUNT     %d\n", QP_METRIC_COUNT);
+    printf("#define QP_SUBSAMPLINGS     %d\n", QP_SUBSAMPLINGS);
+    printf("#define QP_TABLE_ROWS       %d\n", QP_TABLE_ROWS);
+    printf("\n");
+    printf("static const guint8 qp_tables[QP_METRIC_COUNT][QP_SUBSAMPLINGS][QP_TABLE_ROWS][6] =\n");
+    printf("{\n");
+
+    for (m = 0; m < QP_METRIC_COUNT; m++)
+    {
+        printf("    { // %s\n", METRIC_NAMES[m]);
+
+        for (s = 0; s < QP_SUBSAMPLINGS; s++)
+        {
+            printf("        { // %s\n", SUBSAMPLING_NAMES[s]);
+
+            for (r = 0; r < QP_TABLE_ROWS; r++)
+            {
+                const guint8* qp = tables[m][s][r];
+
+                printf("            { %3u, %3u, %3u, %3u, %3u, %3u }%s\n", qp[0], qp[1], qp[2], qp[3], qp[4], qp[5],
+                    r + 1 < QP_TABLE_ROWS ? "," : "");
+            }
+
+            printf("        }%s\n", s + 1 < QP_SUBSAMPLINGS ? "," : "");
+        }
+
+        printf("    }%s\n", m + 1 < QP_METRIC_COUNT ? "," : "");
+    }
+
+    printf("};\n");
+    printf("\n");
+    printf("#endif\n");
+}
@@ -0,0 +1,253 @@
+// Checks region loads against a full load of the same file.
+//
+//     region-test
+//
+// Saves a lossless RGB image without tiles and a lossless RGBA image with
+// 256 pixel tiles to a temporary directory, then loads regions at the origin,
+// away from it across tile boundaries and at the bottom right edge, at scales
+// 1, 2 and 4. Every region is compared byte for byte with the same part of
+// the full load, scaled with the same box filter. Each region is loaded
+// without the tile cache, with an empty cache and with a filled one. The tool
+// stops with exit status 1 at the first mismatch or failed load.
+//
+// Build with make region-test; it links the plug-in sources but does not
+// need a running GIMP.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "../src/load.h"
+#include "../src/save.h"
+#include "../src/buffers.h"
+
+#define IMAGE_WIDTH     1100
+#define IMAGE_HEIGHT    900
+
+// x, y, width, height, scale; tiles are 256 pixels of the scaled image
+static const Region REGIONS[] =
+{
+    { 0, 0, 300, 200, 1 },
+    { 300, 270, 400, 300, 1 },
+    { 517, 601, 583, 299, 1 },
+    { 1000, 800, 500, 500, 1 },
+    { 260, 300, 700, 500, 2 },
+    { 770, 530, 330, 370, 4 }
+};
+
+static gboolean check_format(const gchar* dir, const PKPixelFormatGUID* pixel_format, guint bytes_per_pixel, TilingSetting tiling, const gchar* name);
+static gboolean check_region(const gchar* filename, const Image* full, const Region* region, const gchar* name, const gchar* pass);
+static void fill_pattern(Image* image, guint bytes_per_pixel);
+static void remove_tree(const gchar* path);
+
+int main(int argc, char* argv[])
+{
+    gchar*      dir;
+    gboolean    passed;
+
+    // sizes the worker pool without asking GIMP
+    g_setenv("GIMP_JXR_THREADS", "4", FALSE);
+
+    dir = g_dir_make_tmp("region-test-XXXXXX", NULL);
+
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Cannot create a temporary directory\n");
+        return 1;
+    }
+
+    passed = check_format(dir, &GUID_PKPixelFormat24bppRGB, 3, TILING_NONE, "RGB") &&
+        check_format(dir, &GUID_PKPixelFormat32bppBGRA, 4, TILING_256, "RGBA");
+
+    remove_tree(dir);
+    g_free(dir);
+
+    if (!passed)
+        return 1;
+
+    printf("All regions match the full load.\n");
+
+    return 0;
+}
+
+static gboolean check_format(const gchar* dir, const PKPixelFormatGUID* pixel_format, guint bytes_per_pixel, TilingSetting tiling, const gchar* name)
+{
+    static const gchar* passes[] = { "uncached", "cold cache", "warm cache" };
+
+    SaveOptions save_options = DEFAULT_SAVE_OPTIONS;
+    Image       source;
+    Image       full;
+    gchar*      filename;
+    gchar*      cache_dir;
+    gchar*      error_message = NULL;
+    gboolean    passed = FALSE;
+    guint       p, i;
+
+    memset(&source, 0, sizeof(source));
+    memset(&full, 0, sizeof(full));
+
+    filename = g_strdup_printf("%s/%s.jxr", dir, name);
+    cache_dir = g_strdup_printf("%s/%s-cache", dir, name);
+
+    source.width = IMAGE_WIDTH;
+    source.height = IMAGE_HEIGHT;
+    source.stride = IMAGE_WIDTH * bytes_per_pixel;
+    source.resolution_x = 72.0f;
+    source.resolution_y = 72.0f;
+    source.pixel_format = *pixel_format;
+    source.pixels = g_malloc((gsize)source.stride * source.height);
+
+    fill_pattern(&source, bytes_per_pixel);
+
+    save_options.image_quality = 100;
+    save_options.alpha_quality = 100;
+    save_options.tiling = tiling;
+
+    if (Failed(jxrlib_save(filename, &source, &save_options, NULL)))
+    {
+        fprintf(stderr, "%s: saving %s failed\n", name, filename);
+        goto Cleanup;
+    }
+
+    g_unsetenv("GIMP_JXR_TILE_CACHE");
+
+    if (Failed(jxrlib_load(filename, &full, &error_message, NULL)))
+    {
+        fprintf(stderr, "%s: loading %s failed: %s\n", name, filename, error_message != NULL ? error_message : "");
+        goto Cleanup;
+    }
+
+    for (p = 0; p < G_N_ELEMENTS(passes); p++)
+    {
+        if (p == 0)
+            g_unsetenv("GIMP_JXR_TILE_CACHE");
+        else
+            g_setenv("GIMP_JXR_TILE_CACHE", cache_dir, TRUE);
+
+        for (i = 0; i < G_N_ELEMENTS(REGIONS); i++)
+            if (!check_region(filename, &full, &REGIONS[i], name, passes[p]))
+                goto Cleanup;
+    }
+
+    passed = TRUE;
+
+Cleanup:
+    g_unsetenv("GIMP_JXR_TILE_CACHE");
+
+    g_free(source.pixels);
+
+    if (full.pixels != NULL)
+        buffer_free(&full.pixels);
+
+    g_free(full.color_context);
+    g_free(full.xmp_metadata);
+    g_free(error_message);
+    g_free(cache_dir);
+    g_free(filename);
+
+    return passed;
+}
+
+static gboolean check_region(const gchar* filename, const Image* full, const Region* region, const gchar* name, const gchar* pass)
+{
+    Image           image;
+    gchar*          error_message = NULL;
+    guchar*         scaled;
+    guint           bytes_per_pixel = full->stride / full->width;
+    guint           scaled_width = (full->width + region->scale - 1) / region->scale;
+    guint           scaled_height = (full->height + region->scale - 1) / region->scale;
+    guint           x0 = region->x / region->scale;
+    guint           y0 = region->y / region->scale;
+    guint           x1 = (MIN((guint)(region->x + region->width), full->width) + region->scale - 1) / region->scale;
+    guint           y1 = (MIN((guint)(region->y + region->height), full->height) + region->scale - 1) / region->scale;
+    gsize           scaled_stride = (gsize)scaled_width * bytes_per_pixel;
+    gboolean        passed = FALSE;
+    guint           y;
+
+    memset(&image, 0, sizeof(image));
+
+    scaled = g_malloc(scaled_stride * scaled_height);
+
+    if (region->scale > 1)
+        downsample_box(full->pixels, scaled, full->width, full->height, full->stride, bytes_per_pixel, region->scale);
+    else
+        memcpy(scaled, full->pixels, scaled_stride * scaled_height);
+
+    if (Failed(jxrlib_load_region(filename, region, &image, &error_message, NULL)))
+    {
+        fprintf(stderr, "%s, %s: region %d,%d %dx%d /%u failed to load: %s\n", name, pass,
+            region->x, region->y, region->width, region->height, region->scale, error_message != NULL ? error_message : "");
+        goto Cleanup;
+    }
+
+    if (image.width != x1 - x0 || image.height != y1 - y0 || image.stride != (x1 - x0) * bytes_per_pixel)
+    {
+        fprintf(stderr, "%s, %s: region %d,%d %dx%d /%u is %u x %u, expected %u x %u\n", name, pass,
+            region->x, region->y, region->width, region->height, region->scale, image.width, image.height, x1 - x0, y1 - y0);
+        goto Cleanup;
+    }
+
+    for (y = 0; y < image.height; y++)
+    {
+        if (memcmp(image.pixels + (gsize)y * image.stride, scaled + (gsize)(y0 + y) * scaled_stride + (gsize)x0 * bytes_per_pixel, image.stride) != 0)
+        {
+            fprintf(stderr, "%s, %s: region %d,%d %dx%d /%u differs from the full load in row %u\n", name, pass,
+                region->x, region->y, region->width, region->height, region->scale, y);
+            goto Cleanup;
+        }
+    }
+
+    passed = TRUE;
+
+Cleanup:
+    if (image.pixels != NULL)
+        buffer_free(&image.pixels);
+
+    g_free(image.color_context);
+    g_free(image.xmp_metadata);
+    g_free(error_message);
+    g_free(scaled);
+
+    return passed;
+}
+
+// Gives every pixel of a row and column a different value, so that regions
+// read from the wrong place do not match by accident. The channels of alpha
+// images are in GIMP's RGBA order, as jxrlib_save expects them.
+static void fill_pattern(Image* image, guint bytes_per_pixel)
+{
+    guint x, y, c;
+
+    for (y = 0; y < image->height; y++)
+    {
+        guchar* p = image->pixels + (gsize)y * image->stride;
+
+        for (x = 0; x < image->width; x++)
+            for (c = 0; c < bytes_per_pixel; c++)
+                *p++ = (guchar)(x * (c + 3) + y * (2 * c + 5) + (x >> 8) * 17 + (y >> 8) * 29);
+    }
+}
+
+static void remove_tree(const gchar* path)
+{
+    GDir*           dir;
+    const gchar*    name;
+    gchar*          child;
+
+    dir = g_dir_open(path, 0, NULL);
+
+    if (dir != NULL)
+    {
+        while ((name = g_dir_read_name(dir)) != NULL)
+        {
+            child = g_build_filename(path, name, NULL);
+            remove_tree(child);
+            g_free(child);
+        }
+
+        g_dir_close(dir);
+    }
+
+    g_remove(path);
+}